@@ -0,0 +1,179 @@
+#!/usr/bin/env bash
+# cchunks benchmark: compares I/O engines, buffer sizes and range shapes.
+#
+# Usage: bench/bench.sh [-b CCHUNKS] [-d WORKDIR] [-s SIZE_MB] [-j JSON_FILE]
+#                       [-e "ENGINES"] [-z "BUFSIZES"] [-w "WORKLOADS"] [-i "INPUTS"]
+#
+# Inputs (-i):    dense  - random data.
+#                 sparse - mostly holes, with some random data blocks.
+#                 cached - dense, after reading it once to the page cache.
+#                 cold   - dense, after dropping the page cache (needs root,
+#                          skipped otherwise).
+# Workloads (-w): huge    - one range of the whole file.
+#                 tiny    - 1M ranges of 16 bytes (via --batch, no argv limit).
+#                 overlap - 1M ranges which overlap half of the previous one.
+#                 reverse - 1M ranges from the end of the file to the start.
+# Baselines (dd/head/tail) run on the huge workload only, since they can't
+# do the others in one process.
+#
+# Prints a table to stdout and writes the results as JSON (default:
+# WORKDIR/bench_output.json). Syscalls are counted if strace is available.
+
+set -u
+
+CC=./cchunks
+WORK=${TMPDIR:-/tmp}/cchunks-bench
+SIZE_MB=256
+JSON=
+ENGINES=
+BUFSIZES="4K 64K 512K 4M auto"
+WORKLOADS="huge tiny overlap reverse"
+INPUTS="dense sparse cached cold"
+
+while getopts b:d:s:j:e:z:w:i:h opt; do
+    case $opt in
+        b) CC=$OPTARG ;;
+        d) WORK=$OPTARG ;;
+        s) SIZE_MB=$OPTARG ;;
+        j) JSON=$OPTARG ;;
+        e) ENGINES=$OPTARG ;;
+        z) BUFSIZES=$OPTARG ;;
+        w) WORKLOADS=$OPTARG ;;
+        i) INPUTS=$OPTARG ;;
+        *) sed -n '2,/^$/s/^# \{0,1\}//p' "$0"; exit 1 ;;
+    esac
+done
+
+[ -x "$CC" ] || { echo "cannot execute '$CC', use -b CCHUNKS" >&2; exit 1; }
+mkdir -p "$WORK" || exit 1
+JSON=${JSON:-$WORK/bench_output.json}
+SIZE=$((SIZE_MB * 1024 * 1024))
+OUT=$WORK/out.bin
+NR=1000000
+
+# engines which this cchunks binary supports
+if [ -z "$ENGINES" ]; then
+    ENGINES=$("$CC" --engine=none 2>&1 | sed -n 's/.*Available: //p')
+fi
+
+HAVE_STRACE=
+command -v strace >/dev/null 2>&1 && HAVE_STRACE=1
+
+drop_caches() {
+    sync && echo 3 2>/dev/null > /proc/sys/vm/drop_caches
+}
+
+make_inputs() {
+    local f=$WORK/dense.bin
+    if [ ! -f "$f" ] || [ "$(wc -c < "$f")" -ne "$SIZE" ]; then
+        head -c "$SIZE" /dev/urandom > "$f" || exit 1
+    fi
+
+    f=$WORK/sparse.bin
+    rm -f "$f"
+    truncate -s "$SIZE" "$f" 2>/dev/null || dd if=/dev/zero of="$f" bs=1 count=0 seek="$SIZE" 2>/dev/null
+    local i
+    for i in 0 1 2 3 4 5 6 7; do
+        dd if="$WORK/dense.bin" of="$f" bs=1M count=1 seek=$((i * SIZE_MB / 8)) conv=notrunc 2>/dev/null
+    done
+}
+
+# make_ranges WORKLOAD - writes the ranges of WORKLOAD to $WORK/WORKLOAD.ranges
+make_ranges() {
+    local r=$WORK/$1.ranges
+    case $1 in
+        huge)    echo ":" > "$r" ;;
+        tiny)    awk -v n=$NR -v s=$SIZE 'BEGIN { st = int(s / n); for (i = 0; i < n; i++) printf "%d:+16 ", i * st }' > "$r" ;;
+        overlap) awk -v n=$NR -v s=$SIZE 'BEGIN { l = int(s / n) * 2; printf "0:+%d ", l; for (i = 1; i < n; i++) printf "+-%d:+%d ", l / 2, l }' > "$r" ;;
+        reverse) awk -v n=$NR -v s=$SIZE 'BEGIN { l = int(s / n); for (i = 1; i <= n; i++) printf "-%d:+%d ", i * l, l }' > "$r" ;;
+        *)       echo "unknown workload '$1'" >&2; exit 1 ;;
+    esac
+}
+
+# prepare INPUT - prints the input file, or nothing if it should be skipped
+prepare() {
+    case $1 in
+        dense)  echo "$WORK/dense.bin" ;;
+        sparse) echo "$WORK/sparse.bin" ;;
+        cached) cat "$WORK/dense.bin" > /dev/null; echo "$WORK/dense.bin" ;;
+        cold)   drop_caches && echo "$WORK/dense.bin" ;;
+    esac
+}
+
+FIRST=1
+json_row() {
+    [ "$FIRST" = 1 ] && FIRST= || printf ',\n' >> "$JSON"
+    printf '  {"input": "%s", "workload": "%s", "tool": "%s", "bufsize": "%s", "bytes": %s, "ranges": %s, "wall_s": %s, "cpu_s": %s, "mb_s": %s, "ops_s": %s, "syscalls": %s}' \
+        "$@" >> "$JSON"
+}
+
+# run INPUT WORKLOAD TOOL BUFSIZE NRANGES CMD... - times CMD (which writes
+# $OUT) and reports a row
+run() {
+    local input=$1 workload=$2 tool=$3 bs=$4 nranges=$5
+    shift 5
+    local tf=$WORK/time.txt sf=$WORK/strace.txt
+    rm -f "$OUT"
+
+    local TIMEFORMAT='%R %U %S'
+    { time "$@" > /dev/null 2>&1; } 2> "$tf" || { echo "failed: $*" >&2; return; }
+    local wall user sys
+    read -r wall user sys < "$tf"
+
+    local bytes sc=null
+    bytes=$(wc -c < "$OUT")
+    if [ -n "$HAVE_STRACE" ]; then
+        rm -f "$OUT"
+        strace -f -c -o "$sf" "$@" > /dev/null 2>&1
+        sc=$(awk '$NF == "total" { print $(NF - 1) }' "$sf")
+        sc=${sc:-null}
+    fi
+
+    local cpu mbs ops
+    cpu=$(awk -v u="$user" -v s="$sys" 'BEGIN { printf "%.3f", u + s }')
+    mbs=$(awk -v b="$bytes" -v t="$wall" 'BEGIN { printf "%.1f", (t > 0 ? b / 1048576 / t : 0) }')
+    ops=$(awk -v n="$nranges" -v t="$wall" 'BEGIN { printf "%.0f", (t > 0 ? n / t : 0) }')
+
+    printf '%-7s %-8s %-23s %6s %12s %8s %8s %10s %12s %10s\n' \
+        "$input" "$workload" "$tool" "$bs" "$bytes" "$wall" "$cpu" "$mbs" "$ops" "${sc/null/-}"
+    json_row "$input" "$workload" "$tool" "$bs" "$bytes" "$nranges" "$wall" "$cpu" "$mbs" "$ops" "$sc"
+}
+
+make_inputs
+for w in $WORKLOADS; do make_ranges "$w"; done
+
+printf '[\n' > "$JSON"
+printf '%-7s %-8s %-23s %6s %12s %8s %8s %10s %12s %10s\n' \
+    input workload tool bufsize bytes wall_s cpu_s MB/s ops/s syscalls
+
+for input in $INPUTS; do
+    for w in $WORKLOADS; do
+        nranges=1
+        [ "$w" = huge ] || nranges=$NR
+
+        for e in $ENGINES; do
+            for bs in $BUFSIZES; do
+                f=$(prepare "$input")
+                [ -n "$f" ] || { echo "$input: skipped (cannot drop caches)" >&2; continue 4; }
+                # one --batch job, so the ranges don't need to fit in argv
+                printf '%s\t%s\t%s\n' "$f" "$OUT" "$(cat "$WORK/$w.ranges")" > "$WORK/job.txt"
+                run "$input" "$w" "cchunks-$e" "$bs" "$nranges" \
+                    "$CC" -f --engine="$e" --bufsize="$bs" --batch "$WORK/job.txt"
+            done
+        done
+
+        [ "$w" = huge ] || continue
+        for bs in $BUFSIZES; do
+            [ "$bs" = auto ] && continue  # cchunks only
+            f=$(prepare "$input")
+            run "$input" "$w" dd "$bs" 1 dd if="$f" of="$OUT" bs="$bs"
+        done
+        f=$(prepare "$input")
+        run "$input" "$w" head - 1 sh -c 'head -c "$1" "$2" > "$3"' sh "$SIZE" "$f" "$OUT"
+        f=$(prepare "$input")
+        run "$input" "$w" tail - 1 sh -c 'tail -c "$1" "$2" > "$3"' sh "$SIZE" "$f" "$OUT"
+    done
+done
+
+printf '\n]\n' >> "$JSON"
+echo "JSON: $JSON" >&2
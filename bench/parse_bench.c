@@ -0,0 +1,270 @@
+/*******************************************************************************
+*  cchunks range parser benchmark, with differential testing of the fast
+*  parser (atooff_fast/get_range) against the reference (atooff/get_range_ref).
+*
+*  Build: $CC -O2 bench/parse_bench.c -o parse_bench
+*  Usage: parse_bench [N_TOKENS]     (default: 10M)
+*
+*  First checks N_TOKENS random tokens from the whole grammar, including
+*  units, signs, overflowing values and invalid input, and exits with 1 on
+*  any mismatch. Then measures the throughput of both parsers.
+*******************************************************************************/
+
+#define main cchunks_main
+#include "../cchunks.c"
+#undef main
+
+#include <time.h>
+
+// get_range as it was before atooff_fast: strstr, strlen and atooff.
+static int get_range_ref(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
+{
+    if (!out || !str)
+        return 0;
+
+    char *sep = strstr(str, ":");
+    if (!sep)
+        return 0;
+
+    out->from = 0;
+    if (sep != str) {
+        int isfromback = 0;
+        int isfromskip = 0;
+        if (*str == '-') {
+            isfromback = 1;
+        } else if (*str == '+') {
+            isfromskip = 1;
+            str++;
+        }
+
+        cc_off_t val = 0;
+        if (!atooff(str, sep - str, isfromskip || isfromback, &val))
+            return 0;
+
+        if (isfromback) {
+            if (!add_safe(in_size, val, &out->from))
+                return 0;
+        } else if (isfromskip) {
+            if (!add_safe(prev_to, val, &out->from))
+                out->from = OFF_T_MAX;
+        } else {
+            out->from = val;
+        }
+
+        out->from = cc_crop(out->from, 0, in_size);
+    }
+
+    sep++;
+    out->to = in_size;
+    if (strlen(sep)) {
+        int istoback = 0;
+        int istolen = 0;
+        if (*sep == '-') {
+            istoback = 1;
+        } else if (*sep == '+') {
+            istolen = 1;
+            sep++;
+        }
+
+        cc_off_t val = 0;
+        if (!atooff(sep, strlen(sep), istoback, &val))
+            return 0;
+
+        if (istoback) {
+            if (!add_safe(in_size, val, &out->to))
+                return 0;
+        } else if (istolen) {
+            if (!add_safe(out->from, val, &out->to))
+                out->to = OFF_T_MAX;
+        } else {
+            out->to = val;
+        }
+
+        out->to = cc_crop(out->to, out->from, in_size);
+    }
+
+    return 1;
+}
+
+static uint64_t rnd_state = 88172645463325252ULL;
+static uint64_t rnd(void)
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 7;
+    rnd_state ^= rnd_state << 17;
+    return rnd_state;
+}
+
+static const char *edge_values[] = {
+    "0", "00000000000000000000001", "99999999", "100000000", "999999999999999999",
+    "1000000000000000000", "9223372036854775807", "9223372036854775808",
+    "9223372036854775806", "18446744073709551616", "8796093022207", "8796093022208",
+    "9007199254740991", "12345678", "123456789", "1234567812345678",
+};
+
+// writes a random value token (without a +/- prefix) to p, returns its end
+static char *rnd_value(char *p)
+{
+    int i, n;
+    switch (rnd() % 8) {
+        case 0:  // edge value
+            p += sprintf(p, "%s", edge_values[rnd() % (sizeof(edge_values) / sizeof(*edge_values))]);
+            break;
+        case 1:  // long, may overflow
+            for (n = 15 + rnd() % 8, i = 0; i < n; i++)
+                *p++ = '0' + rnd() % 10;
+            break;
+        default:
+            for (n = 1 + rnd() % 12, i = 0; i < n; i++)
+                *p++ = '0' + rnd() % 10;
+    }
+
+    switch (rnd() % 10) {
+        case 0: *p++ = "kmKM"[rnd() % 4]; break;
+        case 1: *p++ = "kmKM"[rnd() % 4]; break;
+        case 2: *p++ = "xgG+-: "[rnd() % 7]; break;       // invalid unit
+        case 3: if (rnd() % 4 == 0) p[-1 - rnd() % 2] = "k-x+"[rnd() % 4]; // garbage inside
+                break;
+    }
+    return p;
+}
+
+// writes a random range token to buf
+static void rnd_range(char *buf)
+{
+    char *p = buf;
+    if (rnd() % 6) {
+        int kind = rnd() % 4;
+        if (kind == 1)
+            *p++ = '-';
+        else if (kind == 2)
+            *p++ = '+', *p++ = rnd() % 2 ? '-' : '0' + rnd() % 10;
+        p = rnd_value(p);
+    }
+    if (rnd() % 30)
+        *p++ = ':';
+    if (rnd() % 6) {
+        int kind = rnd() % 4;
+        if (kind == 1)
+            *p++ = '-';
+        else if (kind == 2)
+            *p++ = '+';
+        else if (kind == 3 && rnd() % 4 == 0)
+            *p++ = '+', *p++ = '-';
+        p = rnd_value(p);
+    }
+    if (rnd() % 50 == 0)
+        *p++ = ':';
+    *p = 0;
+}
+
+static double now(void)
+{
+    return (double)clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+    long n = argc > 1 ? atol(argv[1]) : 10000000;
+    long i, mismatches = 0, valid = 0;
+    char tok[128];
+
+    if (n <= 0 || n > 100000000) {
+        fprintf(stderr, "Usage: parse_bench [N_TOKENS]   (1 .. 100M, default: 10M)\n");
+        return 1;
+    }
+
+    // differential testing, tokens are checked as ranges and as values
+    for (i = 0; i < n; i++) {
+        rnd_range(tok);
+        cc_off_t in_size = (cc_off_t)(rnd() % 4 ? rnd() % 100000000000ULL : rnd() >> 1);
+        cc_off_t prev_to = (cc_off_t)(rnd() % (uint64_t)(in_size + 1));
+        range_t a = {0, 0}, b = {0, 0};
+        int ra = get_range_ref(in_size, prev_to, tok, &a);
+        int rb = get_range(in_size, prev_to, tok, &b);
+        valid += ra;
+        if (ra != rb || (ra && (a.from != b.from || a.to != b.to))) {
+            if (mismatches++ < 20)
+                fprintf(stderr, "mismatch: range '%s' (size %lld, prev %lld): %d [%lld, %lld) vs %d [%lld, %lld)\n",
+                        tok, (long long)in_size, (long long)prev_to,
+                        ra, (long long)a.from, (long long)a.to, rb, (long long)b.from, (long long)b.to);
+        }
+
+        int len = (int)strlen(tok), neg = (int)(rnd() % 2);
+        cc_off_t va = 0, vb = 0;
+        ra = atooff(tok, len, neg, &va);
+        rb = atooff_fast(tok, len, neg, &vb);
+        if (ra != rb || (ra && va != vb)) {
+            if (mismatches++ < 20)
+                fprintf(stderr, "mismatch: value '%s' (neg %d): %d %lld vs %d %lld\n",
+                        tok, neg, ra, (long long)va, rb, (long long)vb);
+        }
+    }
+    printf("differential: %ld tokens (%ld valid ranges), %ld mismatches\n", n, valid, mismatches);
+    if (mismatches)
+        return 1;
+
+    // throughput, over typical valid ranges
+    const size_t count = (size_t)n;
+    char **toks = malloc(count * sizeof(char *));
+    char *pool = malloc(count * 32);
+    if (!toks || !pool)
+        return 1;
+    for (i = 0; i < n; i++) {
+        toks[i] = pool + i * 32;
+        switch (i % 4) {
+            case 0: sprintf(toks[i], "%llu:+%lluK", (unsigned long long)(rnd() % 100000000000ULL), (unsigned long long)(rnd() % 4096)); break;
+            case 1: sprintf(toks[i], "+%llu:+%llu", (unsigned long long)(rnd() % 100000), (unsigned long long)(rnd() % 100000)); break;
+            case 2: sprintf(toks[i], "-%lluM:", (unsigned long long)(rnd() % 100000)); break;
+            case 3: sprintf(toks[i], "%llu:%llu", (unsigned long long)(rnd() % 1000000000000ULL), (unsigned long long)(rnd() % 1000000000000ULL)); break;
+        }
+    }
+
+    struct {
+        const char *name;
+        int (*fn)(cc_off_t, cc_off_t, const char *, range_t *);
+    } parsers[] = {
+        { "get_range_ref (atooff)", get_range_ref },
+        { "get_range (atooff_fast)", get_range },
+    };
+
+    int p;
+    for (p = 0; p < 2; p++) {
+        cc_off_t sum = 0, prev_to = 0;
+        double t0 = now();
+        for (i = 0; i < n; i++) {
+            range_t r;
+            if (parsers[p].fn((cc_off_t)1 << 50, prev_to, toks[i], &r))
+                sum += r.to - r.from;
+            prev_to = r.to;
+        }
+        double t = now() - t0;
+        printf("%-24s %8.3f s  %8.1f M ranges/s  %6.1f ns/range  (sum %lld)\n",
+               parsers[p].name, t, t > 0 ? count / t / 1e6 : 0, t > 0 ? t * 1e9 / count : 0, (long long)sum);
+    }
+
+    struct {
+        const char *name;
+        int (*fn)(const char *, int, int, cc_off_t *);
+    } values[] = {
+        { "atooff", atooff },
+        { "atooff_fast", atooff_fast },
+    };
+
+    for (p = 0; p < 2; p++) {
+        cc_off_t sum = 0, v;
+        double t0 = now();
+        for (i = 0; i < n; i++) {
+            const char *s = toks[i] + (*toks[i] == '+' || *toks[i] == '-');
+            if (values[p].fn(s, (int)(strchr(s, ':') - s), 0, &v))
+                sum += v;
+        }
+        double t = now() - t0;
+        printf("%-24s %8.3f s  %8.1f M values/s  %6.1f ns/value  (sum %lld)\n",
+               values[p].name, t, t > 0 ? count / t / 1e6 : 0, t > 0 ? t * 1e9 / count : 0, (long long)sum);
+    }
+
+    free(pool);
+    free(toks);
+    return 0;
+}
@@ -27,6 +27,10 @@
 // #define _LARGEFILE_SOURCE
 // #define _LARGEFILE64_SOURCE
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE  // sendfile and other linux-specific APIs
+#endif
+
 #ifdef _WIN32
     #include "win_compat.h"
 #else
@@ -36,12 +40,43 @@
     #include <limits.h>
     #include <stdint.h>
     #include <sys/types.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+    #include <errno.h>
+    #include <time.h>
+    #include <fcntl.h>
+
+    #define CC_HAVE_PREAD
+    #include <sys/mman.h>
+    #include <sys/file.h>
+    #include <glob.h>
+    #define CC_HAVE_GLOB
+    #ifdef __linux__
+        #include <sys/sendfile.h>
+        #include <sys/syscall.h>
+        #include <sys/ioctl.h>
+        #include <sys/sysmacros.h>
+        #include <linux/fs.h>
+        #include <linux/fiemap.h>
+        #include <sys/uio.h>
+        #include <sys/inotify.h>
+        #include <poll.h>
+        #define CC_HAVE_SENDFILE
+        #define CC_HAVE_PREADV
+        #define CC_HAVE_SYNC_FILE_RANGE
+        #define CC_HAVE_FALLOCATE
+        #define CC_HAVE_INOTIFY
+        #ifdef SYS_copy_file_range
+            #define CC_HAVE_COPY_FILE_RANGE
+        #endif
+    #endif
 
     #define cc_off_t    off_t
     #define cc_fseek    fseeko
     #define cc_ftell    ftello
     #define cc_fopen    fopen
     #define cc_fprintf  fprintf
+    #define cc_getpid   getpid
 
     /**************************************************************************/
     // From: http://src.chromium.org/native_client/trunk/src/native_client/src/include/portability.h
@@ -72,13 +107,151 @@
     #endif
 #endif
 
+#ifdef CC_HAVE_ZLIB
+    #include <zlib.h>
+#endif
+#ifdef CC_HAVE_ZSTD
+    #include <zstd.h>
+#endif
+
+// Threads are used to run --batch and --each jobs concurrently, for --compress,
+// and for progress reports. Without them (e.g. -DCC_NO_THREADS, or Windows by
+// default) jobs run one after the other, and blocks are compressed in turn.
+
+#ifndef CC_NO_THREADS
+    #include <pthread.h>
+    #define cc_thread_t             pthread_t
+    #define cc_thread_create(t, f, a) pthread_create(t, NULL, f, a)
+    #define cc_thread_join(t)       pthread_join(t, NULL)
+    #define cc_mutex_t              pthread_mutex_t
+    #define cc_mutex_init(m)        pthread_mutex_init(m, NULL)
+    #define cc_mutex_destroy(m)     pthread_mutex_destroy(m)
+    #define cc_mutex_lock(m)        pthread_mutex_lock(m)
+    #define cc_mutex_unlock(m)      pthread_mutex_unlock(m)
+    #define cc_cond_t               pthread_cond_t
+    #define cc_cond_init(c)         pthread_cond_init(c, NULL)
+    #define cc_cond_destroy(c)      pthread_cond_destroy(c)
+    #define cc_cond_wait(c, m)      pthread_cond_wait(c, m)
+    #define cc_cond_broadcast(c)    pthread_cond_broadcast(c)
+    #define cc_flockfile(f)         flockfile(f)
+    #define cc_funlockfile(f)       funlockfile(f)
+    // counters which one thread updates and another reads
+    #if (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)) && \
+         !defined(__TINYC__)) || defined(__clang__)
+        #define cc_atomic_add(p, v) __atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+        #define cc_atomic_load(p)   __atomic_load_n(p, __ATOMIC_RELAXED)
+    #else
+        // without the builtins (e.g. tcc): with a lock. The counters are long long
+        static pthread_mutex_t cc_atomic_lock = PTHREAD_MUTEX_INITIALIZER;
+        static long long cc_atomic_op(long long *p, long long v)
+        {
+            pthread_mutex_lock(&cc_atomic_lock);
+            long long old = *p;
+            *p += v;
+            pthread_mutex_unlock(&cc_atomic_lock);
+            return old;
+        }
+        #define cc_atomic_add(p, v) cc_atomic_op(p, v)
+        #define cc_atomic_load(p)   cc_atomic_op(p, 0)
+    #endif
+#else
+    #define cc_mutex_t              int
+    #define cc_mutex_init(m)        (void)(m)
+    #define cc_mutex_destroy(m)     (void)(m)
+    #define cc_mutex_lock(m)        (void)(m)
+    #define cc_mutex_unlock(m)      (void)(m)
+    #define cc_cond_t               int
+    #define cc_cond_init(c)         (void)(c)
+    #define cc_cond_destroy(c)      (void)(c)
+    #define cc_cond_wait(c, m)      (void)(c)
+    #define cc_cond_broadcast(c)    (void)(c)
+    #define cc_flockfile(f)         (void)(f)
+    #define cc_funlockfile(f)       (void)(f)
+    #define cc_atomic_add(p, v)     (*(p) += (v))
+    #define cc_atomic_load(p)       (*(p))
+#endif
+
 
 #define CCVERSION "0.4.1"
 #define RW_BUFFSIZE (512 * 1024)
+#define RW_BUFFSIZE_MAX (1024 * 1024 * 1024)
+
+// --bufsize=auto (default): start from the files' block size and the device's
+// optimal I/O size, then if the output is at least TUNE_MIN_TOTAL, measure
+// TUNE_BYTES with each size while doubling (or halving) it, and keep the best.
+#define AUTO_MIN_BUFSIZE  (64 * 1024)
+#define AUTO_MAX_BUFSIZE  (16 * 1024 * 1024)
+#define TUNE_BYTES        (4 * 1024 * 1024)
+#define TUNE_MIN_TOTAL    (64 * 1024 * 1024)
+#define TUNE_GAIN         1.05  // a size should be 5% faster to be preferred
+
+// --max-rate/--max-iops: tokens can accumulate for up to THROTTLE_BURST
+// seconds, and a chunk is at most THROTTLE_BURST seconds worth of bytes, so
+// the I/O is spread evenly instead of in bursts.
+#define THROTTLE_BURST    0.01
+#define THROTTLE_MIN_IO   4096
 
-// -p prints percentage every PROGRESS_PER percent and '.' every PROGRESS_DOT
-#define PROGRESS_PER 20
-#define PROGRESS_DOT  2
+// Ranges of up to GATHER_MAX_PIECE bytes, in ascending order and with gaps of
+// up to GATHER_MAX_GAP between them, are read with one preadv per up to
+// GATHER_IOV pieces and gaps, and written in one call per GATHER_BUF bytes.
+#define GATHER_MAX_PIECE  (16 * 1024)
+#define GATHER_MAX_GAP    (64 * 1024)
+#define GATHER_IOV        256
+#define GATHER_BUF        (256 * 1024)
+
+// zero: ranges of at least this size are holes at output files
+#define GEN_HOLE_MIN      (64 * 1024)
+
+// Buffers of at least this size are backed by huge pages where possible
+#define HUGE_PAGE_SIZE    (2 * 1024 * 1024)
+
+#define PREFETCH_DEFAULT  (16 * 1024 * 1024)
+// Ranges to prefetch which are up to this far apart are advised as one span
+// (with the gap), rather than with a call each
+#define PREFETCH_MERGE_GAP (64 * 1024)
+
+// --nocache writes back and drops the output in windows of this size, so
+// at most about two windows of it are dirty at any time
+#define NOCACHE_WINDOW    (8 * 1024 * 1024)
+// Windows are aligned to this, since the cache can't drop part of a (large)
+// folio which crosses the edge of a window
+#define NOCACHE_ALIGN     HUGE_PAGE_SIZE
+
+// -o more than once: the other outputs are written from queues of blocks
+// of TEE_BLOCK bytes, and by default may lag up to TEE_LAG_DEFAULT behind
+#define TEE_BLOCK         (1024 * 1024)
+#define TEE_LAG_DEFAULT   (64 * 1024 * 1024)
+
+// --fields: the field buffers of a block of records are up to this size overall
+#define FIELDS_BUF        (4 * 1024 * 1024)
+#define FIELDS_MAX        64
+
+// -p and --progress-fd report every PROGRESS_MS, or every PROGRESS_LOG_MS
+// if stderr is not a terminal (one line per report instead of updating one)
+#define PROGRESS_MS      500
+#define PROGRESS_LOG_MS  5000
+
+// --batch: max number of worker threads, and how deep a worker looks into a
+// job queue for a job whose input device is below the --per-device limit.
+#define BATCH_MAX_JOBS  256
+#define BATCH_SCAN      64
+
+// --rescue: a read which fails is retried in halves, down to RESCUE_SECTOR
+// (a page of the cache, which is what a buffered read of a device fails by),
+// and the map is saved at most every RESCUE_SAVE_MS while copying.
+#define RESCUE_SECTOR   4096
+#define RESCUE_SAVE_MS  5000
+
+// --diff: the files are compared by threads, a segment of DIFF_SEG bytes at a
+// time, in reads of DIFF_CHUNK. Differences which are up to --diff-gap bytes
+// apart are one range.
+#define DIFF_SEG          (64 * 1024 * 1024)
+#define DIFF_CHUNK        (1024 * 1024)
+#define DIFF_GAP_DEFAULT  64
+
+// --follow: how often the input is looked at, also with inotify (which wakes
+// it on writes, but not when IN_FILE is another file)
+#define FOLLOW_POLL_MS    250
 
 // We don't have double-evaluations, so simple is OK. Caller should handle types if applicable
 #define cc_max(a, b) ((a) > (b) ? (a) : (b))
@@ -91,16 +264,517 @@ typedef struct {
     cc_off_t to;
 } range_t;
 
+// Resolves RANGE strings one at a time, in order (SKIP depends on the
+// previous range). RANGE*STRIDE#COUNT repetitions are resolved one at a time
+// too. It's a plain value, so a copy of it can be used to look ahead.
+typedef struct {
+    char **ranges;
+    int nranges;
+    int i;              // the next range
+    cc_off_t in_size;
+    cc_off_t prev_to;
+
+    // the last repetition of ranges[i - 1], and how many are left (-1: up
+    // to IN_SIZE). nrep is its index, 0 for the first or a plain range.
+    range_t rep;
+    cc_off_t rep_len;
+    cc_off_t stride;
+    cc_off_t reps;
+    cc_off_t nrep;
+
+    // GEN_*: the last range is generated (zero:, fill: or hex:), and isn't
+    // of the input: it's [0, LENGTH), and SKIP isn't relative to it.
+    int gen;
+    int fill;           // GEN_FILL: the byte
+    const char *hex;    // GEN_HEX: the digits
+
+    const char *at;     // --patch: OFFSET of RANGE@OFFSET, else NULL
+} range_iter_t;
+
+// --sync: when the output is flushed to the disk
+enum {
+    SYNC_NONE,
+    SYNC_END,
+    SYNC_RANGE,     // also orders them: a range is on the disk before the next
+};
+
+// --rescue: what is known of an area of the output
+enum {
+    RESCUE_UNKNOWN, // not read yet
+    RESCUE_GOOD,
+    RESCUE_BAD,     // cannot be read, zeros at the output
+};
+
+enum {
+    GEN_NONE,
+    GEN_ZERO,
+    GEN_FILL,
+    GEN_HEX,
+};
+
+typedef struct vcat_s vcat_t;
+typedef struct rescue_s rescue_t;
+
+// --prefetch: advises the kernel to read ahead the input of the next ranges,
+// up to depth bytes (of output) ahead of the copy.
+typedef struct {
+    vcat_t *vcat;       // if the input is several files
+    range_iter_t it;
+    range_t cur;        // cur.from advances as it's advised
+    cc_off_t ahead;     // output offset which was advised up to
+    cc_off_t depth;     // 0: done
+} prefetch_t;
+
+// How a chunk is copied from the input to the output. The kernel engines
+// fall back to pread for the rest of the job if the files don't support them.
+enum {
+    ENGINE_STDIO,
+    ENGINE_PREAD,
+    ENGINE_SENDFILE,
+    ENGINE_COPY_FILE_RANGE,
+};
+
+static const struct {
+    const char *name;
+    int available;
+} engines[] = {
+    { "stdio", 1 },
+#ifdef CC_HAVE_PREAD
+    { "pread", 1 },
+#else
+    { "pread", 0 },
+#endif
+#ifdef CC_HAVE_SENDFILE
+    { "sendfile", 1 },
+#else
+    { "sendfile", 0 },
+#endif
+#ifdef CC_HAVE_COPY_FILE_RANGE
+    { "copy_file_range", 1 },
+#else
+    { "copy_file_range", 0 },
+#endif
+    { NULL, 0 }
+};
+
+// --compress output formats. Both are written as a sequence of independent
+// frames/members of COMPRESS_BLOCK input bytes, which standard tools accept.
+enum {
+    COMPRESS_NONE,
+    COMPRESS_GZIP,
+    COMPRESS_ZSTD,
+};
+
+static const struct {
+    const char *name;
+    int available;
+    int level;          // default
+    int max_level;
+} compressors[] = {
+    { "none", 1, 0, 0 },
+#ifdef CC_HAVE_ZLIB
+    { "gzip", 1, 6, 9 },
+#else
+    { "gzip", 0, 6, 9 },
+#endif
+#ifdef CC_HAVE_ZSTD
+    { "zstd", 1, 3, 22 },
+#else
+    { "zstd", 0, 3, 22 },
+#endif
+    { NULL, 0, 0, 0 }
+};
+
+#define COMPRESS_BLOCK    (1024 * 1024)
+
+typedef struct zsink_s zsink_t;
+typedef struct zsrc_s zsrc_t;
+typedef struct tee_s tee_t;
+typedef struct fields_s fields_t;
+
+// --stats: latency histogram with log2 buckets of nanoseconds, bucket i
+// counts latencies at [2^i, 2^(i+1)).
+#define HIST_BUCKETS 48
+
+typedef struct {
+    uint64_t count;
+    uint64_t max_ns;
+    uint64_t bucket[HIST_BUCKETS];
+} lat_hist_t;
+
+typedef struct {
+    cc_off_t from;
+    cc_off_t to;
+    cc_off_t bytes;     // copied, of all the repetitions
+    uint64_t reads;     // I/O calls which read (or copy, with kernel engines),
+    uint64_t writes;    // once for each range of a gathered read or write
+} range_stats_t;
+
+typedef struct {
+    uint64_t open_ns;       // stat/open of the input and creating the output
+    uint64_t resolve_ns;    // validating and resolving the ranges
+    uint64_t copy_ns;
+    uint64_t close_ns;
+
+    lat_hist_t read;
+    lat_hist_t write;
+    lat_hist_t copy;        // sendfile/copy_file_range: read and write at once
+
+    range_stats_t *ranges;  // one per range
+    range_stats_t *cur;     // the range which is copied now
+} job_stats_t;
+
+// -p/--progress-fd: the copy loop only adds to done, and a reporter thread
+// (or the copy loop, without threads) reports it every PROGRESS_MS.
+typedef struct {
+    long long done;         // atomic
+    long long total;
+    int text;               // -p, to stderr
+    int fd;                 // --progress-fd, NDJSON, or -1
+    int tty;                // stderr is a terminal
+
+    uint64_t start_ns;
+    uint64_t last_ns;
+    long long last_done;
+    uint64_t last_text_ns;
+
+#ifndef CC_NO_THREADS
+    cc_thread_t thread;
+    cc_mutex_t lock;
+    cc_cond_t cond;
+    int stop;
+    int running;
+#endif
+} progress_t;
+
+// --bufsize=auto tuning state. size is 0 when done (or not tuning).
+typedef struct {
+    size_t size;        // being measured now
+    size_t min, max;
+    size_t first;
+    size_t best;
+    double best_rate;
+    int dir;            // 1: doubling, -1: halving
+    uint64_t t0;
+    long long bytes;
+} io_tuner_t;
+
+// Token buckets for --max-rate and --max-iops, shared by all the jobs. The
+// tokens may go negative: each I/O takes its tokens and then sleeps until
+// the bucket is out of debt, so concurrent jobs are spaced correctly too.
+typedef struct {
+    double rate;        // bytes per second, 0: unlimited
+    double iops;        // I/O calls per second, 0: unlimited
+    double bytes;       // tokens
+    double ops;
+    uint64_t last_ns;
+    size_t max_io;
+    cc_mutex_t lock;
+} throttle_t;
+
+// --nocache state of a job. Output offsets are of the output file.
+typedef struct {
+    int in_fd;          // -1: the input isn't dropped
+    vcat_t *vcat;       // if the input is several files
+    int out_fd;         // -1 if the output isn't seekable (pipe)
+    cc_off_t out_base;  // where the job started writing
+    cc_off_t out_from;  // window which is being written back
+    cc_off_t out_to;
+    range_t in;         // consumed input which wasn't dropped yet
+} nocache_t;
+
+// Options which apply to every job of a run.
+typedef struct {
+    int verbose;
+    int overwrite;
+    int progress;
+    int dummy;
+    int engine;
+    size_t bufsize;     // 0: auto
+    int stats;          // --stats=json
+    int progress_fd;    // -1 if not set
+    throttle_t *throttle; // NULL if unlimited
+    cc_off_t prefetch;  // bytes, 0: disabled
+    int nocache;
+    int compress;       // COMPRESS_*
+    int compress_level;
+    int compress_threads; // 0: compress in the job's thread
+    int decompress;     // the input is compressed
+    cc_off_t tee_lag;   // bytes which each of the other outputs may lag
+    cc_off_t record_size; // --record, if nfields (or else of key: ranges)
+    cc_off_t key_at;    // key: ranges, the key's offset at a line or a record
+    int nfields;        // --fields, of the records
+    range_t fields[FIELDS_MAX];
+    int manifest;       // write the plan instead of the data
+    int patch;          // write into the existing output, at RANGE@OFFSET
+    int sync;           // SYNC_*
+    int in_place;       // the ranges are the new content of the input file
+    int follow;         // then copy what's appended to the input
+    const char *rescue; // if set, continue past read errors, with this map of the output
+    const char *diff;   // if set, write where the input differs from this file
+    cc_off_t diff_gap;
+} cc_opts_t;
+
+// One (input, output, ranges) copy. A single invocation is one job, --batch
+// runs one job per manifest line.
+typedef struct {
+    const cc_opts_t *opts;
+    const char *in_name;
+    char **in_names;    // if set, nin_names (> 1) input files, in_name is the first
+    int nin_names;
+    const char *out_name;
+    char **tee_names;   // -o more than once: ntee_names other outputs
+    int ntee_names;
+    char **ranges;
+    int nranges;
+    int line;           // --batch: manifest line number
+
+    // Optional. If in_file is set, it's used as-is with in_size (not closed).
+    // buf (buf_size bytes) is used if big enough, else one is allocated. With
+    // keep_buf, an allocated one then replaces buf (which is freed), to reuse.
+    FILE *in_file;
+    cc_off_t in_size;
+    char *buf;
+    size_t buf_size;
+    int keep_buf;
+
+    // --each to one output: out_file is shared (not closed), and the job
+    // writes its output as one frame while it holds out_lock.
+    FILE *out_file;
+    cc_mutex_t *out_lock;
+
+    size_t io_size;     // bytes per I/O call, --bufsize or chosen by auto
+    int out_pos;        // the writes go to out_at (not with stdio), else they append
+    cc_off_t out_at;
+
+    int engine;         // initially opts->engine, may fall back to pread
+    zsink_t *zsink;     // if opts->compress. Set by run_job
+    zsrc_t *zsrc;       // if opts->decompress. Set by run_job
+    vcat_t *vcat;       // if in_names. Set by run_job
+    tee_t *tee;         // if tee_names. Set by run_job
+    fields_t *fields;   // if opts->nfields. Set by run_job
+    rescue_t *rescue;   // if opts->rescue. Set by run_job
+    job_stats_t *stats; // if opts->stats. Set by run_job
+
+    // --batch: index of the input device, for the --per-device limit
+    int dev;
+
+    // results
+    cc_off_t copied;
+    int started;        // inputs were valid and output was created
+    char err[256];      // set if run_job fails
+} job_t;
+
 void usage(void); // short
 void help(void);  // full
 cc_off_t fsize(const char* fname);
+FILE *open_input(const char *fname, cc_off_t *out_size);
+FILE *open_output(const char *fname, int overwrite, char *err, size_t errlen);
+FILE *open_patch_output(const char *fname, char *err, size_t errlen);
+int out_sync(FILE *out_file, int data_only);
+int range_out_at(const range_iter_t *it, cc_off_t out_size, cc_off_t prev_end, cc_off_t *out);
+int run_in_place(job_t *job);
+rescue_t *rescue_open(const char *map_name, cc_off_t out_size, char *err, size_t errlen);
+int rescue_resumed(const rescue_t *r);
+cc_off_t rescue_bytes(const rescue_t *r, int state);
+int rescue_copy(job_t *job, FILE *in_file, FILE *out_file, char *buf, cc_off_t at, size_t len, cc_off_t out);
+int rescue_retry(job_t *job, FILE *in_file, FILE *out_file, char *buf, size_t buf_size);
+int rescue_close(rescue_t *r, int save);
+int run_diff(job_t *job, int nthreads);
+int keys_resolve(job_t *job, FILE *in_file, cc_off_t in_size);
+int follow_input(job_t *job, FILE **in_file, FILE *out_file, char *buf, size_t buf_size, cc_off_t at);
 int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out);
+void range_iter_init(range_iter_t *it, char **ranges, int nranges, cc_off_t in_size);
+int range_next(range_iter_t *it, range_t *out);
+void prefetch_advance(prefetch_t *pf, FILE *in_file, cc_off_t done);
+int add_safe(cc_off_t a, cc_off_t b, cc_off_t *out);
+int atooff(const char *str, int length, int allow_neg, cc_off_t *outval);
+int atooff_fast(const char *str, int length, int allow_neg, cc_off_t *outval);
+int run_job(job_t *job);
+void tuner_start(io_tuner_t *t, size_t size, size_t blksize);
+void tuner_update(job_t *job, io_tuner_t *t, size_t got);
+int copy_chunk(job_t *job, FILE *in_file, FILE *out_file, char *buf, cc_off_t at, size_t len);
+int gather_copy(job_t *job, FILE *in_file, FILE *out_file, char *buf, size_t buf_size,
+                char *gap, range_iter_t *it, const range_t *first, range_t *span, size_t *got);
+uint64_t cc_now_ns(void);
+char *iobuf_alloc(size_t size);
+void iobuf_free(char *buf, size_t size);
+size_t io_size_hint(FILE *in_file, FILE *out_file, size_t *blksize, size_t *optimal);
+void throttle_init(throttle_t *t, double rate, double iops);
+size_t throttle(throttle_t *t, size_t len, int calls);
+void cc_sleep_ns(uint64_t ns);
+int out_preallocate(FILE *out_file, cc_off_t size);
+void out_unreserve(FILE *out_file, cc_off_t size);
+long out_extents(FILE *out_file);
+void nocache_start(nocache_t *nc, FILE *in_file, FILE *out_file);
+void nocache_update(nocache_t *nc, FILE *out_file, cc_off_t in_at, size_t len, cc_off_t done);
+void nocache_finish(nocache_t *nc, FILE *out_file, cc_off_t done);
+void print_stats(const job_t *job, int ok);
+int cc_ncpus(void);
+zsink_t *zsink_open(const cc_opts_t *opts, FILE *out_file, tee_t *tee);
+int zsink_write(zsink_t *z, const char *buf, size_t len);
+cc_off_t zsink_written(const zsink_t *z);
+int zsink_close(zsink_t *z, int finish, cc_off_t *written);
+zsrc_t *zsrc_open(FILE *in_file, const char *in_name, cc_off_t file_size, int opt_verbose,
+                  cc_off_t *size, char *err, size_t errlen);
+int zsrc_read(zsrc_t *s, char *buf, size_t len, cc_off_t at);
+void zsrc_close(zsrc_t *s);
+tee_t *tee_open(const cc_opts_t *opts, char **names, int n, cc_off_t size, char *err, size_t errlen);
+int tee_write(tee_t *t, const char *buf, size_t len);
+const char *tee_failed(const tee_t *t);
+int tee_close(tee_t *t, int finish, const char **failed);
+fields_t *fields_open(const cc_opts_t *opts, const char *out_tmpl, const char *in_name,
+                      cc_off_t nrec, char *err, size_t errlen);
+int fields_write(fields_t *f, const char *buf, size_t len);
+const char *fields_failed(const fields_t *f);
+int fields_close(fields_t *f, int finish, const char **failed);
+int manifest_write(job_t *job, FILE *out_file, cc_off_t in_size, cc_off_t out_size);
+int gen_write(job_t *job, FILE *out_file, char *buf, size_t buf_size, const range_iter_t *it,
+              cc_off_t len, int holes);
+vcat_t *vcat_open(char **names, int n, FILE *first, cc_off_t *size, char *err, size_t errlen);
+int vcat_copy(job_t *job, FILE *out_file, char *buf, cc_off_t at, size_t len);
+void vcat_advise(vcat_t *v, cc_off_t at, cc_off_t len, int advice);
+void vcat_close(vcat_t *v);
+void progress_start(progress_t *p, long long total, int text, int fd);
+void progress_poll(progress_t *p);
+void progress_stop(progress_t *p, int ok);
+void progress_failed(int fd, long long total);
+int run_batch(const cc_opts_t *opts, const char *manifest, int njobs, int per_device);
+int run_each(const cc_opts_t *opts, const char *list, int is_glob, const char *out_tmpl,
+             char **ranges, int nranges, int njobs, int per_device);
+int each_per_input(const char *out_tmpl);
 
 #define VERBOSE(...)  { if (opt_verbose) cc_fprintf(stderr, __VA_ARGS__); }
 #define ERR_EXIT(...) { cc_fprintf(stderr, "Error: ");   \
                         cc_fprintf(stderr, __VA_ARGS__); \
                         cc_fprintf(stderr, "\n");        \
                         goto exit_L; }
+// --stats: STAT_T0 starts timing an I/O call, and STAT_OP adds it to hist
+#define STAT_T0()     uint64_t stat_t0_ = job->stats ? cc_now_ns() : 0
+#define STAT_OP(hist) { if (job->stats) stats_op(job->stats, &job->stats->hist, stat_t0_); }
+#define STAT_PHASE(phase, t0) { if (job->stats) job->stats->phase += cc_now_ns() - (t0); }
+// Like ERR_EXIT, but keeps the message at job->err instead of printing it
+#define JOB_ERR(...)  { snprintf(job->err, sizeof(job->err), __VA_ARGS__); \
+                        goto exit_L; }
+
+// Long options are handled by us, since getopt_long isn't portable.
+// The ids share the switch at main with the short options chars.
+enum {
+    LOPT_NONE = 0,
+    LOPT_UNKNOWN = 256,
+    LOPT_MISSING_ARG,
+    LOPT_BATCH,
+    LOPT_JOBS,
+    LOPT_PER_DEVICE,
+    LOPT_ENGINE,
+    LOPT_BUFSIZE,
+    LOPT_STATS,
+    LOPT_PROGRESS_FD,
+    LOPT_MAX_RATE,
+    LOPT_MAX_IOPS,
+    LOPT_PREFETCH,
+    LOPT_NOCACHE,
+    LOPT_COMPRESS,
+    LOPT_DECOMPRESS,
+    LOPT_EACH,
+    LOPT_EACH_GLOB,
+    LOPT_TEE_LAG,
+    LOPT_RECORD,
+    LOPT_FIELDS,
+    LOPT_MANIFEST,
+    LOPT_PATCH,
+    LOPT_SYNC,
+    LOPT_IN_PLACE,
+    LOPT_RESCUE,
+    LOPT_DIFF,
+    LOPT_DIFF_GAP,
+    LOPT_KEY_AT,
+    LOPT_FOLLOW,
+};
+
+static const struct {
+    const char *name;
+    int has_arg;
+    int id;
+} long_opts[] = {
+    { "batch",      1, LOPT_BATCH },
+    { "jobs",       1, LOPT_JOBS },
+    { "per-device", 1, LOPT_PER_DEVICE },
+    { "engine",     1, LOPT_ENGINE },
+    { "bufsize",    1, LOPT_BUFSIZE },
+    { "stats",      1, LOPT_STATS },
+    { "progress-fd", 1, LOPT_PROGRESS_FD },
+    { "max-rate",   1, LOPT_MAX_RATE },
+    { "max-iops",   1, LOPT_MAX_IOPS },
+    { "prefetch",   1, LOPT_PREFETCH },
+    { "nocache",    0, LOPT_NOCACHE },
+    { "compress",   1, LOPT_COMPRESS },
+    { "decompress", 0, LOPT_DECOMPRESS },
+    { "each",       1, LOPT_EACH },
+    { "each-glob",  1, LOPT_EACH_GLOB },
+    { "tee-lag",    1, LOPT_TEE_LAG },
+    { "record",     1, LOPT_RECORD },
+    { "fields",     1, LOPT_FIELDS },
+    { "manifest",   0, LOPT_MANIFEST },
+    { "patch",      0, LOPT_PATCH },
+    { "sync",       1, LOPT_SYNC },
+    { "in-place",   1, LOPT_IN_PLACE },
+    { "rescue",     1, LOPT_RESCUE },
+    { "diff",       1, LOPT_DIFF },
+    { "diff-gap",   1, LOPT_DIFF_GAP },
+    { "key-at",     1, LOPT_KEY_AT },
+    { "follow",     0, LOPT_FOLLOW },
+    { NULL, 0, 0 }
+};
+
+// The modes which change what a job does, and which of them cannot be used
+// together. A pair is listed at either of them, and the error is of the one
+// which comes first.
+enum {
+    MODE_IN_PLACE,
+    MODE_DIFF,
+    MODE_FOLLOW,
+    MODE_RESCUE,
+    MODE_PATCH,         // without --diff, where it's only the format of the ranges
+    MODE_MANIFEST,
+    MODE_FIELDS,
+    MODE_BATCH,
+    MODE_EACH,
+    MODE_COMPRESS,
+    MODE_DECOMPRESS,
+    MODE_NOCACHE,
+    MODE_INPUTS,        // several IN_FILEs
+    MODE_TEE,           // several -o
+    MODE_COUNT
+};
+
+#define M(mode) (1u << MODE_##mode)
+static const struct {
+    const char *name;
+    unsigned excludes;
+} modes[MODE_COUNT] = {
+    { "--in-place",     M(DIFF) | M(FOLLOW) | M(RESCUE) | M(PATCH) | M(MANIFEST) | M(FIELDS) |
+                        M(BATCH) | M(EACH) | M(COMPRESS) | M(DECOMPRESS) | M(TEE) },
+    { "--diff",         M(FOLLOW) | M(RESCUE) | M(MANIFEST) | M(FIELDS) | M(BATCH) | M(EACH) |
+                        M(COMPRESS) | M(DECOMPRESS) | M(INPUTS) | M(TEE) },
+    { "--follow",       M(RESCUE) | M(PATCH) | M(MANIFEST) | M(FIELDS) | M(BATCH) | M(EACH) |
+                        M(COMPRESS) | M(DECOMPRESS) | M(INPUTS) | M(TEE) },
+    { "--rescue",       M(PATCH) | M(MANIFEST) | M(FIELDS) | M(BATCH) | M(EACH) |
+                        M(COMPRESS) | M(DECOMPRESS) | M(INPUTS) | M(TEE) },
+    { "--patch",        M(MANIFEST) | M(FIELDS) | M(COMPRESS) | M(NOCACHE) | M(TEE) },
+    { "--manifest",     M(FIELDS) | M(COMPRESS) | M(DECOMPRESS) | M(TEE) },
+    { "--fields",       M(BATCH) | M(EACH) | M(COMPRESS) | M(TEE) },
+    { "--batch",        M(EACH) | M(TEE) },
+    { "--each",         M(TEE) },
+    { "--compress",     0 },
+    { "--decompress",   M(INPUTS) },
+    { "--nocache",      0 },
+    { "several inputs", 0 },
+    { "several -o",     0 },
+};
+#undef M
+
+int get_long_opt(int argc, char **argv);
 
 int main (int argc, char **argv)
 {
@@ -112,17 +786,31 @@ int main (int argc, char **argv)
     int rv = 1;
     int needs_usage_on_err = 1;
 
+    cc_opts_t opts = {0};
+    opts.engine = ENGINE_STDIO;
+    opts.bufsize = 0;
+    opts.progress_fd = -1;
+    opts.prefetch = PREFETCH_DEFAULT;
+    opts.tee_lag = TEE_LAG_DEFAULT;
+    opts.diff_gap = DIFF_GAP_DEFAULT;
     int opt_verbose = 0;
-    int opt_overwrite = 0;
-    int opt_progress = 0;
-    int opt_dummy = 0;
+    char *batch_name = NULL;
+    int batch_jobs = 0;
+    int batch_per_device = 0;
+    char *each_name = NULL;  // --each LIST or --each-glob PATTERN
+    int each_glob = 0;
+    char *fields_list = NULL;  // --fields LIST, parsed once --record is known
 
     char *in_name = NULL;
+    char **in_names = NULL;  // all the input files, if more than one
+    int nin_names = 0;
     char *out_name = NULL;
-    FILE *in_file = NULL;
-    FILE *out_file = NULL;
-
-    int i = 0;
+    char **tee_names = NULL;  // the other outputs, if -o is given more than once
+    int ntee_names = 0;
+    cc_off_t val;
+    cc_off_t max_rate = 0;
+    cc_off_t max_iops = 0;
+    throttle_t throttle_bucket;
 
     opterr = 0; // suppress getopt error prints, we're handling them.
     int c;
@@ -137,27 +825,214 @@ int main (int argc, char **argv)
         // it as an indicator, therefore interpreting it as a valid option char.
         // So to cover both variants, we use the '+' to make GNU posix compliant,
         // but also expect it and then and reject it as an unknown option on posix getopt.
-        if ((c = getopt (argc, argv, "+hdvfpo:")) != -1) {
+        if ((c = get_long_opt(argc, argv)) != LOPT_NONE ||
+            (c = getopt (argc, argv, "+hdvfpo:")) != -1)
+        {
             switch (c) {
                 case 'h': help();
                           exit(0);
 
-                case 'v': opt_verbose = 1;
+                case 'v': opts.verbose = opt_verbose = 1;
                           break;
 
-                case 'f': opt_overwrite = 1;
+                case 'f': opts.overwrite = 1;
                           break;
 
-                case 'p': opt_progress = 1;
+                case 'p': opts.progress = 1;
                           break;
 
-                case 'd': opt_dummy = 1;
+                case 'd': opts.dummy = 1;
                           break;
 
-                case 'o': out_name = optarg;
+                case 'o': if (!out_name) {
+                              out_name = optarg;
+                          } else {
+                              if (!tee_names && !(tee_names = malloc(argc * sizeof(char *))))
+                                  ERR_EXIT("out of memory");
+                              tee_names[ntee_names++] = optarg;
+                          }
                           // Will also exit the while loop and start the ranges
                           break;
 
+                case LOPT_BATCH:
+                          batch_name = optarg;
+                          break;
+
+                case LOPT_EACH:
+                case LOPT_EACH_GLOB:
+                          each_name = optarg;
+                          each_glob = c == LOPT_EACH_GLOB;
+                          break;
+
+                case LOPT_JOBS:
+                          if (!atooff(optarg, strlen(optarg), 0, &val) || val < 1 || val > BATCH_MAX_JOBS)
+                              ERR_EXIT("--jobs: expecting a number between 1 and %d", BATCH_MAX_JOBS);
+                          batch_jobs = (int)val;
+                          break;
+
+                case LOPT_PER_DEVICE:
+                          if (!atooff(optarg, strlen(optarg), 0, &val) || val > BATCH_MAX_JOBS)
+                              ERR_EXIT("--per-device: expecting a number between 0 and %d", BATCH_MAX_JOBS);
+                          batch_per_device = (int)val;
+                          break;
+
+                case LOPT_ENGINE:
+                          for (c = 0; engines[c].name; c++) {
+                              if (engines[c].available && !strcmp(optarg, engines[c].name))
+                                  break;
+                          }
+                          if (!engines[c].name) {
+                              char avail[128] = "";
+                              for (c = 0; engines[c].name; c++) {
+                                  if (engines[c].available)
+                                      strcat(strcat(avail, " "), engines[c].name);
+                              }
+                              ERR_EXIT("--engine: unknown or unavailable '%s'. Available:%s", optarg, avail);
+                          }
+                          opts.engine = c;
+                          break;
+
+                case LOPT_BUFSIZE:
+                          if (!strcmp(optarg, "auto")) {
+                              opts.bufsize = 0;
+                              break;
+                          }
+                          if (!atooff(optarg, strlen(optarg), 0, &val) || val < 1 || val > RW_BUFFSIZE_MAX)
+                              ERR_EXIT("--bufsize: expecting 'auto' or a size between 1 and 1024M");
+                          opts.bufsize = (size_t)val;
+                          break;
+
+                case LOPT_STATS:
+                          if (strcmp(optarg, "json"))
+                              ERR_EXIT("--stats: unknown format '%s' (supported: json)", optarg);
+                          opts.stats = 1;
+                          break;
+
+                case LOPT_PROGRESS_FD:
+                          if (!atooff(optarg, strlen(optarg), 0, &val) || val > INT_MAX)
+                              ERR_EXIT("--progress-fd: expecting a file descriptor number");
+                          opts.progress_fd = (int)val;
+                          break;
+
+                case LOPT_MAX_RATE:
+                          if (!atooff(optarg, strlen(optarg), 0, &max_rate) || max_rate < 1)
+                              ERR_EXIT("--max-rate: expecting bytes per second, e.g. 20M");
+                          break;
+
+                case LOPT_MAX_IOPS:
+                          if (!atooff(optarg, strlen(optarg), 0, &max_iops) || max_iops < 1)
+                              ERR_EXIT("--max-iops: expecting I/O calls per second");
+                          break;
+
+                case LOPT_TEE_LAG:
+                          if (!atooff(optarg, strlen(optarg), 0, &opts.tee_lag) || opts.tee_lag < TEE_BLOCK)
+                              ERR_EXIT("--tee-lag: expecting a size of at least 1M");
+                          break;
+
+                case LOPT_RECORD:
+                          if (!atooff(optarg, strlen(optarg), 0, &opts.record_size) || opts.record_size < 1 ||
+                              opts.record_size > RW_BUFFSIZE_MAX)
+                          {
+                              ERR_EXIT("--record: expecting a size between 1 and 1024M");
+                          }
+                          break;
+
+                case LOPT_FIELDS:
+                          fields_list = optarg;
+                          break;
+
+                case LOPT_PREFETCH:
+                          if (!atooff(optarg, strlen(optarg), 0, &opts.prefetch))
+                              ERR_EXIT("--prefetch: expecting a size, e.g. 64M");
+                          break;
+
+                case LOPT_COMPRESS: {
+                          char *colon = strchr(optarg, ':');
+                          size_t len = colon ? (size_t)(colon - optarg) : strlen(optarg);
+                          for (c = 1; compressors[c].name; c++) {
+                              if (strlen(compressors[c].name) == len && !strncmp(optarg, compressors[c].name, len))
+                                  break;
+                          }
+                          if (!compressors[c].name)
+                              ERR_EXIT("--compress: unknown format '%s', expecting gzip or zstd", optarg);
+                          if (!compressors[c].available)
+                              ERR_EXIT("--compress: %s is not available in this build", compressors[c].name);
+                          opts.compress = c;
+                          opts.compress_level = compressors[c].level;
+                          if (colon && (!atooff(colon + 1, strlen(colon + 1), 0, &val) ||
+                                        val < 1 || val > compressors[c].max_level))
+                          {
+                              ERR_EXIT("--compress: %s level should be 1-%d", compressors[c].name,
+                                       compressors[c].max_level);
+                          }
+                          if (colon)
+                              opts.compress_level = (int)val;
+                          break;
+                      }
+
+                case LOPT_DECOMPRESS:
+                          opts.decompress = 1;
+                          break;
+
+                case LOPT_NOCACHE:
+                          opts.nocache = 1;
+                          break;
+
+                case LOPT_MANIFEST:
+                          opts.manifest = 1;
+                          break;
+
+                case LOPT_PATCH:
+                          opts.patch = 1;
+                          break;
+
+                case LOPT_SYNC:
+                          if (!strcmp(optarg, "none"))
+                              opts.sync = SYNC_NONE;
+                          else if (!strcmp(optarg, "end"))
+                              opts.sync = SYNC_END;
+                          else if (!strcmp(optarg, "range"))
+                              opts.sync = SYNC_RANGE;
+                          else
+                              ERR_EXIT("--sync: unknown '%s', expecting none, end or range", optarg);
+                          break;
+
+                case LOPT_RESCUE:
+                          opts.rescue = optarg;
+                          break;
+
+                case LOPT_DIFF:
+                          opts.diff = optarg;
+                          break;
+
+                case LOPT_FOLLOW:
+                          opts.follow = 1;
+                          break;
+
+                case LOPT_KEY_AT:
+                          if (!atooff(optarg, strlen(optarg), 0, &opts.key_at) || opts.key_at < 0)
+                              ERR_EXIT("--key-at: expecting an offset");
+                          break;
+
+                case LOPT_DIFF_GAP:
+                          if (!atooff(optarg, strlen(optarg), 0, &opts.diff_gap) || opts.diff_gap < 0)
+                              ERR_EXIT("--diff-gap: expecting a size");
+                          break;
+
+                case LOPT_IN_PLACE:
+                          if (in_name)
+                              ERR_EXIT("--in-place FILE is the input, without IN_FILE");
+                          in_name = optarg;
+                          opts.in_place = 1;
+                          // Like -o, the rest are the ranges
+                          break;
+
+                case LOPT_UNKNOWN:
+                          ERR_EXIT("unknown option %s", argv[optind]);
+
+                case LOPT_MISSING_ARG:
+                          ERR_EXIT("%s: missing value", argv[optind]);
+
                 case '+': optopt = '+'; // fallthrough - proper POSIX (bsd, OS X, ...)
                 case '?': if (optopt == 'o')
                               ERR_EXIT("-o: missing output file name");
@@ -169,172 +1044,5852 @@ int main (int argc, char **argv)
             }
 
         } else if (optind < argc) { // still more arguments, so it's a value
-            if (!in_name) {
+            if (!in_name && !batch_name && !each_name) {
                 // still no input file, so this is it.
                 in_name = argv[optind];
                 optind++; // skip the value and continue parsing.
 
+            } else if (batch_name) {
+                ERR_EXIT("unexpected '%s' (--batch takes the jobs from the manifest)", argv[optind]);
+
+            } else if (each_name) {
+                ERR_EXIT("unexpected '%s' (--each takes the input files from the list)", argv[optind]);
+
             } else {
-                ERR_EXIT("unexpected '%s' (missing -o OUT_FILE before the ranges?)", argv[optind]);
+                // more input files (before -o), the input is their concatenation
+                if (!in_names) {
+                    if (!(in_names = malloc(argc * sizeof(char *))))
+                        ERR_EXIT("out of memory");
+                    in_names[nin_names++] = in_name;
+                }
+                in_names[nin_names++] = argv[optind];
+                optind++;
+            }
+
+        } else { // no more arguments to parse
+            break;
+        }
+
+        // Once we got the output file(s), the rest should be ranges
+        if ((out_name || opts.in_place) && !(optind < argc && !strncmp(argv[optind], "-o", 2)))
+            break;
+    }
+    // from here onwards, optind should point to the first range in argv
+
+    VERBOSE("- Verbose mode enabled.\n");
+
+    if (opts.overwrite)
+        VERBOSE("- Force overwrite output file if exists.\n");
+
+    if (opts.progress)
+        VERBOSE("- Progress display enabled.\n");
+
+    if (opts.dummy)
+        VERBOSE("- Dummy mode enabled.\n");
+
+    if (opts.prefetch) {
+#ifdef POSIX_FADV_WILLNEED
+        VERBOSE("- Prefetch up to %lld bytes ahead.\n", (long long)opts.prefetch);
+#else
+        VERBOSE("- Prefetch is not supported on this platform, ignored.\n");
+        opts.prefetch = 0;
+#endif
+    }
+
+    if (opts.nocache) {
+#ifdef POSIX_FADV_DONTNEED
+        VERBOSE("- No cache: write back and drop windows of %d bytes.\n", NOCACHE_WINDOW);
+#else
+        VERBOSE("- No cache is not supported on this platform, ignored.\n");
+        opts.nocache = 0;
+#endif
+    }
+
+    if (opts.compress) {
+        // with --batch, the CPUs are shared by the concurrent jobs
+        int ncpus = cc_ncpus();
+        opts.compress_threads = cc_max(1, batch_name || each_name ? ncpus / (batch_jobs ? batch_jobs : ncpus)
+                                                                  : ncpus);
+        VERBOSE("- Compress: %s, level %d, blocks of %d bytes, threads per job: %d\n",
+                compressors[opts.compress].name, opts.compress_level, COMPRESS_BLOCK,
+                opts.compress_threads);
+    }
+
+    if (max_rate || max_iops) {
+        throttle_init(&throttle_bucket, (double)max_rate, (double)max_iops);
+        opts.throttle = &throttle_bucket;
+        VERBOSE("- Throttle: max rate: %lld bytes/s, max IOPS: %lld (0: unlimited)\n",
+                (long long)max_rate, (long long)max_iops);
+    }
+
+    if (opts.bufsize) {
+        VERBOSE("- I/O engine: %s, buffer size: %lld\n",
+                engines[opts.engine].name, (long long)opts.bufsize);
+    } else {
+        VERBOSE("- I/O engine: %s, buffer size: auto\n", engines[opts.engine].name);
+    }
+
+    unsigned used = (opts.in_place ? 1u << MODE_IN_PLACE : 0) | (opts.diff ? 1u << MODE_DIFF : 0) |
+                    (opts.follow ? 1u << MODE_FOLLOW : 0) | (opts.rescue ? 1u << MODE_RESCUE : 0) |
+                    (opts.patch && !opts.diff ? 1u << MODE_PATCH : 0) |
+                    (opts.manifest ? 1u << MODE_MANIFEST : 0) | (fields_list ? 1u << MODE_FIELDS : 0) |
+                    (batch_name ? 1u << MODE_BATCH : 0) | (each_name ? 1u << MODE_EACH : 0) |
+                    (opts.compress ? 1u << MODE_COMPRESS : 0) | (opts.decompress ? 1u << MODE_DECOMPRESS : 0) |
+                    (opts.nocache ? 1u << MODE_NOCACHE : 0) | (in_names ? 1u << MODE_INPUTS : 0) |
+                    (tee_names ? 1u << MODE_TEE : 0);
+    for (c = 0; c < MODE_COUNT; c++) {
+        int k;
+        for (k = c + 1; k < MODE_COUNT && (used >> c & 1); k++) {
+            if ((used >> k & 1) && ((modes[c].excludes >> k & 1) || (modes[k].excludes >> c & 1)))
+                ERR_EXIT("%s cannot be used with %s", modes[c].name, modes[k].name);
+        }
+    }
+
+    if (fields_list && !opts.record_size)
+        ERR_EXIT("--fields needs --record SIZE");
+
+    if (fields_list) {
+        // FROM:TO or FROM:+LENGTH within the record, comma separated
+        char *f = fields_list, *comma;
+        cc_off_t prev_to = 0;
+        do {
+            char tok[64];
+            size_t len = (comma = strchr(f, ',')) ? (size_t)(comma - f) : strlen(f);
+            range_t *r = &opts.fields[opts.nfields];
+            if (opts.nfields == FIELDS_MAX)
+                ERR_EXIT("--fields: more than %d fields", FIELDS_MAX);
+            if (len < sizeof(tok)) {
+                memcpy(tok, f, len);
+                tok[len] = 0;
             }
+            if (len >= sizeof(tok) || !get_range(opts.record_size, prev_to, tok, r))
+                ERR_EXIT("--fields: invalid field '%.*s'", (int)len, f);
+            if (r->to == r->from)
+                ERR_EXIT("--fields: field '%.*s' is empty at records of %lld bytes",
+                         (int)len, f, (long long)opts.record_size);
+            prev_to = r->to;
+            opts.nfields++;
+            f = comma + 1;
+        } while (comma);
+
+        if (out_name && !strstr(out_name, "{n}"))
+            ERR_EXIT("--fields needs an output per field ({n} at -o)");
+        VERBOSE("- Records of %lld bytes, %d fields to their own outputs.\n",
+                (long long)opts.record_size, opts.nfields);
+    }
+    if (opts.record_size && !fields_list && !batch_name) {
+        // else it's of key: ranges (with --batch, they're at the manifest)
+        for (c = optind; c < argc && strncmp(argv[c], "key:", 4); c++)
+            ;
+        if (c == argc)
+            ERR_EXIT("--record needs --fields or key: ranges");
+    }
+
+    if (batch_name || each_name) {
+        if (opts.progress || opts.progress_fd >= 0) {
+            VERBOSE("- Progress display is not supported with --batch or --each, ignored.\n");
+            opts.progress = 0;
+            opts.progress_fd = -1;
+        }
+    }
+
+    if (opts.manifest) {
+        // the plan is of uncompressed input offsets, to one output
+        if (each_name && !each_per_input(out_name ? out_name : ""))
+            ERR_EXIT("--manifest with --each needs an output per input ({} or {n} at -o)");
+        VERBOSE("- Manifest: write the plan of the copy instead of the data.\n");
+    }
+
+    if (opts.patch && !opts.diff) {
+        // the output is written at random offsets, as itself
+        if (out_name && !strcmp(out_name, "-"))
+            ERR_EXIT("--patch needs an output file, not stdout");
+        if (each_name && !each_per_input(out_name ? out_name : ""))
+            ERR_EXIT("--patch with --each needs an output per input ({} or {n} at -o)");
+        VERBOSE("- Patch: write into the existing output, without truncating it.\n");
+    }
+    if (opts.rescue) {
+        // later runs write to the same output, from the same input
+        if (out_name && !strcmp(out_name, "-"))
+            ERR_EXIT("--rescue needs an output file, not stdout");
+#ifndef CC_HAVE_PREAD
+        ERR_EXIT("--rescue is not supported on this platform");
+#endif
+        VERBOSE("- Rescue: continue past read errors, map: '%s'\n", opts.rescue);
+    }
+    if (opts.follow) {
+        // the output is a stream of the input, until it's interrupted
+#ifndef CC_HAVE_PREAD
+        ERR_EXIT("--follow is not supported on this platform");
+#endif
+        if (opts.progress || opts.progress_fd >= 0) {
+            VERBOSE("- Progress display is not supported with --follow, ignored.\n");
+            opts.progress = 0;
+            opts.progress_fd = -1;
+        }
+        VERBOSE("- Follow: then copy what's appended to the input.\n");
+    }
+    if (opts.sync)
+        VERBOSE("- Sync the output to the disk: %s.\n", opts.sync == SYNC_END ? "at the end" : "after each range");
+
+    if (each_name) {
+        if (!out_name)
+            ERR_EXIT("missing output file name template, --each needs -o OUT_TEMPLATE");
+        if (optind == argc)
+            ERR_EXIT("no ranges defined, must have at least one range");
+        if (opts.compress && !each_per_input(out_name))
+            ERR_EXIT("--compress with --each needs an output per input ({} or {n} at -o)");
+
+        needs_usage_on_err = 0;
+        rv = run_each(&opts, each_name, each_glob, out_name, argv + optind, argc - optind,
+                      batch_jobs, batch_per_device);
+        goto exit_L;
+    }
+
+    if (batch_name) {
+        if (in_name || out_name)
+            ERR_EXIT("--batch cannot be used with IN_FILE or -o OUT_FILE");
+
+        needs_usage_on_err = 0;
+        rv = run_batch(&opts, batch_name, batch_jobs, batch_per_device);
+        goto exit_L;
+    }
+
+    if (opts.diff) {
+        // the output is text, of the ranges
+        if (!in_name)
+            ERR_EXIT("missing input file name");
+        if (!out_name)
+            ERR_EXIT("missing output file name");
+        if (optind < argc)
+            ERR_EXIT("unexpected '%s' (--diff has no ranges)", argv[optind]);
+        if (batch_per_device)
+            ERR_EXIT("--per-device is only valid with --batch or --each");
+
+        job_t job = {0};
+        job.opts = &opts;
+        job.in_name = in_name;
+        job.out_name = out_name;
+        if (!run_diff(&job, batch_jobs ? batch_jobs : cc_ncpus())) {
+            needs_usage_on_err = !job.started;
+            ERR_EXIT("%s", job.err);
+        }
+        VERBOSE("- Done.\n");
+        rv = 0;
+        goto exit_L;
+    }
+
+    if (batch_jobs || batch_per_device)
+        ERR_EXIT("--jobs and --per-device are only valid with --batch, --each or --diff");
+
+    if (opts.in_place) {
+        if (out_name)
+            ERR_EXIT("--in-place writes into FILE, without -o");
+        if (optind == argc)
+            ERR_EXIT("no ranges defined, must have at least one range");
+
+        job_t job = {0};
+        job.opts = &opts;
+        job.in_name = in_name;
+        job.ranges = argv + optind;
+        job.nranges = argc - optind;
+        if (!run_in_place(&job)) {
+            needs_usage_on_err = !job.started;
+            ERR_EXIT("%s", job.err);
+        }
+        VERBOSE("- Done.\n");
+        rv = 0;
+        goto exit_L;
+    }
+
+    if (!in_name)
+        ERR_EXIT("missing input file name");
+
+    if (!out_name) {
+        ERR_EXIT("missing output file name%s",
+                 in_names ? " (missing -o OUT_FILE before the ranges?)" : "");
+    }
+
+    for (c = 0; c < ntee_names; c++) {
+        int k;
+        for (k = -1; k < c; k++) {
+            if (!strcmp(tee_names[c], k < 0 ? out_name : tee_names[k]))
+                ERR_EXIT("output file '%s' is given more than once", tee_names[c]);
+        }
+    }
+    if (ntee_names)
+        VERBOSE("- Outputs: %d, lag of the others up to %lld bytes\n", ntee_names + 1, (long long)opts.tee_lag);
+
+    if (optind == argc)
+        ERR_EXIT("no ranges defined, must have at least one range");
+
+    job_t job = {0};
+    job.opts = &opts;
+    job.in_name = in_name;
+    job.in_names = in_names;
+    job.nin_names = nin_names;
+    job.out_name = out_name;
+    job.tee_names = tee_names;
+    job.ntee_names = ntee_names;
+    job.ranges = argv + optind;
+    job.nranges = argc - optind;
+
+    if (!run_job(&job)) {
+        needs_usage_on_err = !job.started;
+        ERR_EXIT("%s", job.err);
+    }
+
+    // success
+    VERBOSE("- Done.\n");
+    rv = 0;
+
+exit_L:
+    if (rv && needs_usage_on_err) {
+        cc_fprintf(stderr, "\n");
+        usage();
+    }
+    free(in_names);
+    free(tee_names);
+
+#ifdef CC_HAVE_WIN_UTF8
+    if (g_win_utf8_enabled)
+        free_argvutf8(argc, argv);
+#endif
+
+    return rv;
+}
+
+// Copy the ranges of one job. Returns 1 on success, or 0 with job->err set.
+int run_job(job_t *job)
+{
+    int rv = 0;
+    int opt_verbose = job->opts->verbose;
+
+    const char *out_name = job->out_name;
+    FILE *in_file = job->in_file;
+    FILE *out_file = NULL;
+    char *buf = job->buf;
+    size_t buf_size = job->buf_size;
+    cc_off_t in_size = job->in_size;
+    char **ranges_arg = job->ranges;  // until key: ranges are resolved
+    io_tuner_t tuner = {0};
+    progress_t progress;
+    int has_progress = 0;
+    int created = 0;      // the output file, by this job
+    int reserved = 0;     // its blocks, by out_preallocate
+    cc_off_t expected_output_size = 0;
+    range_iter_t it;
+    prefetch_t pf;
+    nocache_t nc;
+    range_t range;
+    range_t span;
+    char *gbuf = NULL;  // gather_copy output and gaps
+    int framing = 0;
+    int i, r;
+
+    uint64_t t0 = cc_now_ns();
+    if (job->opts->stats && !(job->stats = calloc(1, sizeof(job_stats_t))))
+        JOB_ERR("out of memory");
+
+    // Input file - verify, open and read size
+    if (!in_file) {
+        in_file = open_input(job->in_name, &in_size);
+        if (!in_file)
+            JOB_ERR("input file '%s' cannot be opened", job->in_name);
+    }
+    VERBOSE("-   Input file: '%s', size: %lld\n", job->in_name, (long long)in_size);
+
+    // from here on in_size is of the whole input
+    if (job->in_names) {
+        char err[200];
+        if (!(job->vcat = vcat_open(job->in_names, job->nin_names, in_file, &in_size, err, sizeof(err))))
+            JOB_ERR("%s", err);
+        VERBOSE("-   Input: concatenation of %d files, size: %lld\n",
+                job->nin_names, (long long)in_size);
+    }
+
+    // from here on in_size is of the uncompressed data
+    if (job->opts->decompress) {
+        char err[200];
+        job->zsrc = zsrc_open(in_file, job->in_name, in_size, opt_verbose, &in_size, err, sizeof(err));
+        if (!job->zsrc)
+            JOB_ERR("input file '%s': %s", job->in_name, err);
+    }
+    STAT_PHASE(open_ns, t0);
+
+    // verify ranges and calculate expected output size
+    t0 = cc_now_ns();
+    if (!keys_resolve(job, in_file, in_size))
+        goto exit_L;
+    if (job->stats && !(job->stats->ranges = calloc(job->nranges, sizeof(range_stats_t))))
+        JOB_ERR("out of memory");
+
+    cc_off_t max_range = 0;
+    cc_off_t min_range = OFF_T_MAX;
+    cc_off_t reps = 0, rep_bytes = 0;  // of a repeated range, for -v
+    cc_off_t patch_size = 0, patch_at = 0;  // the output before, and where the range goes
+    if (job->opts->patch) {
+        if (job->out_file)
+            JOB_ERR("--patch needs an output file of its own");
+        patch_size = cc_max(fsize(out_name), 0);  // -1 if it doesn't exist yet
+    }
+    range_iter_init(&it, job->ranges, job->nranges, in_size);
+    while ((r = range_next(&it, &range)) > 0) {
+        i = it.i - 1;
+        if (it.at && !job->opts->patch)
+            JOB_ERR("invalid range '%s' (@OFFSET is valid with --patch)", job->ranges[i]);
+        if (job->opts->patch) {
+            if (!range_out_at(&it, patch_size, patch_at, &patch_at))
+                JOB_ERR("invalid range '%s' (bad @OFFSET, or before the output)", job->ranges[i]);
+            if (it.at)
+                VERBOSE("-   Range #%d: written at output offset %lld\n", i + 1, (long long)patch_at);
+            patch_at += it.gen ? range.to : range.to - range.from;
+        }
+        expected_output_size += range.to - range.from;
+        max_range = cc_max(max_range, range.to - range.from);
+        min_range = cc_min(min_range, range.to - range.from);
+        if (job->stats) {
+            if (!it.nrep)
+                job->stats->ranges[i].from = range.from;
+            job->stats->ranges[i].to = range.to;
+        }
+        if (!it.nrep && reps) {
+            VERBOSE("-     Repeated: %lld times -> %lld bytes\n", (long long)reps, (long long)rep_bytes);
+            reps = 0;
+        }
+        if (it.gen) {
+            VERBOSE("-   Range #%d: '%s' -> %lld generated bytes\n",
+                    i + 1, job->ranges[i], (long long)range.to);
+        } else if (!it.nrep) {
+            VERBOSE("-   Range #%d: '%s' -> [%lld, %lld) -> %lld bytes\n",
+                    i + 1,
+                    job->ranges[i],
+                    (long long)range.from,
+                    (long long)range.to,
+                    (long long)(range.to - range.from)
+                    );
+            rep_bytes = range.to - range.from;
+        } else {
+            reps = it.nrep + 1;
+            rep_bytes += range.to - range.from;
+        }
+    }
+    if (reps)
+        VERBOSE("-     Repeated: %lld times -> %lld bytes\n", (long long)reps, (long long)rep_bytes);
+    if (r < 0)
+        JOB_ERR("invalid range '%s'", job->ranges[it.i - 1]);
+    STAT_PHASE(resolve_ns, t0);
+
+    if (job->opts->dummy) {
+        VERBOSE("- Done - dummy mode - skipped copying %lld bytes to '%s'%s.\n",
+                (long long)expected_output_size, out_name,
+                strcmp(out_name, "-") ? "" : " (stdout)");
+        job->copied = expected_output_size;
+        rv = 1;
+        goto exit_L;
+    }
+
+    // open/setup output
+    t0 = cc_now_ns();
+    if (job->opts->nfields) {
+        // no output of its own, each field has one
+        char err[200];
+        if (expected_output_size % job->opts->record_size)
+            JOB_ERR("the ranges are %lld bytes, not whole records of %lld bytes",
+                    (long long)expected_output_size, (long long)job->opts->record_size);
+        job->fields = fields_open(job->opts, out_name, job->in_name,
+                                  expected_output_size / job->opts->record_size, err, sizeof(err));
+        if (!job->fields)
+            JOB_ERR("%s", err);
+    } else if (job->out_file) {
+        out_file = job->out_file;  // shared, framed below
+    } else if (job->opts->patch) {
+        if (!(out_file = open_patch_output(out_name, job->err, sizeof(job->err))))
+            goto exit_L;
+        VERBOSE("-   Patching '%s', size: %lld\n", out_name, (long long)patch_size);
+    } else if (job->opts->rescue) {
+        // with a map, the output is of an earlier run, which is continued
+        char err[200];
+        if (!(job->rescue = rescue_open(job->opts->rescue, expected_output_size, err, sizeof(err))))
+            JOB_ERR("%s", err);
+        if (rescue_resumed(job->rescue)) {
+            if (!(out_file = cc_fopen(out_name, "r+b")))
+                JOB_ERR("cannot open the output file '%s' of the map '%s'", out_name, job->opts->rescue);
+            VERBOSE("-   Continuing the map, %lld bytes are good, %lld bad\n",
+                    (long long)rescue_bytes(job->rescue, RESCUE_GOOD),
+                    (long long)rescue_bytes(job->rescue, RESCUE_BAD));
+        } else if (!(out_file = open_output(out_name, job->opts->overwrite, job->err, sizeof(job->err)))) {
+            goto exit_L;
+        }
+    } else if (!(out_file = open_output(out_name, job->opts->overwrite, job->err, sizeof(job->err)))) {
+        goto exit_L;
+    } else {
+        created = out_file != stdout;
+    }
+
+    STAT_PHASE(open_ns, t0);
+
+    if (job->opts->manifest) {
+        job->started = 1;
+        if (!manifest_write(job, out_file, in_size, expected_output_size))
+            goto exit_L;
+        VERBOSE("- Wrote the plan of %lld bytes to '%s'%s.\n",
+                (long long)expected_output_size, out_name,
+                strcmp(out_name, "-") ? "" : " (stdout)");
+        job->copied = expected_output_size;
+        rv = 1;
+        goto exit_L;
+    }
+
+    job->engine = job->opts->engine;
+    if ((job->opts->compress || job->tee_names || job->fields) && job->engine != ENGINE_STDIO)
+        job->engine = ENGINE_PREAD;  // the data passes through the compressor, the tee or the fields
+    if (job->rescue)
+        job->engine = ENGINE_PREAD;  // each read error is handled
+    job->out_pos = job->opts->patch || job->rescue;
+#ifdef CC_HAVE_SENDFILE
+    if (job->opts->patch && job->engine == ENGINE_SENDFILE)
+        job->engine = ENGINE_PREAD;  // sendfile writes at the file offset
+#endif
+
+    // I/O size, and a buffer which fits it (and the auto tuning), but not
+    // bigger than the biggest range.
+    size_t need;
+    if (job->opts->bufsize) {
+        job->io_size = need = job->opts->bufsize;
+    } else {
+        size_t blksize, optimal;
+        job->io_size = need = io_size_hint(in_file, out_file, &blksize, &optimal);
+        VERBOSE("-   Auto I/O size: %lld (block size: %lld, optimal I/O size: %lld)\n",
+                (long long)job->io_size, (long long)blksize, (long long)optimal);
+
+        if (expected_output_size >= TUNE_MIN_TOTAL && max_range > (cc_off_t)job->io_size &&
+            !job->opts->throttle && !job->rescue)
+        {
+            tuner_start(&tuner, job->io_size, blksize);
+            need = tuner.max;
+        }
+    }
+    if ((cc_off_t)need > max_range && !job->opts->follow)
+        need = (size_t)cc_max(max_range, 1);
+
+    if (!buf || buf_size < need) {
+        if (!(buf = iobuf_alloc(need)))
+            JOB_ERR("out of memory");
+        buf_size = need;
+    }
+
+    // args are valid, input file is valid, output file created. Start copy
+    job->started = 1;
+
+    // reserve the whole output, to fail now rather than mid-copy
+    if (!job->opts->compress && !job->out_file && !job->fields && !job->out_pos) {
+        if (!out_preallocate(out_file, expected_output_size)) {
+            int e = errno;
+            if (created) {  // empty, don't leave it
+                fclose(out_file);
+                out_file = NULL;
+                remove(out_name);
+            }
+            JOB_ERR("not enough space for the output (%lld bytes): %s",
+                    (long long)expected_output_size, strerror(e));
+        }
+        reserved = 1;
+    }
+
+    if (job->tee_names) {
+        char err[200];
+        job->tee = tee_open(job->opts, job->tee_names, job->ntee_names,
+                            job->opts->compress ? -1 : expected_output_size, err, sizeof(err));
+        if (!job->tee)
+            JOB_ERR("%s", err);
+        for (i = 0; i < job->ntee_names; i++)
+            VERBOSE("-   Also writing to '%s'\n", job->tee_names[i]);
+    }
+
+    if (job->opts->compress && !(job->zsink = zsink_open(job->opts, out_file, job->tee)))
+        JOB_ERR("cannot initialize %s compression", compressors[job->opts->compress].name);
+
+    // zero: ranges may be holes at an output file of its own
+    int holes = out_file && out_file != stdout && !job->out_file && !job->zsink && !job->tee &&
+                !job->out_pos;  // the output may have data there
+#ifndef _WIN32
+    struct stat st;
+    holes = holes && !fstat(fileno(out_file), &st) && S_ISREG(st.st_mode);
+#endif
+
+    VERBOSE("- About to copy overall %lld bytes to '%s'%s ...\n",
+            (long long)expected_output_size, out_name,
+            strcmp(out_name, "-") ? "" : " (stdout)");
+
+    cc_off_t total_processed = 0;
+    cc_off_t patch_base = 0;  // --patch: the output offset is patch_base + total_processed
+    t0 = cc_now_ns();
+
+    pf.depth = job->zsrc || job->rescue ? 0 : job->opts->prefetch;
+    pf.vcat = job->vcat;
+    if (pf.depth) {
+        range_iter_init(&pf.it, job->ranges, job->nranges, in_size);
+        pf.cur.from = pf.cur.to = pf.ahead = 0;
+        prefetch_advance(&pf, in_file, 0);
+    }
+
+    // the input is open and read ahead, now wait for the shared output. A
+    // frame is a LENGTH<TAB>IN_FILE<LF> header and then LENGTH bytes.
+    if (job->out_lock) {
+        cc_mutex_lock(job->out_lock);
+        framing = 1;
+        if (cc_fprintf(out_file, "%lld\t%s\n", (long long)expected_output_size, job->in_name) < 0 ||
+            fflush(out_file))
+        {
+            JOB_ERR("cannot write to output file");
+        }
+    }
+
+    if (job->opts->nocache) {
+        nocache_start(&nc, in_file, out_file);
+        if (job->zsrc)
+            nc.in_fd = -1;  // the ranges aren't input offsets
+        nc.vcat = job->vcat;
+    }
+
+    if (job->opts->progress || job->opts->progress_fd >= 0) {
+        progress_start(&progress, expected_output_size, job->opts->progress, job->opts->progress_fd);
+        has_progress = 1;
+    }
+
+#ifdef CC_HAVE_PREADV
+    // many small ranges: gather them (not when metering the I/O by size)
+    if (min_range <= GATHER_MAX_PIECE && !job->zsrc && !job->vcat && !job->opts->throttle &&
+        !job->rescue &&
+        !(gbuf = malloc(GATHER_BUF + GATHER_MAX_GAP)))
+    {
+        JOB_ERR("out of memory");
+    }
+#endif
+
+    range_iter_init(&it, job->ranges, job->nranges, in_size);
+    while (expected_output_size && (r = range_next(&it, &range)) > 0) {
+        if (job->stats)
+            job->stats->cur = &job->stats->ranges[it.i - 1];
+
+        // once per RANGE, not per repetition of it
+        if (job->opts->sync == SYNC_RANGE && !it.nrep && total_processed && out_file &&
+            !out_sync(out_file, 1))
+        {
+            JOB_ERR("cannot sync the output file: %s", strerror(errno));
+        }
+
+        if (job->opts->patch) {
+            cc_off_t at;
+            range_out_at(&it, patch_size, patch_base + total_processed, &at);  // valid, see above
+            if (job->engine == ENGINE_STDIO && at != patch_base + total_processed &&
+                cc_fseek(out_file, at, SEEK_SET))
+            {
+                JOB_ERR("cannot seek output file to offset %lld", (long long)at);
+            }
+            job->out_at = at;
+            patch_base = at - total_processed;
+        } else if (job->rescue) {
+            job->out_at = total_processed;
+        }
+
+        if (it.gen) {
+            if (!gen_write(job, out_file, buf, buf_size, &it, range.to, holes))
+                goto exit_L;
+            total_processed += range.to;
+            job->copied = total_processed;
+            if (job->stats)
+                job->stats->cur->bytes += range.to;
+            if (has_progress) {
+                cc_atomic_add(&progress.done, (long long)range.to);
+                progress_poll(&progress);
+            }
+            continue;
+        }
+
+#ifdef CC_HAVE_PREADV
+        if (gbuf && range.to - range.from <= GATHER_MAX_PIECE && range.to > range.from) {
+            size_t got;
+            if (!gather_copy(job, in_file, out_file, gbuf, GATHER_BUF, gbuf + GATHER_BUF, &it, &range,
+                             &span, &got))
+            {
+                goto exit_L;
+            }
+            total_processed += got;
+            job->copied = total_processed;
+
+            if (pf.depth)
+                prefetch_advance(&pf, in_file, total_processed);
+            if (job->opts->nocache)
+                nocache_update(&nc, out_file, span.from, (size_t)(span.to - span.from),
+                               job->zsink ? zsink_written(job->zsink) : total_processed);
+            if (has_progress) {
+                cc_atomic_add(&progress.done, (long long)got);
+                progress_poll(&progress);
+            }
+            continue;
+        }
+#endif
+
+        if (job->engine == ENGINE_STDIO && !job->zsrc && !job->vcat &&
+            cc_fseek(in_file, range.from, SEEK_SET))
+            JOB_ERR("cannot seek input file to offset %lld", (long long)range.from);
+
+        cc_off_t toread = range.to - range.from;
+        while (toread) {
+            size_t got = (size_t)(cc_min(toread, (cc_off_t)job->io_size));
+            if (job->opts->throttle) {
+                // the kernel engines copy with one call, the others read and write
+                int kernel = job->engine == ENGINE_SENDFILE || job->engine == ENGINE_COPY_FILE_RANGE;
+                got = throttle(job->opts->throttle, got, kernel ? 1 : 2);
+            }
+            if (job->rescue ? !rescue_copy(job, in_file, out_file, buf, range.to - toread, got, total_processed)
+                : job->vcat ? !vcat_copy(job, out_file, buf, range.to - toread, got)
+                            : !copy_chunk(job, in_file, out_file, buf, range.to - toread, got))
+            {
+                goto exit_L;
+            }
+
+            if (tuner.size)
+                tuner_update(job, &tuner, got);
+
+            toread -= got;
+            total_processed += got;
+            job->copied = total_processed;
+            if (job->stats)
+                job->stats->cur->bytes += got;
+
+            if (pf.depth)
+                prefetch_advance(&pf, in_file, total_processed);
+
+            if (job->opts->nocache)
+                nocache_update(&nc, out_file, range.to - toread - got, got,
+                               job->zsink ? zsink_written(job->zsink) : total_processed);
+
+            if (has_progress) {
+                cc_atomic_add(&progress.done, (long long)got);
+                progress_poll(&progress);
+            }
+        }
+    }
+    if (r < 0)
+        JOB_ERR("(Internal): range became invalid?! '%s'", job->ranges[it.i - 1]);
+
+    if (job->rescue) {
+        // what failed, in smaller reads
+        if (!rescue_retry(job, in_file, out_file, buf, buf_size))
+            goto exit_L;
+        if (rescue_bytes(job->rescue, RESCUE_BAD)) {
+            cc_fprintf(stderr, "- Rescue: %lld bytes could not be read and are zeros at the output, see '%s'\n",
+                       (long long)rescue_bytes(job->rescue, RESCUE_BAD), job->opts->rescue);
+        }
+    }
+
+    if (job->opts->follow && !follow_input(job, &in_file, out_file, buf, buf_size, in_size))
+        goto exit_L;
+
+    cc_off_t out_size = total_processed;
+    if (job->zsink) {
+        zsink_t *z = job->zsink;
+        job->zsink = NULL;
+        if (!zsink_close(z, 1, &out_size))
+            JOB_ERR("cannot compress or write to output file");
+        VERBOSE("-   Compressed %lld bytes to %lld bytes\n",
+                (long long)total_processed, (long long)out_size);
+    }
+
+    if (job->tee) {
+        const char *failed;
+        tee_t *tee = job->tee;
+        job->tee = NULL;
+        if (!tee_close(tee, 1, &failed))
+            JOB_ERR("cannot write to output file '%s'", failed);
+    }
+
+    if (job->fields) {
+        const char *failed;
+        fields_t *fields = job->fields;
+        job->fields = NULL;
+        if (!fields_close(fields, 1, &failed))
+            JOB_ERR("cannot write to output file '%s'", failed);
+    }
+
+    if (job->opts->sync && out_file && !out_sync(out_file, 0))
+        JOB_ERR("cannot sync the output file: %s", strerror(errno));
+
+    if (job->opts->nocache)
+        nocache_finish(&nc, out_file, out_size);
+    STAT_PHASE(copy_ns, t0);
+
+    if (opt_verbose && out_file && !fflush(out_file)) {
+        long extents = out_extents(out_file);
+        if (extents >= 0)
+            VERBOSE("-   Output file extents: %ld\n", extents);
+    }
+
+    rv = 1;
+
+exit_L:
+    if (job->zsink) {  // failed
+        zsink_close(job->zsink, 0, NULL);
+        job->zsink = NULL;
+    }
+    if (job->tee) {
+        tee_close(job->tee, 0, NULL);
+        job->tee = NULL;
+    }
+    if (job->fields) {
+        fields_close(job->fields, 0, NULL);
+        job->fields = NULL;
+    }
+    if (job->rescue) {
+        // also of a failed copy, to continue from
+        if (!rescue_close(job->rescue, job->started) && rv) {
+            snprintf(job->err, sizeof(job->err), "cannot write the map '%s'", job->opts->rescue);
+            rv = 0;
+        }
+        job->rescue = NULL;
+    }
+    if (has_progress)
+        progress_stop(&progress, rv);
+    else if (!rv && job->opts->progress_fd >= 0)
+        progress_failed(job->opts->progress_fd, expected_output_size);  // before it started
+
+    if (framing) {
+        // keep the next frames readable: pad a failed frame to its length
+        cc_off_t pad = rv ? 0 : expected_output_size - job->copied;
+        if (pad)
+            memset(buf, 0, buf_size);
+        while (pad > 0 && fwrite(buf, (size_t)cc_min(pad, (cc_off_t)buf_size), 1, out_file) == 1)
+            pad -= cc_min(pad, (cc_off_t)buf_size);
+        if (fflush(out_file) && rv) {
+            snprintf(job->err, sizeof(job->err), "cannot write to output file");
+            rv = 0;
+        }
+        cc_mutex_unlock(job->out_lock);
+    }
+
+    t0 = cc_now_ns();
+    if (job->zsrc) {
+        zsrc_close(job->zsrc);
+        job->zsrc = NULL;
+    }
+    if (job->vcat) {
+        vcat_close(job->vcat);
+        job->vcat = NULL;
+    }
+    if (in_file && in_file != job->in_file)
+        fclose(in_file);
+    if (!rv && reserved && out_file)
+        out_unreserve(out_file, expected_output_size);
+    if (out_file && out_file != stdout && out_file != job->out_file && fclose(out_file) && rv) {
+        snprintf(job->err, sizeof(job->err), "cannot write to output file");
+        rv = 0;
+    }
+    if (buf != job->buf && job->keep_buf) {
+        iobuf_free(job->buf, job->buf_size);
+        job->buf = buf;
+        job->buf_size = buf_size;
+    } else if (buf != job->buf) {
+        iobuf_free(buf, buf_size);
+    }
+    free(gbuf);
+
+    if (job->stats) {
+        STAT_PHASE(close_ns, t0);
+        print_stats(job, rv);
+        free(job->stats->ranges);
+        free(job->stats);
+        job->stats = NULL;
+    }
+    if (job->ranges != ranges_arg) {
+        free(job->ranges);
+        job->ranges = ranges_arg;
+    }
+
+    return rv;
+}
+
+static void stats_op(job_stats_t *stats, lat_hist_t *hist, uint64_t t0);
+
+#ifdef CC_HAVE_PREAD
+// Writes all len bytes of buf to fd, at *at if at isn't NULL (and advances
+// it), else at the file offset. Returns 1 on success, 0 on error.
+static int write_all(job_t *job, int fd, const char *buf, size_t len, cc_off_t *at)
+{
+    while (len) {
+        STAT_T0();
+        ssize_t n = at ? pwrite(fd, buf, len, *at) : write(fd, buf, len);
+        STAT_OP(write);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        if (at)
+            *at += n;
+        buf += n;
+        len -= n;
+    }
+    return 1;
+}
+#endif
+
+// Writes len bytes of buf to the output: split to the field outputs with
+// --fields, via the compressor if compressing, else with stdio or write() as
+// the engine does, and to the other -o outputs.
+// Returns 1 on success, or 0 with job->err set.
+static int write_out(job_t *job, FILE *out_file, const char *buf, size_t len)
+{
+    int ok;
+    if (job->fields) {
+        STAT_T0();
+        ok = fields_write(job->fields, buf, len);
+        STAT_OP(write);
+        if (!ok)
+            JOB_ERR("cannot write to output file '%s'", fields_failed(job->fields));
+        return 1;
+    }
+    if (job->zsink || job->engine == ENGINE_STDIO) {
+        STAT_T0();
+        ok = job->zsink ? zsink_write(job->zsink, buf, len) : fwrite(buf, 1, len, out_file) == len;
+        STAT_OP(write);
+    } else {
+#ifdef CC_HAVE_PREAD
+        ok = write_all(job, fileno(out_file), buf, len,
+                       job->out_pos ? &job->out_at : NULL);
+#else
+        ok = 0;
+#endif
+    }
+    if (!ok)
+        JOB_ERR("cannot write to output file");
+    if (job->tee && !job->zsink && !tee_write(job->tee, buf, len))
+        JOB_ERR("cannot write to output file '%s'", tee_failed(job->tee));
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+#ifdef CC_HAVE_PREADV
+// Copies *first, and the next ranges of it while they are small, ascending,
+// close to each other and fit in buf (buf_size bytes), with one preadv: the
+// ranges are read to buf back to back, and the gaps between them to gap
+// (GATHER_MAX_GAP bytes). The ranges which don't fit are left at it, and with
+// --sync range also those of the next RANGE.
+// Returns 1 with *span the input which was read and *got the bytes written,
+// or 0 with job->err set.
+int gather_copy(job_t *job, FILE *in_file, FILE *out_file, char *buf, size_t buf_size,
+                char *gap, range_iter_t *it, const range_t *first, range_t *span, size_t *got)
+{
+    struct iovec iov[GATHER_IOV];
+    int niov = 1;
+    size_t out = (size_t)(first->to - first->from);
+    range_t next;
+    range_stats_t *cur = job->stats ? job->stats->cur : NULL;
+    uint64_t reads = cur ? cur->reads : 0, writes = cur ? cur->writes : 0;
+
+    if (cur)
+        cur->bytes += out;
+
+    iov[0].iov_base = buf;
+    iov[0].iov_len = out;
+    span->from = first->from;
+    span->to = first->to;
+
+    while (niov + 2 <= GATHER_IOV) {
+        range_iter_t save = *it;
+        if (range_next(it, &next) <= 0 || it->gen || it->at || next.from < span->to ||
+            (job->opts->sync == SYNC_RANGE && !it->nrep) ||
+            next.from - span->to > GATHER_MAX_GAP || next.to - next.from > GATHER_MAX_PIECE ||
+            out + (size_t)(next.to - next.from) > buf_size)
+        {
+            *it = save;  // copied later, one way or another
+            break;
+        }
+        if (next.from == next.to)
+            continue;
+
+        if (next.from > span->to) {
+            iov[niov].iov_base = gap;
+            iov[niov++].iov_len = (size_t)(next.from - span->to);
+        }
+        iov[niov].iov_base = buf + out;
+        iov[niov++].iov_len = (size_t)(next.to - next.from);
+        out += (size_t)(next.to - next.from);
+        span->to = next.to;
+        if (cur)
+            job->stats->ranges[it->i - 1].bytes += next.to - next.from;
+    }
+
+    // preadv may read less than asked (e.g. on signals), then read the rest
+    struct iovec *v = iov;
+    cc_off_t at = span->from;
+    while (niov) {
+        STAT_T0();
+        ssize_t n = preadv(fileno(in_file), v, niov, at);
+        STAT_OP(read);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            JOB_ERR("cannot read from input file");
+        at += n;
+        for (; niov && (size_t)n >= v->iov_len; niov--, v++)
+            n -= v->iov_len;
+        if (niov) {
+            v->iov_base = (char *)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+
+    *got = out;
+    if (!write_out(job, out_file, buf, out))
+        return 0;
+
+    // the I/O of the first range was also of the next ranges which it gathered
+    if (cur) {
+        range_stats_t *r;
+        for (r = cur + 1; r <= &job->stats->ranges[it->i - 1]; r++) {
+            r->reads += cur->reads - reads;
+            r->writes += cur->writes - writes;
+        }
+    }
+    return 1;
+
+exit_L:
+    return 0;
+}
+#endif
+
+// Copies len bytes from offset at of the input to the output, using the job's
+// engine and buf (at least len bytes). With the stdio engine the input should
+// already be positioned at at. Compressed inputs are read like with stdio.
+// Returns 1 on success, or 0 with job->err set.
+int copy_chunk(job_t *job, FILE *in_file, FILE *out_file, char *buf, cc_off_t at, size_t len)
+{
+    if (job->engine == ENGINE_STDIO || job->zsrc) {
+        STAT_T0();
+        size_t got = job->zsrc ? (zsrc_read(job->zsrc, buf, len, at) ? len : 0)
+                               : fread(buf, 1, len, in_file);
+        STAT_OP(read);
+        if (ferror(in_file) || got != len)
+            JOB_ERR("cannot %s input file", job->zsrc ? "decompress the" : "read from");
+
+        return write_out(job, out_file, buf, got);
+    }
+
+#ifdef CC_HAVE_PREAD
+    int in_fd = fileno(in_file);
+    int out_fd = out_file ? fileno(out_file) : -1;  // NULL with --fields
+
+    while (len) {
+        ssize_t n;
+        STAT_T0();
+        switch (job->engine) {
+#ifdef CC_HAVE_SENDFILE
+            case ENGINE_SENDFILE: {
+                off_t off = at;
+                n = sendfile(out_fd, in_fd, &off, len);
+                STAT_OP(copy);
+                break;
+            }
+#endif
+#ifdef CC_HAVE_COPY_FILE_RANGE
+            case ENGINE_COPY_FILE_RANGE: {
+                long long off = at, out_off = job->out_at; // loff_t
+                n = syscall(SYS_copy_file_range, in_fd, &off, out_fd, job->out_pos ? &out_off : NULL,
+                            len, 0);
+                STAT_OP(copy);
+                if (n > 0)
+                    job->out_at += n;
+                break;
+            }
+#endif
+            default:
+                n = pread(in_fd, buf, len, at);
+                STAT_OP(read);
+                if (n > 0 && !write_out(job, out_file, buf, n))
+                    return 0;
+        }
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0 && job->engine != ENGINE_PREAD &&
+            (errno == EINVAL || errno == ENOSYS || errno == EXDEV || errno == EBADF || errno == EOPNOTSUPP))
+        {
+            // files not supported by this kernel engine. pread wouldn't be much worse.
+            job->engine = ENGINE_PREAD;
+            continue;
+        }
+
+        if (n <= 0)
+            JOB_ERR("cannot %s", job->engine == ENGINE_PREAD ? "read from input file"
+                                                            : "copy to output file");
+        at += n;
+        len -= n;
+    }
+
+    return 1;
+#else
+    (void)at;
+    JOB_ERR("(Internal) engine %d is not available", job->engine);
+#endif
+
+exit_L:
+    return 0;
+}
+
+
+///////////////////////////  I/O size and buffers  ///////////////////////////
+
+// Allocates an I/O buffer. Big buffers are mapped at huge page alignment and
+// advised to use (transparent) huge pages, which saves TLB misses and page
+// faults when copying many MBs. Free it with iobuf_free and the same size.
+char *iobuf_alloc(size_t size)
+{
+#if defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+    if (size >= HUGE_PAGE_SIZE) {
+        size_t len = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        char *p = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            // trim to an aligned len
+            size_t head = (HUGE_PAGE_SIZE - (uintptr_t)p % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+            if (head)
+                munmap(p, head);
+            if (HUGE_PAGE_SIZE - head)
+                munmap(p + head + len, HUGE_PAGE_SIZE - head);
+            madvise(p + head, len, MADV_HUGEPAGE);
+            return p + head;
+        }
+    }
+#endif
+    return malloc(size);
+}
+
+void iobuf_free(char *buf, size_t size)
+{
+    if (!buf)
+        return;
+#if defined(MADV_HUGEPAGE) && defined(MAP_ANONYMOUS)
+    if (size >= HUGE_PAGE_SIZE) {
+        munmap(buf, (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+        return;
+    }
+#endif
+    (void)size;
+    free(buf);
+}
+
+#ifdef __linux__
+// Returns the optimal I/O size which the device of fd reports, or 0
+static size_t optimal_io_size(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st))
+        return 0;
+
+#ifdef BLKIOOPT
+    unsigned int opt = 0;
+    if (S_ISBLK(st.st_mode))
+        return ioctl(fd, BLKIOOPT, &opt) ? 0 : opt;
+#endif
+
+    // a file: the queue of its device, or of the parent if it's a partition
+    static const char *paths[] = { "queue/optimal_io_size", "../queue/optimal_io_size" };
+    int i;
+    for (i = 0; i < 2; i++) {
+        char path[128];
+        unsigned long long opt = 0;
+        snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+                 (unsigned)major(st.st_dev), (unsigned)minor(st.st_dev), paths[i]);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        int got = fscanf(f, "%llu", &opt);
+        fclose(f);
+        if (got == 1)
+            return (size_t)opt;
+    }
+    return 0;
+}
+#endif
+
+// Returns the initial --bufsize=auto I/O size: RW_BUFFSIZE or the device's
+// optimal I/O size if bigger, rounded up to a multiple of the files' block
+// size. blksize and optimal are set to what was found (or 0).
+size_t io_size_hint(FILE *in_file, FILE *out_file, size_t *blksize, size_t *optimal)
+{
+    size_t size = RW_BUFFSIZE;
+    *blksize = *optimal = 0;
+
+#ifndef _WIN32
+    struct stat st;
+    if (!fstat(fileno(in_file), &st) && st.st_blksize > 0)
+        *blksize = st.st_blksize;
+    if (out_file && !fstat(fileno(out_file), &st) && st.st_blksize > 0)
+        *blksize = cc_max(*blksize, (size_t)st.st_blksize);
+#else
+    (void)in_file;
+    (void)out_file;
+#endif
+
+#ifdef __linux__
+    *optimal = optimal_io_size(fileno(in_file));
+    if (*optimal > AUTO_MAX_BUFSIZE)
+        *optimal = 0;  // bogus
+#endif
+
+    size = cc_max(size, *optimal);
+    if (*blksize > 1 && *blksize <= AUTO_MAX_BUFSIZE)
+        size = (size + *blksize - 1) / *blksize * *blksize;
+    return cc_min(size, (size_t)AUTO_MAX_BUFSIZE);
+}
+
+// Starts measuring I/O size candidates from size, in multiples of blksize
+void tuner_start(io_tuner_t *t, size_t size, size_t blksize)
+{
+    memset(t, 0, sizeof(*t));
+    t->min = cc_max((size_t)AUTO_MIN_BUFSIZE, blksize);
+    t->max = AUTO_MAX_BUFSIZE;
+    t->size = t->first = size;
+    t->dir = 1;
+}
+
+// Called after each copied chunk while tuning. Once size was measured over
+// TUNE_BYTES, moves to the next candidate, or sets the best and stops.
+void tuner_update(job_t *job, io_tuner_t *t, size_t got)
+{
+    uint64_t now = cc_now_ns();
+    if (!t->t0) {
+        t->t0 = now;  // the first chunk at a new size only warms up
+        return;
+    }
+
+    t->bytes += got;
+    if (t->bytes < TUNE_BYTES || now == t->t0)
+        return;
+
+    double rate = t->bytes / ((now - t->t0) / 1e9);
+    size_t next = 0;
+    if (!t->best || rate > t->best_rate * TUNE_GAIN) {
+        t->best = t->size;
+        t->best_rate = rate;
+        next = t->dir > 0 ? t->size * 2 : t->size / 2;
+    }
+    if (t->dir > 0 && (!next || next > t->max) && t->best == t->first) {
+        t->dir = -1;  // bigger didn't help, try smaller
+        next = t->first / 2;
+    }
+    if (next < t->min || next > t->max)
+        next = 0;
+
+    int opt_verbose = job->opts->verbose;
+    VERBOSE("-   Auto I/O size: %lld -> %.1f MB/s\n", (long long)t->size, rate / 1e6);
+
+    t->t0 = 0;
+    t->bytes = 0;
+    t->size = next;
+    job->io_size = next ? next : t->best;
+    if (!next)
+        VERBOSE("-   Auto I/O size: using %lld\n", (long long)job->io_size);
+}
+
+
+//////////////////////////  --max-rate and --max-iops  //////////////////////////
+
+void throttle_init(throttle_t *t, double rate, double iops)
+{
+    memset(t, 0, sizeof(*t));
+    t->rate = rate;
+    t->iops = iops;
+    t->max_io = rate ? cc_max((size_t)(rate * THROTTLE_BURST), (size_t)THROTTLE_MIN_IO) : (size_t)-1;
+    t->last_ns = cc_now_ns();
+    cc_mutex_init(&t->lock);
+}
+
+// Takes the tokens for copying up to len bytes with calls I/O calls (e.g. a
+// read and a write), and sleeps while the buckets are in debt. Returns how
+// many bytes should be copied.
+size_t throttle(throttle_t *t, size_t len, int calls)
+{
+    double wait = 0;
+    len = cc_min(len, t->max_io);
+
+    cc_mutex_lock(&t->lock);
+    uint64_t now = cc_now_ns();
+    double dt = (now - t->last_ns) / 1e9;
+    t->last_ns = now;
+
+    if (t->rate) {
+        t->bytes = cc_min(t->bytes + dt * t->rate, t->rate * THROTTLE_BURST) - len;
+        if (t->bytes < 0)
+            wait = -t->bytes / t->rate;
+    }
+    if (t->iops) {
+        t->ops = cc_min(t->ops + dt * t->iops, cc_max((double)calls, t->iops * THROTTLE_BURST)) - calls;
+        if (t->ops < 0)
+            wait = cc_max(wait, -t->ops / t->iops);
+    }
+    cc_mutex_unlock(&t->lock);
+
+    if (wait > 0)
+        cc_sleep_ns((uint64_t)(wait * 1e9));
+    return len;
+}
+
+
+//////////////////////////////  Output preallocation  //////////////////////////////
+
+// Reserves size bytes of a regular output file from its current offset, so
+// it's not fragmented by the appending writes, and so a lack of space fails
+// now rather than mid-copy. The file size is unchanged (it grows as written).
+// Returns 0 with errno if there's not enough space, else 1 (also if the file
+// or the OS doesn't support it).
+int out_preallocate(FILE *out_file, cc_off_t size)
+{
+#ifdef CC_HAVE_FALLOCATE
+    int fd = fileno(out_file);
+    struct stat st;
+    if (size <= 0 || fstat(fd, &st) || !S_ISREG(st.st_mode))
+        return 1;
+
+    off_t at = lseek(fd, 0, SEEK_CUR);
+    if (at < 0 || !fallocate(fd, FALLOC_FL_KEEP_SIZE, at, size))
+        return 1;
+
+    return errno != ENOSPC && errno != EDQUOT && errno != EFBIG;
+#else
+    (void)out_file;
+    (void)size;
+    return 1;
+#endif
+}
+
+// After a failed copy: frees what out_preallocate reserved (size bytes from
+// offset 0) beyond the end of the file, by truncating it to its size.
+void out_unreserve(FILE *out_file, cc_off_t size)
+{
+#ifdef CC_HAVE_FALLOCATE
+    struct stat st;
+    if (!fflush(out_file) && !fstat(fileno(out_file), &st) && S_ISREG(st.st_mode) && st.st_size < size &&
+        ftruncate(fileno(out_file), st.st_size))
+    {
+        return;  // then it's kept until the file is removed
+    }
+#else
+    (void)out_file;
+    (void)size;
+#endif
+}
+
+// Returns the number of extents of the output file (1 is not fragmented), or
+// -1 if unknown.
+long out_extents(FILE *out_file)
+{
+#ifdef FS_IOC_FIEMAP
+    struct fiemap fm;
+    memset(&fm, 0, sizeof(fm));
+    fm.fm_length = FIEMAP_MAX_OFFSET;  // fm_extent_count 0: only count them
+    if (!ioctl(fileno(out_file), FS_IOC_FIEMAP, &fm))
+        return (long)fm.fm_mapped_extents;
+#else
+    (void)out_file;
+#endif
+    return -1;
+}
+
+// Flushes the output file to the disk: its data, or also its metadata (size,
+// times) unless data_only. Returns 0 with errno on error. Not syncable (pipes,
+// terminals) is not an error.
+int out_sync(FILE *out_file, int data_only)
+{
+    if (fflush(out_file))
+        return 0;
+#ifdef _WIN32
+    (void)data_only;
+    if (_commit(_fileno(out_file)) && errno != EBADF)
+        return 0;
+#else
+    if ((data_only ? fdatasync(fileno(out_file)) : fsync(fileno(out_file))) && errno != EINVAL &&
+        errno != ENOTSUP)
+    {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+
+//////////////////////////////////  --nocache  //////////////////////////////////
+
+// Instead of O_DIRECT (alignment constraints, no readahead), the copy goes
+// through the page cache as usual, but the output is written back in windows
+// (sync_file_range where available) and then dropped with the consumed input
+// (posix_fadvise DONTNEED), so dirty memory and the cache footprint stay flat.
+
+#ifdef POSIX_FADV_DONTNEED
+// Drops the consumed input, but unless all, keeps the part after the last
+// NOCACHE_ALIGN boundary for later.
+static void nocache_drop_input(nocache_t *nc, int all)
+{
+    cc_off_t from = nc->in.from / NOCACHE_ALIGN * NOCACHE_ALIGN;
+    cc_off_t to = all ? nc->in.to : nc->in.to / NOCACHE_ALIGN * NOCACHE_ALIGN;
+    if (to > from && nc->in_fd >= 0) {
+        if (nc->vcat)
+            vcat_advise(nc->vcat, from, to - from, POSIX_FADV_DONTNEED);
+        else
+            posix_fadvise(nc->in_fd, from, to - from, POSIX_FADV_DONTNEED);
+        nc->in.from = to;
+    }
+    if (all)
+        nc->in.from = nc->in.to;
+}
+
+// Starts the write back of the output up to end as the next window, then
+// waits for the write back of the current window and drops it.
+static void nocache_next_window(nocache_t *nc, cc_off_t end)
+{
+#ifdef CC_HAVE_SYNC_FILE_RANGE
+    if (end > nc->out_to)
+        sync_file_range(nc->out_fd, nc->out_to, end - nc->out_to, SYNC_FILE_RANGE_WRITE);
+    if (nc->out_to > nc->out_from) {
+        sync_file_range(nc->out_fd, nc->out_from, nc->out_to - nc->out_from,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+#else
+    // no async write back, but dirty pages can't be dropped otherwise
+    fdatasync(nc->out_fd);
+#endif
+    if (nc->out_to > nc->out_from)
+        posix_fadvise(nc->out_fd, nc->out_from, nc->out_to - nc->out_from, POSIX_FADV_DONTNEED);
+    nc->out_from = nc->out_to;
+    nc->out_to = end;
+}
+#endif
+
+void nocache_start(nocache_t *nc, FILE *in_file, FILE *out_file)
+{
+    memset(nc, 0, sizeof(*nc));
+    nc->in_fd = in_file ? fileno(in_file) : -1;
+    nc->out_fd = out_file ? fileno(out_file) : -1;
+#ifdef CC_HAVE_PREAD
+    // stdout may be a file which is appended to, or a pipe
+    nc->out_base = nc->out_fd >= 0 ? lseek(nc->out_fd, 0, SEEK_CUR) : -1;
+    if (nc->out_base < 0)
+        nc->out_fd = -1;
+#endif
+    nc->out_from = nc->out_to = nc->out_base;
+}
+
+// After len bytes from input offset in_at were copied, and overall done bytes
+// were written to the output.
+void nocache_update(nocache_t *nc, FILE *out_file, cc_off_t in_at, size_t len, cc_off_t done)
+{
+#ifdef POSIX_FADV_DONTNEED
+    if (in_at != nc->in.to) {
+        // skipped input may have been read ahead by the OS, drop it too
+        if (in_at > nc->in.to && nc->in.to > nc->in.from)
+            nc->in.to = cc_min(in_at, nc->in.to + NOCACHE_WINDOW);
+        nocache_drop_input(nc, 1);
+    }
+    if (nc->in.from == nc->in.to)
+        nc->in.from = in_at;
+    nc->in.to = in_at + len;
+    if (nc->in.to - nc->in.from >= NOCACHE_WINDOW)
+        nocache_drop_input(nc, 0);
+
+    cc_off_t end = (nc->out_base + done) / NOCACHE_ALIGN * NOCACHE_ALIGN;
+    if (nc->out_fd >= 0 && end - nc->out_to >= NOCACHE_WINDOW) {
+        fflush(out_file);
+        nocache_next_window(nc, end);
+    }
+#else
+    (void)nc; (void)out_file; (void)in_at; (void)len; (void)done;
+#endif
+}
+
+// Drops the rest of the input, and writes back and drops the rest of the output.
+void nocache_finish(nocache_t *nc, FILE *out_file, cc_off_t done)
+{
+#ifdef POSIX_FADV_DONTNEED
+    nocache_drop_input(nc, 1);
+    if (nc->out_fd >= 0) {
+        fflush(out_file);
+        nocache_next_window(nc, nc->out_base + done);
+        nocache_next_window(nc, nc->out_base + done);  // waits for the last one
+    }
+#else
+    (void)nc; (void)out_file; (void)done;
+#endif
+}
+
+
+///////////////////////////////////  --compress  ///////////////////////////////////
+
+// The copied data is cut into blocks of COMPRESS_BLOCK bytes, which are
+// compressed independently by a pool of threads into a zstd frame or a gzip
+// member each, and written in order by the job's thread (which only waits
+// when all the blocks are busy). The ring has two blocks per thread, so the
+// threads have work while the oldest block waits to be written.
+// zstd outputs end with a seek table (zstd seekable format), which decoders
+// skip, and which --decompress uses to read ranges without the prefix.
+
+#define ZSTD_SKIPPABLE_MAGIC  0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC   0x8F92EAB1
+
+enum {
+    ZB_FREE,            // the job's thread fills it
+    ZB_QUEUED,
+    ZB_BUSY,            // a thread compresses it
+    ZB_DONE,
+    ZB_FAILED,
+};
+
+typedef struct {
+    char *in;           // COMPRESS_BLOCK bytes
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    int state;
+} zblock_t;
+
+// per thread compression state
+typedef struct {
+    zsink_t *z;
+#ifndef CC_NO_THREADS
+    cc_thread_t thread;
+#endif
+#ifdef CC_HAVE_ZLIB
+    z_stream strm;
+    int strm_ok;
+#endif
+#ifdef CC_HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+#endif
+} zworker_t;
+
+struct zsink_s {
+    int format;
+    int level;
+    FILE *out_file;
+    tee_t *tee;           // -o more than once: the compressed data goes there too
+    cc_off_t written;
+    int failed;
+
+    zblock_t *blocks;
+    int nblocks;
+    size_t out_cap;
+    // block sequence numbers, the block of seq is seq % nblocks
+    long long seq_fill;   // filled by the job's thread
+    long long seq_take;   // next to compress
+    long long seq_write;  // next to write
+
+    uint32_t *frames;     // zstd: compressed and uncompressed size of each frame
+    long long nframes;
+    long long frames_cap;
+
+    zworker_t *workers;   // at least one, for its state
+    int nworkers;
+    int nthreads;         // 0: compress in the job's thread
+    int stop;
+    cc_mutex_t lock;
+    cc_cond_t cond;
+};
+
+static int zworker_init(zworker_t *w, zsink_t *z)
+{
+    memset(w, 0, sizeof(*w));
+    w->z = z;
+#ifdef CC_HAVE_ZLIB
+    if (z->format == COMPRESS_GZIP) {
+        // windowBits 15 + 16: gzip header and trailer, one member per block
+        w->strm_ok = deflateInit2(&w->strm, z->level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+        return w->strm_ok;
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (z->format == COMPRESS_ZSTD)
+        return (w->cctx = ZSTD_createCCtx()) != NULL;
+#endif
+    return 0;
+}
+
+static void zworker_free(zworker_t *w)
+{
+#ifdef CC_HAVE_ZLIB
+    if (w->strm_ok)
+        deflateEnd(&w->strm);
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (w->cctx)
+        ZSTD_freeCCtx(w->cctx);
+#endif
+    (void)w;
+}
+
+// Returns the maximum compressed size of a block
+static size_t zsink_bound(zsink_t *z, zworker_t *w)
+{
+#ifdef CC_HAVE_ZLIB
+    if (z->format == COMPRESS_GZIP)
+        return deflateBound(&w->strm, COMPRESS_BLOCK);
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (z->format == COMPRESS_ZSTD)
+        return ZSTD_compressBound(COMPRESS_BLOCK);
+#endif
+    (void)z;
+    (void)w;
+    return 0;
+}
+
+// Compresses b->in into b->out. Returns 1 on success.
+static int zblock_compress(zworker_t *w, zblock_t *b)
+{
+#ifdef CC_HAVE_ZLIB
+    if (w->z->format == COMPRESS_GZIP) {
+        if (deflateReset(&w->strm) != Z_OK)
+            return 0;
+        w->strm.next_in = (Bytef *)b->in;
+        w->strm.avail_in = (uInt)b->in_len;
+        w->strm.next_out = (Bytef *)b->out;
+        w->strm.avail_out = (uInt)w->z->out_cap;
+        if (deflate(&w->strm, Z_FINISH) != Z_STREAM_END)
+            return 0;
+        b->out_len = w->z->out_cap - w->strm.avail_out;
+        return 1;
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (w->z->format == COMPRESS_ZSTD) {
+        size_t n = ZSTD_compressCCtx(w->cctx, b->out, w->z->out_cap, b->in, b->in_len, w->z->level);
+        if (ZSTD_isError(n))
+            return 0;
+        b->out_len = n;
+        return 1;
+    }
+#endif
+    (void)w;
+    (void)b;
+    return 0;
+}
+
+#ifndef CC_NO_THREADS
+static void *zsink_thread(void *arg)
+{
+    zworker_t *w = arg;
+    zsink_t *z = w->z;
+
+    cc_mutex_lock(&z->lock);
+    while (1) {
+        while (z->seq_take == z->seq_fill && !z->stop)
+            cc_cond_wait(&z->cond, &z->lock);
+        if (z->seq_take == z->seq_fill)
+            break;  // stopped, and nothing is queued
+
+        zblock_t *b = &z->blocks[z->seq_take++ % z->nblocks];
+        b->state = ZB_BUSY;
+        cc_mutex_unlock(&z->lock);
+
+        int ok = zblock_compress(w, b);
+
+        cc_mutex_lock(&z->lock);
+        b->state = ok ? ZB_DONE : ZB_FAILED;
+        cc_cond_broadcast(&z->cond);
+    }
+    cc_mutex_unlock(&z->lock);
+    return NULL;
+}
+#endif
+
+// Waits for the oldest block and writes it. Returns 0 on error.
+static int zsink_write_oldest(zsink_t *z)
+{
+    zblock_t *b = &z->blocks[z->seq_write % z->nblocks];
+
+    cc_mutex_lock(&z->lock);
+    while (b->state == ZB_QUEUED || b->state == ZB_BUSY)
+        cc_cond_wait(&z->cond, &z->lock);
+    cc_mutex_unlock(&z->lock);
+
+    int ok = b->state == ZB_DONE && fwrite(b->out, 1, b->out_len, z->out_file) == b->out_len &&
+             (!z->tee || tee_write(z->tee, b->out, b->out_len));
+    z->written += b->out_len;
+
+    if (ok && z->format == COMPRESS_ZSTD) {
+        if (z->nframes == z->frames_cap) {
+            uint32_t *f = realloc(z->frames, (z->frames_cap * 2 + 64) * 2 * sizeof(uint32_t));
+            if (!f)
+                return 0;
+            z->frames = f;
+            z->frames_cap = z->frames_cap * 2 + 64;
+        }
+        z->frames[z->nframes * 2] = (uint32_t)b->out_len;
+        z->frames[z->nframes * 2 + 1] = (uint32_t)b->in_len;
+        z->nframes++;
+    }
+
+    z->seq_write++;
+    b->state = ZB_FREE;
+    b->in_len = 0;
+    return ok;
+}
+
+// Queues the block which is being filled, after making room for the next one
+static int zsink_submit(zsink_t *z)
+{
+    zblock_t *b = &z->blocks[z->seq_fill % z->nblocks];
+
+    if (!z->nthreads) {
+        b->state = zblock_compress(&z->workers[0], b) ? ZB_DONE : ZB_FAILED;
+        z->seq_fill++;
+        z->seq_take++;
+    } else {
+        cc_mutex_lock(&z->lock);
+        b->state = ZB_QUEUED;
+        z->seq_fill++;
+        cc_cond_broadcast(&z->cond);
+        cc_mutex_unlock(&z->lock);
+    }
+
+    if (z->seq_fill - z->seq_write == z->nblocks)
+        return zsink_write_oldest(z);
+    return 1;
+}
+
+// Returns a compressor which writes to out_file (and to tee if not NULL), or
+// NULL on error
+zsink_t *zsink_open(const cc_opts_t *opts, FILE *out_file, tee_t *tee)
+{
+    zsink_t *z = calloc(1, sizeof(*z));
+    if (!z)
+        return NULL;
+
+    z->format = opts->compress;
+    z->level = opts->compress_level;
+    z->out_file = out_file;
+    z->tee = tee;
+    cc_mutex_init(&z->lock);
+    cc_cond_init(&z->cond);
+
+    int nthreads = 0;  // z->nthreads is set once they're running
+#ifndef CC_NO_THREADS
+    nthreads = opts->compress_threads;
+#endif
+    z->nworkers = cc_max(nthreads, 1);
+    z->nblocks = nthreads ? nthreads * 2 : 1;
+    if (!(z->workers = calloc(z->nworkers, sizeof(zworker_t))) ||
+        !(z->blocks = calloc(z->nblocks, sizeof(zblock_t))))
+    {
+        goto fail_L;
+    }
+
+    int i;
+    for (i = 0; i < z->nworkers; i++) {
+        if (!zworker_init(&z->workers[i], z))
+            goto fail_L;
+    }
+
+    z->out_cap = zsink_bound(z, &z->workers[0]);
+    for (i = 0; i < z->nblocks; i++) {
+        if (!(z->blocks[i].in = malloc(COMPRESS_BLOCK)) || !(z->blocks[i].out = malloc(z->out_cap)))
+            goto fail_L;
+    }
+
+#ifndef CC_NO_THREADS
+    // if not all could start, those which did are enough (or none: inline)
+    for (z->nthreads = 0; z->nthreads < nthreads; z->nthreads++) {
+        if (cc_thread_create(&z->workers[z->nthreads].thread, zsink_thread, &z->workers[z->nthreads]))
+            break;
+    }
+#endif
+    return z;
+
+fail_L:
+    zsink_close(z, 0, NULL);
+    return NULL;
+}
+
+// Compresses len bytes of buf (in the background). Returns 0 on error.
+int zsink_write(zsink_t *z, const char *buf, size_t len)
+{
+    while (len && !z->failed) {
+        zblock_t *b = &z->blocks[z->seq_fill % z->nblocks];
+        size_t n = cc_min(len, COMPRESS_BLOCK - b->in_len);
+        memcpy(b->in + b->in_len, buf, n);
+        b->in_len += n;
+        buf += n;
+        len -= n;
+
+        if (b->in_len == COMPRESS_BLOCK && !zsink_submit(z))
+            z->failed = 1;
+    }
+    return !z->failed;
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+// Writes the zstd seek table: a skippable frame with the sizes of the frames,
+// then the number of frames, descriptor (no checksums) and magic.
+static int zsink_write_seek_table(zsink_t *z)
+{
+    size_t size = z->nframes * 8 + 9;
+    unsigned char *t = malloc(8 + size);
+    if (!t || (uint64_t)z->nframes > 0xffffffffu || size > 0xffffffffu) {
+        free(t);
+        return 0;
+    }
+
+    long long i;
+    put_le32(t, ZSTD_SKIPPABLE_MAGIC);
+    put_le32(t + 4, (uint32_t)size);
+    for (i = 0; i < z->nframes * 2; i++)
+        put_le32(t + 8 + i * 4, z->frames[i]);
+    put_le32(t + 8 + size - 9, (uint32_t)z->nframes);
+    t[8 + size - 5] = 0;
+    put_le32(t + 8 + size - 4, ZSTD_SEEKABLE_MAGIC);
+
+    int ok = fwrite(t, 1, 8 + size, z->out_file) == 8 + size &&
+             (!z->tee || tee_write(z->tee, (char *)t, 8 + size));
+    z->written += 8 + size;
+    free(t);
+    return ok;
+}
+
+// Output bytes which were written so far
+cc_off_t zsink_written(const zsink_t *z)
+{
+    return z->written;
+}
+
+// If finish, compresses and writes the rest, and sets *written to the size
+// of the whole output (an empty input is still one valid frame/member).
+// Returns 0 on error, or if not finish. Frees z.
+int zsink_close(zsink_t *z, int finish, cc_off_t *written)
+{
+    int i;
+    if (finish && !z->failed) {
+        if (z->blocks[z->seq_fill % z->nblocks].in_len || !z->seq_fill) {
+            if (!zsink_submit(z))
+                z->failed = 1;
+        }
+        while (!z->failed && z->seq_write < z->seq_fill) {
+            if (!zsink_write_oldest(z))
+                z->failed = 1;
+        }
+        if (!z->failed && z->format == COMPRESS_ZSTD && !zsink_write_seek_table(z))
+            z->failed = 1;
+    }
+
+#ifndef CC_NO_THREADS
+    if (z->nthreads) {
+        cc_mutex_lock(&z->lock);
+        z->stop = 1;
+        z->seq_fill = z->seq_take;  // drop what's still queued
+        cc_cond_broadcast(&z->cond);
+        cc_mutex_unlock(&z->lock);
+        for (i = 0; i < z->nthreads; i++)
+            cc_thread_join(z->workers[i].thread);
+    }
+#endif
+
+    int ok = finish && !z->failed;
+    if (written)
+        *written = z->written;
+
+    for (i = 0; z->workers && i < z->nworkers; i++)
+        zworker_free(&z->workers[i]);
+    for (i = 0; z->blocks && i < z->nblocks; i++) {
+        free(z->blocks[i].in);
+        free(z->blocks[i].out);
+    }
+    free(z->workers);
+    free(z->blocks);
+    free(z->frames);
+    cc_cond_destroy(&z->cond);
+    cc_mutex_destroy(&z->lock);
+    free(z);
+    return ok;
+}
+
+
+/////////////////////////////  -o more than once: tee  /////////////////////////////
+
+// The job writes to the first output as usual, and the same data is also
+// copied once into blocks of TEE_BLOCK bytes, which are queued to a writer
+// thread per other output. A queue holds up to --tee-lag bytes, and when a
+// slow output has that much queued, the copy waits for it, so it doesn't
+// hold back the others by more than that. Without threads, each block is
+// written to the other outputs in turn.
+
+typedef struct tee_block_s {
+    struct tee_block_s *next;   // in the free list
+    int refs;                   // outputs which didn't write it yet
+    size_t len;
+    char *data;                 // TEE_BLOCK bytes, after the struct
+} tee_block_t;
+
+typedef struct {
+    tee_t *tee;
+    const char *name;
+    FILE *file;
+    tee_block_t **q;            // ring of tee->qcap blocks
+    int head, count;
+    int failed;
+    cc_off_t written;
+    int nocache;
+    nocache_t nc;
+#ifndef CC_NO_THREADS
+    cc_thread_t thread;
+    int running;
+#endif
+} tee_out_t;
+
+struct tee_s {
+    cc_mutex_t lock;
+    cc_cond_t cond;             // a block was queued or written, or closing
+    tee_out_t *outs;
+    int nouts;
+    int qcap;
+    tee_block_t *cur;           // being filled by the job
+    tee_block_t *free;
+    int closing;
+    int abort;                  // closing without writing the rest
+};
+
+static int tee_out_write(tee_out_t *o, tee_block_t *b)
+{
+    if (o->failed || fwrite(b->data, 1, b->len, o->file) != b->len)
+        return 0;
+    o->written += b->len;
+    if (o->nocache)
+        nocache_update(&o->nc, o->file, 0, 0, o->written);
+    return 1;
+}
+
+// Returns b to the free list once all the outputs wrote it. Tee locked.
+static void tee_release(tee_t *t, tee_block_t *b)
+{
+    if (--b->refs == 0) {
+        b->next = t->free;
+        t->free = b;
+    }
+}
+
+#ifndef CC_NO_THREADS
+static void *tee_thread(void *arg)
+{
+    tee_out_t *o = arg;
+    tee_t *t = o->tee;
+
+    cc_mutex_lock(&t->lock);
+    while (1) {
+        while (!o->count && !t->closing)
+            cc_cond_wait(&t->cond, &t->lock);
+        if (!o->count)
+            break;
+
+        tee_block_t *b = o->q[o->head];
+        int skip = t->abort;
+        cc_mutex_unlock(&t->lock);
+
+        int ok = skip || tee_out_write(o, b);
+
+        cc_mutex_lock(&t->lock);
+        if (!ok)
+            o->failed = 1;
+        o->head = (o->head + 1) % t->qcap;
+        o->count--;
+        tee_release(t, b);
+        cc_cond_broadcast(&t->cond);
+    }
+    cc_mutex_unlock(&t->lock);
+    return NULL;
+}
+#endif
+
+// Queues the current block to all the outputs, after waiting for room at
+// their queues. Returns 0 if an output failed.
+static int tee_submit(tee_t *t)
+{
+    tee_block_t *b = t->cur;
+    int i, ok = 1;
+    t->cur = NULL;
+    if (!b)
+        return 1;
+
+    cc_mutex_lock(&t->lock);
+    b->refs = 1;  // until it's queued to all
+#ifndef CC_NO_THREADS
+    for (i = 0; i < t->nouts; i++) {
+        tee_out_t *o = &t->outs[i];
+        while (o->running && !o->failed && o->count == t->qcap)
+            cc_cond_wait(&t->cond, &t->lock);
+        if (o->failed) {
+            ok = 0;
+        } else if (o->running) {
+            o->q[(o->head + o->count++) % t->qcap] = b;
+            b->refs++;
+        }
+    }
+    cc_cond_broadcast(&t->cond);
+#endif
+    cc_mutex_unlock(&t->lock);
+
+    // outputs without a thread are written here
+    for (i = 0; i < t->nouts; i++) {
+        tee_out_t *o = &t->outs[i];
+#ifndef CC_NO_THREADS
+        if (o->running)
+            continue;
+#endif
+        if (!tee_out_write(o, b)) {
+            o->failed = 1;
+            ok = 0;
+        }
+    }
+
+    cc_mutex_lock(&t->lock);
+    tee_release(t, b);
+    cc_mutex_unlock(&t->lock);
+    return ok;
+}
+
+// Writes len bytes of buf to all the other outputs. Returns 0 if one failed.
+int tee_write(tee_t *t, const char *buf, size_t len)
+{
+    while (len) {
+        if (!t->cur) {
+            cc_mutex_lock(&t->lock);
+            if ((t->cur = t->free))
+                t->free = t->cur->next;
+            cc_mutex_unlock(&t->lock);
+            if (!t->cur && (t->cur = malloc(sizeof(tee_block_t) + TEE_BLOCK)))
+                t->cur->data = (char *)(t->cur + 1);
+            if (!t->cur)
+                return 0;
+            t->cur->len = 0;
+        }
+
+        size_t n = cc_min(len, TEE_BLOCK - t->cur->len);
+        memcpy(t->cur->data + t->cur->len, buf, n);
+        t->cur->len += n;
+        buf += n;
+        len -= n;
+        if (t->cur->len == TEE_BLOCK && !tee_submit(t))
+            return 0;
+    }
+    return 1;
+}
+
+// The name of an output which failed, for error messages
+const char *tee_failed(const tee_t *t)
+{
+    int i;
+    for (i = 0; i < t->nouts; i++) {
+        if (t->outs[i].failed)
+            return t->outs[i].name;
+    }
+    return t->nouts ? t->outs[0].name : "";
+}
+
+// Creates the n outputs at names, and reserves size bytes at each (unless -1).
+// Returns NULL with err set on error.
+tee_t *tee_open(const cc_opts_t *opts, char **names, int n, cc_off_t size, char *err, size_t errlen)
+{
+    tee_t *t = calloc(1, sizeof(*t));
+    int i;
+    if (!t || !(t->outs = calloc(n, sizeof(tee_out_t)))) {
+        snprintf(err, errlen, "out of memory");
+        free(t);
+        return NULL;
+    }
+    t->qcap = (int)cc_max(1, opts->tee_lag / TEE_BLOCK);
+    cc_mutex_init(&t->lock);
+    cc_cond_init(&t->cond);
+
+    for (i = 0; i < n; i++) {
+        tee_out_t *o = &t->outs[i];
+        o->tee = t;
+        o->name = names[i];
+        if (!(o->file = open_output(names[i], opts->overwrite, err, errlen)))
+            goto fail_L;
+        t->nouts++;
+
+        if (size >= 0 && !out_preallocate(o->file, size)) {
+            snprintf(err, errlen, "not enough space for the output '%s' (%lld bytes): %s",
+                     names[i], (long long)size, strerror(errno));
+            goto fail_L;
+        }
+        if (opts->nocache) {
+            o->nocache = 1;
+            nocache_start(&o->nc, NULL, o->file);
+        }
+
+#ifndef CC_NO_THREADS
+        if (!(o->q = calloc(t->qcap, sizeof(tee_block_t *)))) {
+            snprintf(err, errlen, "out of memory");
+            goto fail_L;
+        }
+        // without a thread, the output is written by the job
+        o->running = !cc_thread_create(&o->thread, tee_thread, o);
+#endif
+    }
+    return t;
+
+fail_L:
+    tee_close(t, 0, NULL);
+    return NULL;
+}
+
+// Waits for the outputs to be written (unless !finish), and closes them.
+// Returns 0 if an output failed, and sets *failed (if not NULL) to its name.
+int tee_close(tee_t *t, int finish, const char **failed)
+{
+    int i, ok = 1;
+    if (finish)
+        ok = tee_submit(t);
+
+    cc_mutex_lock(&t->lock);
+    t->closing = 1;
+    t->abort = !finish;
+    cc_cond_broadcast(&t->cond);
+    cc_mutex_unlock(&t->lock);
+
+    for (i = 0; i < t->nouts; i++) {
+        tee_out_t *o = &t->outs[i];
+#ifndef CC_NO_THREADS
+        if (o->running)
+            cc_thread_join(o->thread);
+        free(o->q);
+#endif
+        if (finish && o->nocache && !o->failed)
+            nocache_finish(&o->nc, o->file, o->written);
+        if ((o->file != stdout ? fclose(o->file) : fflush(o->file)) || o->failed) {
+            o->failed = 1;
+            ok = 0;
+        }
+    }
+    if (failed)
+        *failed = tee_failed(t);
+
+    free(t->cur);
+    while (t->free) {
+        tee_block_t *b = t->free;
+        t->free = b->next;
+        free(b);
+    }
+    cc_cond_destroy(&t->cond);
+    cc_mutex_destroy(&t->lock);
+    free(t->outs);
+    free(t);
+    return ok;
+}
+
+
+///////////////////////  Several inputs: virtual concatenation  ///////////////////////
+
+// With several IN_FILEs the input is their concatenation. Chunks are copied
+// in pieces which don't cross files, each from its own file with the job's
+// engine, so crossing from one file to the next costs no extra copy.
+// The files are opened when first used, and at most VCAT_MAX_OPEN are open,
+// including the first, which stays open.
+
+#define VCAT_MAX_OPEN     16
+
+typedef struct {
+    const char *name;
+    cc_off_t start;     // offset at the virtual input
+    cc_off_t size;
+    FILE *file;         // NULL if not open
+    uint64_t used;      // for closing the least recently used
+} vseg_t;
+
+struct vcat_s {
+    vseg_t *segs;
+    int nsegs;
+    int nopen;          // including the first file
+    uint64_t clock;
+    FILE *pos_file;     // stdio: the file and offset where reading continues
+    cc_off_t pos;
+};
+
+// Returns the concatenation of the n files at names, and sets *size to the
+// sum of their sizes, or returns NULL with err set. The first file is opened
+// by the caller as first, and is not closed by vcat_close.
+vcat_t *vcat_open(char **names, int n, FILE *first, cc_off_t *size, char *err, size_t errlen)
+{
+    vcat_t *v = calloc(1, sizeof(*v));
+    if (!v || !(v->segs = calloc(n, sizeof(vseg_t)))) {
+        free(v);
+        snprintf(err, errlen, "out of memory");
+        return NULL;
+    }
+    v->nsegs = n;
+
+    cc_off_t start = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        vseg_t *s = &v->segs[i];
+        s->name = names[i];
+        s->start = start;
+        s->size = fsize(names[i]);
+        if (s->size < 0) {
+            snprintf(err, errlen, "input file '%s' cannot be opened", names[i]);
+            vcat_close(v);
+            return NULL;
+        }
+        if (!add_safe(start, s->size, &start)) {
+            snprintf(err, errlen, "the inputs are too big");
+            vcat_close(v);
+            return NULL;
+        }
+    }
+    v->segs[0].file = first;
+    v->nopen = 1;
+    *size = start;
+    return v;
+}
+
+void vcat_close(vcat_t *v)
+{
+    int i;
+    for (i = 1; i < v->nsegs; i++) {
+        if (v->segs[i].file)
+            fclose(v->segs[i].file);
+    }
+    free(v->segs);
+    free(v);
+}
+
+// Maps the piece of [at, at + len) which starts at at and is within one file
+// to its offset there and its length. Returns the file's segment, whose file
+// is NULL if it can't be opened.
+static vseg_t *vcat_map(vcat_t *v, cc_off_t at, cc_off_t len, cc_off_t *off, cc_off_t *n)
+{
+    // the last file which starts at or before at (empty files are skipped)
+    int lo = 0, hi = v->nsegs - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (v->segs[mid].start <= at)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    vseg_t *s = &v->segs[lo];
+
+    if (!s->file) {
+        if (v->nopen == VCAT_MAX_OPEN) {
+            vseg_t *lru = NULL;
+            int i;
+            for (i = 1; i < v->nsegs; i++) {
+                if (v->segs[i].file && (!lru || v->segs[i].used < lru->used))
+                    lru = &v->segs[i];
+            }
+            if (lru->file == v->pos_file)
+                v->pos_file = NULL;
+            fclose(lru->file);
+            lru->file = NULL;
+            v->nopen--;
+        }
+        if (!(s->file = cc_fopen(s->name, "rb")))
+            return s;
+        v->nopen++;
+    }
+    s->used = ++v->clock;
+
+    *off = at - s->start;
+    *n = cc_min(len, s->size - *off);
+    return s;
+}
+
+// Copies len bytes from offset at of the concatenation, like copy_chunk
+int vcat_copy(job_t *job, FILE *out_file, char *buf, cc_off_t at, size_t len)
+{
+    vcat_t *v = job->vcat;
+    while (len) {
+        cc_off_t off, n;
+        vseg_t *s = vcat_map(v, at, len, &off, &n);
+        FILE *f = s->file;
+        if (!f)
+            JOB_ERR("input file '%s' cannot be opened", s->name);
+
+        if (job->engine == ENGINE_STDIO && (f != v->pos_file || off != v->pos)) {
+            if (cc_fseek(f, off, SEEK_SET))
+                JOB_ERR("cannot seek input file to offset %lld", (long long)off);
+        }
+        if (!copy_chunk(job, f, out_file, buf, off, (size_t)n))
+            return 0;
+
+        v->pos_file = f;
+        v->pos = off + n;
+        at += n;
+        len -= n;
+    }
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+// posix_fadvise of [at, at + len) of the concatenation
+void vcat_advise(vcat_t *v, cc_off_t at, cc_off_t len, int advice)
+{
+#ifdef POSIX_FADV_WILLNEED
+    while (len > 0) {
+        cc_off_t off, n;
+        vseg_t *s = vcat_map(v, at, len, &off, &n);
+        if (!s->file || !n)
+            return;
+        posix_fadvise(fileno(s->file), off, n, advice);
+        at += n;
+        len -= n;
+    }
+#else
+    (void)v; (void)at; (void)len; (void)advice;
+#endif
+}
+
+
+/////////////////////////  --decompress: compressed inputs  /////////////////////////
+
+// The ranges are of the uncompressed data, which is read by decompressing
+// from the nearest access point before the range, or by continuing if the
+// stream is already between that point and the range.
+// zstd: the access points are the frames, from the seek table at the end of
+// the file (zstd seekable format, also written by --compress=zstd), or by
+// walking the frames headers (one pass over the blocks headers).
+// gzip: zran-style, the inflate state (bit offset and 32K window) every
+// ZSRC_GZ_SPAN bytes at a deflate block boundary, and at members starts.
+// The index takes one pass over the whole input, and is saved to a sidecar
+// file IN_FILE.ccidx which is used while the input size and mtime match. It's
+// in native byte order, with a marker: of another byte order, it's rebuilt.
+
+#define ZSRC_IN_SIZE      (256 * 1024)
+#define ZSRC_GZ_SPAN      (8 * 1024 * 1024)
+#define ZSRC_GZ_WINDOW    32768
+#define ZSRC_IDX_MAGIC    "CCGZIDX2"
+#define ZSRC_IDX_ORDER    0x0102030405060708ULL  // native byte order, as written
+
+typedef struct {
+    cc_off_t out;       // uncompressed offset
+    cc_off_t in;        // compressed offset
+    int bits;           // gzip: bits of the byte before in which belong to it
+    unsigned char *window; // gzip: NULL at a member start
+} zpoint_t;
+
+struct zsrc_s {
+    int format;         // COMPRESS_GZIP or COMPRESS_ZSTD
+    FILE *file;
+    cc_off_t file_size;
+    cc_off_t size;      // uncompressed
+
+    zpoint_t *points;   // sorted by out, the first is at 0
+    int npoints;
+    int points_cap;
+
+    // the stream: pos is the uncompressed offset it produces next (-1: none)
+    cc_off_t pos;
+    unsigned char *in_buf; // compressed data [in_start, in_end) is unused
+    size_t in_start;
+    size_t in_end;
+    cc_off_t in_pos;    // file offset of in_buf + in_end
+    char *skip_buf;
+
+#ifdef CC_HAVE_ZLIB
+    z_stream strm;
+    int strm_ok;
+    int raw;            // the stream is raw deflate (started at a window point)
+#endif
+#ifdef CC_HAVE_ZSTD
+    ZSTD_DStream *dstream;
+#endif
+};
+
+static uint32_t get_le32(const unsigned char *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static size_t zsrc_pread(zsrc_t *s, void *buf, size_t len, cc_off_t at)
+{
+#ifdef CC_HAVE_PREAD
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(fileno(s->file), (char *)buf + done, len - done, at + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    return done;
+#else
+    if (cc_fseek(s->file, at, SEEK_SET))
+        return 0;
+    return fread(buf, 1, len, s->file);
+#endif
+}
+
+#if defined(CC_HAVE_ZLIB) || defined(CC_HAVE_ZSTD)
+// Makes at least n (up to ZSRC_IN_SIZE) compressed bytes available at
+// in_buf + in_start, if not at the end of the file. Returns how many are.
+static size_t zsrc_fill(zsrc_t *s, size_t n)
+{
+    size_t avail = s->in_end - s->in_start;
+    if (avail >= n)
+        return avail;
+
+    memmove(s->in_buf, s->in_buf + s->in_start, avail);
+    s->in_start = 0;
+    s->in_end = avail;
+    size_t got = zsrc_pread(s, s->in_buf + avail, ZSRC_IN_SIZE - avail, s->in_pos);
+    s->in_pos += got;
+    s->in_end += got;
+    return s->in_end;
+}
+
+static int zsrc_add_point(zsrc_t *s, cc_off_t out, cc_off_t in, int bits, unsigned char *window)
+{
+    if (s->npoints == s->points_cap) {
+        int cap = s->points_cap * 2 + 64;
+        zpoint_t *p = realloc(s->points, cap * sizeof(zpoint_t));
+        if (!p)
+            return 0;
+        s->points = p;
+        s->points_cap = cap;
+    }
+    zpoint_t *p = &s->points[s->npoints++];
+    p->out = out;
+    p->in = in;
+    p->bits = bits;
+    p->window = window;
+    return 1;
+}
+#endif
+
+static void zsrc_free_points(zsrc_t *s)
+{
+    int i;
+    for (i = 0; i < s->npoints; i++)
+        free(s->points[i].window);
+    free(s->points);
+    s->points = NULL;
+    s->npoints = s->points_cap = 0;
+}
+
+// Starts the stream at point p
+static int zsrc_seek(zsrc_t *s, const zpoint_t *p)
+{
+    s->pos = -1;
+    s->in_start = s->in_end = 0;
+    s->in_pos = p->in - (p->bits ? 1 : 0);
+
+#ifdef CC_HAVE_ZLIB
+    if (s->format == COMPRESS_GZIP) {
+        if (!p->window) {  // a member starts here
+            s->raw = 0;
+            if (inflateReset2(&s->strm, 15 + 16) != Z_OK)
+                return 0;
+        } else {
+            s->raw = 1;
+            if (inflateReset2(&s->strm, -15) != Z_OK)
+                return 0;
+            if (p->bits) {
+                if (!zsrc_fill(s, 1))
+                    return 0;
+                int byte = s->in_buf[s->in_start++];
+                if (inflatePrime(&s->strm, p->bits, byte >> (8 - p->bits)) != Z_OK)
+                    return 0;
+            }
+            if (inflateSetDictionary(&s->strm, p->window, ZSRC_GZ_WINDOW) != Z_OK)
+                return 0;
+        }
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (s->format == COMPRESS_ZSTD && ZSTD_isError(ZSTD_initDStream(s->dstream)))
+        return 0;
+#endif
+
+    s->pos = p->out;
+    return 1;
+}
+
+#ifdef CC_HAVE_ZLIB
+// After a gzip member ended: skips the trailer if the stream is raw, and
+// prepares for the next member. Returns 0 if there's no next member.
+static int zsrc_gz_next_member(zsrc_t *s)
+{
+    if (s->raw) {
+        if (zsrc_fill(s, 8) < 8)
+            return 0;
+        s->in_start += 8;
+    }
+    if (zsrc_fill(s, 2) < 2 || s->in_buf[s->in_start] != 0x1f || s->in_buf[s->in_start + 1] != 0x8b)
+        return 0;  // the end, maybe with trailing garbage (like gzip)
+
+    s->raw = 0;
+    return inflateReset2(&s->strm, 15 + 16) == Z_OK;
+}
+#endif
+
+// Decompresses exactly len bytes from the stream into buf. Returns 1 on success.
+static int zsrc_out(zsrc_t *s, char *buf, size_t len)
+{
+#ifdef CC_HAVE_ZLIB
+    if (s->format == COMPRESS_GZIP) {
+        z_stream *z = &s->strm;
+        z->next_out = (Bytef *)buf;
+        z->avail_out = (uInt)len;
+        while (z->avail_out) {
+            size_t avail = zsrc_fill(s, 1);
+            uInt before = z->avail_out;
+            z->next_in = s->in_buf + s->in_start;
+            z->avail_in = (uInt)avail;
+            int ret = inflate(z, Z_NO_FLUSH);
+            s->in_start += avail - z->avail_in;
+
+            if (ret == Z_STREAM_END) {
+                if (z->avail_out && !zsrc_gz_next_member(s))
+                    return 0;  // the data ended early
+            } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+                return 0;
+            } else if (!avail && z->avail_out == before) {
+                return 0;  // truncated
+            }
+        }
+        s->pos += len;
+        return 1;
+    }
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (s->format == COMPRESS_ZSTD) {
+        ZSTD_outBuffer out = { buf, len, 0 };
+        while (out.pos < out.size) {
+            size_t avail = zsrc_fill(s, 1);
+            size_t before = out.pos;
+            ZSTD_inBuffer in = { s->in_buf + s->in_start, avail, 0 };
+            size_t ret = ZSTD_decompressStream(s->dstream, &out, &in);
+            s->in_start += in.pos;
+            if (ZSTD_isError(ret) || (!avail && out.pos == before))
+                return 0;
+        }
+        s->pos += len;
+        return 1;
+    }
+#endif
+    (void)s;
+    (void)buf;
+    (void)len;
+    return 0;
+}
+
+#ifdef CC_HAVE_ZSTD
+// Access points from the seek table, returns 0 if there isn't a valid one
+static int zsrc_zstd_seek_table(zsrc_t *s)
+{
+    unsigned char f[9];
+    if (s->file_size < 17 || zsrc_pread(s, f, 9, s->file_size - 9) != 9 ||
+        get_le32(f + 5) != ZSTD_SEEKABLE_MAGIC || (f[4] & 0x7c))
+    {
+        return 0;
+    }
+
+    uint32_t nframes = get_le32(f);
+    size_t esize = f[4] & 0x80 ? 12 : 8;  // with checksums
+    cc_off_t tsize = (cc_off_t)nframes * esize + 9;
+    cc_off_t at = s->file_size - tsize - 8;
+    unsigned char h[8];
+    if (at < 0 || zsrc_pread(s, h, 8, at) != 8 ||
+        get_le32(h) != ZSTD_SKIPPABLE_MAGIC || get_le32(h + 4) != tsize)
+    {
+        return 0;
+    }
+
+    unsigned char *t = malloc(tsize);
+    int ok = t && zsrc_pread(s, t, tsize, at + 8) == (size_t)tsize;
+    cc_off_t in = 0, out = 0;
+    uint32_t i;
+    for (i = 0; ok && i < nframes; i++) {
+        ok = zsrc_add_point(s, out, in, 0, NULL);
+        in += get_le32(t + i * esize);
+        out += get_le32(t + i * esize + 4);
+    }
+    free(t);
+    s->size = out;
+    return ok && in == at;
+}
+
+// Decompresses the frame at in (to its end) to count its uncompressed size
+static int zsrc_zstd_frame_size(zsrc_t *s, cc_off_t in, cc_off_t *size)
+{
+    zpoint_t p = { 0, in, 0, NULL };
+    if (!zsrc_seek(s, &p))
+        return 0;
+
+    *size = 0;
+    s->pos = -1;  // the stream isn't at a known position for reading
+    while (1) {
+        ZSTD_outBuffer out = { s->skip_buf, ZSRC_IN_SIZE, 0 };
+        size_t avail = zsrc_fill(s, 1);
+        ZSTD_inBuffer inb = { s->in_buf + s->in_start, avail, 0 };
+        size_t ret = ZSTD_decompressStream(s->dstream, &out, &inb);
+        s->in_start += inb.pos;
+        *size += out.pos;
+        if (ZSTD_isError(ret) || (!avail && !out.pos))
+            return 0;
+        if (!ret)
+            return 1;  // the frame is done
+    }
+}
+
+// Access points by walking the frames, from their headers and blocks headers
+static int zsrc_zstd_walk(zsrc_t *s)
+{
+    static const int did_size[4] = { 0, 1, 2, 4 };
+    static const int fcs_size[4] = { 0, 2, 4, 8 };
+    cc_off_t in = 0, out = 0;
+    unsigned char h[18];
+
+    while (in < s->file_size) {
+        if (zsrc_pread(s, h, 8, in) != 8)
+            return 0;
+        uint32_t magic = get_le32(h);
+        if ((magic & 0xfffffff0) == (ZSTD_SKIPPABLE_MAGIC & 0xfffffff0)) {
+            in += 8 + (cc_off_t)get_le32(h + 4);
+            continue;
+        }
+        if (magic != 0xFD2FB528)
+            return 0;
+
+        size_t hlen = zsrc_pread(s, h, sizeof(h), in);
+        int fhd = h[4], single = (fhd >> 5) & 1;
+        int fcs = fcs_size[fhd >> 6] + (!(fhd >> 6) && single);
+        size_t hsize = 5 + !single + did_size[fhd & 3] + fcs;
+        if (hlen < hsize)
+            return 0;
+
+        cc_off_t content = -1;
+        if (fcs) {
+            const unsigned char *p = h + hsize - fcs;
+            uint64_t v = 0;
+            int i;
+            for (i = fcs - 1; i >= 0; i--)
+                v = v << 8 | p[i];
+            content = (cc_off_t)(fcs == 2 ? v + 256 : v);
+        }
+
+        if (!zsrc_add_point(s, out, in, 0, NULL))
+            return 0;
+
+        cc_off_t frame = in;
+        in += hsize;
+        while (1) {
+            unsigned char b[3];
+            if (zsrc_pread(s, b, 3, in) != 3)
+                return 0;
+            uint32_t bh = b[0] | b[1] << 8 | (uint32_t)b[2] << 16;
+            in += 3 + ((bh >> 1 & 3) == 1 ? 1 : bh >> 3);  // RLE blocks have one byte
+            if (bh & 1)
+                break;
+        }
+        in += fhd & 4 ? 4 : 0;  // checksum
+
+        if (content < 0 && !zsrc_zstd_frame_size(s, frame, &content))
+            return 0;
+        out += content;
+    }
+
+    s->size = out;
+    return in == s->file_size;
+}
+#endif
+
+#ifdef CC_HAVE_ZLIB
+static uint64_t zsrc_input_mtime(zsrc_t *s)
+{
+#ifndef _WIN32
+    struct stat st;
+    if (!fstat(fileno(s->file), &st))
+        return (uint64_t)st.st_mtime;
+#endif
+    return 0;
+}
+
+// Index file: magic, compressed size, mtime, uncompressed size, npoints,
+// then for each point: out, in, bits, has window, [window]
+static int zsrc_gz_load_index(zsrc_t *s, const char *idx_name)
+{
+    FILE *f = cc_fopen(idx_name, "rb");
+    if (!f)
+        return 0;
+
+    char magic[8];
+    uint64_t order, h[4];
+    int ok = fread(magic, 1, 8, f) == 8 && !memcmp(magic, ZSRC_IDX_MAGIC, 8) &&
+             fread(&order, sizeof(order), 1, f) == 1 && order == ZSRC_IDX_ORDER &&
+             fread(h, sizeof(h), 1, f) == 1 &&
+             h[0] == (uint64_t)s->file_size && h[1] == zsrc_input_mtime(s);
+    uint64_t i;
+    for (i = 0; ok && i < h[3]; i++) {
+        int64_t oi[2];
+        unsigned char bw[2];
+        unsigned char *w = NULL;
+        ok = fread(oi, sizeof(oi), 1, f) == 1 && fread(bw, 2, 1, f) == 1 &&
+             (!bw[1] || ((w = malloc(ZSRC_GZ_WINDOW)) && fread(w, ZSRC_GZ_WINDOW, 1, f) == 1)) &&
+             zsrc_add_point(s, oi[0], oi[1], bw[0], w);
+        if (!ok)
+            free(w);
+    }
+    fclose(f);
+
+    s->size = (cc_off_t)h[2];
+    return ok && s->npoints && !s->points[0].out;
+}
+
+// Returns 1 on success, or 0 with errno set.
+static int zsrc_gz_save_index(zsrc_t *s, const char *idx_name)
+{
+    // write to a temporary file and rename, so concurrent jobs only see whole ones
+    char *tmp = malloc(strlen(idx_name) + 48);
+    if (!tmp)
+        return 0;
+    static long long ntmp;
+    sprintf(tmp, "%s.%ld.%lld.tmp", idx_name, (long)cc_getpid(), cc_atomic_add(&ntmp, 1));
+
+    FILE *f = cc_fopen(tmp, "wb");
+    uint64_t order = ZSRC_IDX_ORDER;
+    uint64_t h[4] = { s->file_size, zsrc_input_mtime(s), s->size, s->npoints };
+    int ok = f && fwrite(ZSRC_IDX_MAGIC, 1, 8, f) == 8 && fwrite(&order, sizeof(order), 1, f) == 1 &&
+             fwrite(h, sizeof(h), 1, f) == 1;
+    int i;
+    for (i = 0; ok && i < s->npoints; i++) {
+        zpoint_t *p = &s->points[i];
+        int64_t oi[2] = { p->out, p->in };
+        unsigned char bw[2] = { p->bits, p->window != NULL };
+        ok = fwrite(oi, sizeof(oi), 1, f) == 1 && fwrite(bw, 2, 1, f) == 1 &&
+             (!p->window || fwrite(p->window, ZSRC_GZ_WINDOW, 1, f) == 1);
+    }
+    if (f && fclose(f))
+        ok = 0;
+    if (ok && rename(tmp, idx_name))
+        ok = 0;
+    if (!ok) {
+        int e = errno;
+        remove(tmp);
+        errno = e;
+    }
+    free(tmp);
+    return ok;
+}
+
+// One pass over the whole input, adding access points every ZSRC_GZ_SPAN
+static int zsrc_gz_build_index(zsrc_t *s)
+{
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    unsigned char *win = malloc(ZSRC_GZ_WINDOW);
+    if (!win || inflateInit2(&z, 15 + 16) != Z_OK) {
+        free(win);
+        return 0;
+    }
+
+    cc_off_t in = 0, out = 0, last = 0;
+    size_t wpos = 0;
+    int ok = zsrc_add_point(s, 0, 0, 0, NULL);
+    s->in_pos = 0;
+    s->in_start = s->in_end = 0;
+
+    while (ok) {
+        size_t avail = zsrc_fill(s, 1);
+        if (wpos == ZSRC_GZ_WINDOW)
+            wpos = 0;
+        z.next_in = s->in_buf + s->in_start;
+        z.avail_in = (uInt)avail;
+        z.next_out = win + wpos;
+        z.avail_out = (uInt)(ZSRC_GZ_WINDOW - wpos);
+
+        // Z_BLOCK: stop at the end of deflate blocks
+        int ret = inflate(&z, Z_BLOCK);
+        size_t used = avail - z.avail_in;
+        size_t made = ZSRC_GZ_WINDOW - wpos - z.avail_out;
+        s->in_start += used;
+        in += used;
+        out += made;
+        wpos += made;
+
+        if (ret == Z_STREAM_END) {
+            // members are concatenated, anything else after a member is the end
+            if (zsrc_fill(s, 2) < 2 || s->in_buf[s->in_start] != 0x1f || s->in_buf[s->in_start + 1] != 0x8b)
+                break;
+            ok = inflateReset(&z) == Z_OK;
+            if (ok && out - last >= ZSRC_GZ_SPAN) {
+                ok = zsrc_add_point(s, out, in, 0, NULL);
+                last = out;
+            }
+            continue;
+        }
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || (!avail && !made)) {
+            ok = 0;  // corrupt or truncated
+            break;
+        }
+
+        // at the end of a block which isn't the last one of the member
+        if ((z.data_type & 128) && !(z.data_type & 64) && out - last >= ZSRC_GZ_SPAN) {
+            unsigned char *w = malloc(ZSRC_GZ_WINDOW);
+            ok = w != NULL;
+            if (ok) {  // unroll the circular window
+                memcpy(w, win + wpos, ZSRC_GZ_WINDOW - wpos);
+                memcpy(w + ZSRC_GZ_WINDOW - wpos, win, wpos);
+                ok = zsrc_add_point(s, out, in, z.data_type & 7, w);
+                if (!ok)
+                    free(w);
+            }
+            last = out;
+        }
+    }
+
+    inflateEnd(&z);
+    free(win);
+    s->size = out;
+    return ok;
+}
+#endif
+
+// Reads len uncompressed bytes at offset at into buf. Returns 1 on success.
+int zsrc_read(zsrc_t *s, char *buf, size_t len, cc_off_t at)
+{
+    if (at < 0 || at > s->size || (cc_off_t)len > s->size - at)
+        return 0;
+
+    // the last point at or before at
+    int lo = 0, hi = s->npoints - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (s->points[mid].out <= at)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    // unless the stream is already between the point and at
+    const zpoint_t *p = &s->points[lo];
+    if ((s->pos < 0 || at < s->pos || p->out > s->pos) && !zsrc_seek(s, p))
+        return 0;
+
+    while (s->pos < at) {
+        size_t n = (size_t)cc_min(at - s->pos, (cc_off_t)ZSRC_IN_SIZE);
+        if (!zsrc_out(s, s->skip_buf, n))
+            return 0;
+    }
+    return zsrc_out(s, buf, len);
+}
+
+// Returns a reader of the uncompressed data of in_file (file_size bytes), and
+// sets *size to its size, or returns NULL with err set.
+zsrc_t *zsrc_open(FILE *in_file, const char *in_name, cc_off_t file_size, int opt_verbose,
+                  cc_off_t *size, char *err, size_t errlen)
+{
+    unsigned char m[4] = { 0 };
+    zsrc_t *s = calloc(1, sizeof(*s));
+    if (!s || !(s->in_buf = malloc(ZSRC_IN_SIZE)) || !(s->skip_buf = malloc(ZSRC_IN_SIZE))) {
+        snprintf(err, errlen, "out of memory");
+        goto fail_L;
+    }
+    s->file = in_file;
+    s->file_size = file_size;
+    s->pos = -1;
+
+    zsrc_pread(s, m, 4, 0);
+    if (m[0] == 0x1f && m[1] == 0x8b) {
+        s->format = COMPRESS_GZIP;
+    } else if (get_le32(m) == 0xFD2FB528 || (get_le32(m) & 0xfffffff0) == (ZSTD_SKIPPABLE_MAGIC & 0xfffffff0)) {
+        s->format = COMPRESS_ZSTD;
+    } else {
+        snprintf(err, errlen, "input is not gzip or zstd compressed");
+        goto fail_L;
+    }
+    if (!compressors[s->format].available) {
+        snprintf(err, errlen, "%s input is not supported in this build", compressors[s->format].name);
+        goto fail_L;
+    }
+
+#ifdef CC_HAVE_ZLIB
+    if (s->format == COMPRESS_GZIP) {
+        if (!(s->strm_ok = inflateInit2(&s->strm, 15 + 16) == Z_OK)) {
+            snprintf(err, errlen, "cannot initialize zlib");
+            goto fail_L;
+        }
+
+        char *idx_name = malloc(strlen(in_name) + 8);
+        if (!idx_name) {
+            snprintf(err, errlen, "out of memory");
+            goto fail_L;
+        }
+        sprintf(idx_name, "%s.ccidx", in_name);
+
+        if (zsrc_gz_load_index(s, idx_name)) {
+            VERBOSE("-   Using gzip index '%s'\n", idx_name);
+        } else {
+            zsrc_free_points(s);
+            VERBOSE("-   Building gzip index '%s' ...\n", idx_name);
+            if (!zsrc_gz_build_index(s)) {
+                free(idx_name);
+                snprintf(err, errlen, "input is not valid gzip data");
+                goto fail_L;
+            }
+            if (!zsrc_gz_save_index(s, idx_name)) {
+                VERBOSE("-   Cannot save the gzip index '%s': %s (it's built again next time)\n",
+                        idx_name, strerror(errno));
+            }
+        }
+        free(idx_name);
+    }
+#else
+    (void)in_name;
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (s->format == COMPRESS_ZSTD) {
+        if (!(s->dstream = ZSTD_createDStream())) {
+            snprintf(err, errlen, "cannot initialize zstd");
+            goto fail_L;
+        }
+        if (zsrc_zstd_seek_table(s)) {
+            VERBOSE("-   Using the zstd seek table\n");
+        } else {
+            zsrc_free_points(s);
+            if (!zsrc_zstd_walk(s)) {
+                snprintf(err, errlen, "input is not valid zstd data");
+                goto fail_L;
+            }
+        }
+    }
+#endif
+
+    VERBOSE("-   Input is %s compressed, uncompressed size: %lld, access points: %d\n",
+            compressors[s->format].name, (long long)s->size, s->npoints);
+    *size = s->size;
+    return s;
+
+fail_L:
+    if (s)
+        zsrc_close(s);
+    return NULL;
+}
+
+void zsrc_close(zsrc_t *s)
+{
+    zsrc_free_points(s);
+#ifdef CC_HAVE_ZLIB
+    if (s->strm_ok)
+        inflateEnd(&s->strm);
+#endif
+#ifdef CC_HAVE_ZSTD
+    if (s->dstream)
+        ZSTD_freeDStream(s->dstream);
+#endif
+    free(s->in_buf);
+    free(s->skip_buf);
+    free(s);
+}
+
+
+//////////////////////////  -p and --progress-fd  //////////////////////////
+
+// Prints a progress report of p at time now. final is 0, or 1 (success)/-1
+// (failure) for the last report.
+static void progress_report(progress_t *p, uint64_t now, int final)
+{
+    long long done = cc_atomic_load(&p->done);
+    double elapsed = (now - p->start_ns) / 1e9;
+    double dt = (now - p->last_ns) / 1e9;
+    double rate = dt > 0 ? (done - p->last_done) / dt : 0;     // recent
+    double avg = elapsed > 0 ? done / elapsed : 0;
+    double percent = p->total ? 100.0 * done / p->total : final < 0 ? 0 : 100;
+    long long eta = avg > 0 ? (long long)((p->total - done) / avg + 0.5) : -1;
+
+    if (final) {
+        rate = avg;
+        eta = 0;
+    }
+    p->last_ns = now;
+    p->last_done = done;
+
+    if (p->text && (final || p->tty || now - p->last_text_ns >= (uint64_t)PROGRESS_LOG_MS * 1000000)) {
+        char eta_str[32] = "--:--:--";
+        p->last_text_ns = now;
+        if (eta >= 0)
+            snprintf(eta_str, sizeof(eta_str), "%lld:%02d:%02d",
+                     eta / 3600, (int)(eta / 60 % 60), (int)(eta % 60));
+
+        cc_fprintf(stderr, "%s%5.1f%%  %.1f/%.1f MB  %.1f MB/s  ETA %s%s",
+                   p->tty ? "\r" : "", percent, done / 1e6, p->total / 1e6, rate / 1e6,
+                   eta_str, (p->tty && !final) ? "  " : "\n");
+    }
+
+    if (p->fd >= 0) {
+        char line[256];
+        int n = snprintf(line, sizeof(line),
+            "{\"bytes\":%lld,\"total\":%lld,\"percent\":%.2f,\"bytes_per_sec\":%.0f,"
+            "\"avg_bytes_per_sec\":%.0f,\"elapsed_sec\":%.3f,\"eta_sec\":%lld,\"state\":\"%s\"}\n",
+            done, p->total, percent, rate, avg, elapsed, eta,
+            final > 0 ? "done" : final < 0 ? "failed" : "running");
+        if (n > 0 && write(p->fd, line, n) != n)
+            p->fd = -1; // the reader went away, stop reporting to it
+    }
+}
+
+#ifndef CC_NO_THREADS
+static void *progress_thread(void *arg)
+{
+    progress_t *p = arg;
+
+    cc_mutex_lock(&p->lock);
+    while (!p->stop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += PROGRESS_MS / 1000;
+        ts.tv_nsec += PROGRESS_MS % 1000 * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        if (pthread_cond_timedwait(&p->cond, &p->lock, &ts) && !p->stop)
+            progress_report(p, cc_now_ns(), 0);
+    }
+    cc_mutex_unlock(&p->lock);
+    return NULL;
+}
+#endif
+
+// Starts reporting the progress towards total bytes, as text to stderr if
+// text, and as NDJSON to fd if it's not -1. Add progress to p->done.
+void progress_start(progress_t *p, long long total, int text, int fd)
+{
+    memset(p, 0, sizeof(*p));
+    p->total = total;
+    p->text = text;
+    p->fd = fd;
+#ifdef _WIN32
+    p->tty = _isatty(_fileno(stderr));
+#else
+    p->tty = isatty(fileno(stderr));
+#endif
+    p->start_ns = p->last_ns = p->last_text_ns = cc_now_ns();
+
+#ifndef CC_NO_THREADS
+    cc_mutex_init(&p->lock);
+    cc_cond_init(&p->cond);
+    p->running = !cc_thread_create(&p->thread, progress_thread, p);
+#endif
+}
+
+// Called after adding to p->done. Reports if needed when there's no reporter
+// thread, which costs one clock read.
+void progress_poll(progress_t *p)
+{
+#ifndef CC_NO_THREADS
+    if (p->running)
+        return;
+#endif
+    uint64_t now = cc_now_ns();
+    if (now - p->last_ns >= (uint64_t)PROGRESS_MS * 1000000)
+        progress_report(p, now, 0);
+}
+
+// Stops the reporter and prints the final report
+void progress_stop(progress_t *p, int ok)
+{
+#ifndef CC_NO_THREADS
+    if (p->running) {
+        cc_mutex_lock(&p->lock);
+        p->stop = 1;
+        cc_cond_broadcast(&p->cond);
+        cc_mutex_unlock(&p->lock);
+        cc_thread_join(p->thread);
+    }
+    cc_cond_destroy(&p->cond);
+    cc_mutex_destroy(&p->lock);
+#endif
+    progress_report(p, cc_now_ns(), ok ? 1 : -1);
+}
+
+// The final report to fd of a job which failed before its progress started,
+// so that the reader doesn't wait for it
+void progress_failed(int fd, long long total)
+{
+    progress_t p;
+    memset(&p, 0, sizeof(p));
+    p.total = total;
+    p.fd = fd;
+    p.start_ns = p.last_ns = cc_now_ns();
+    progress_report(&p, p.start_ns, -1);
+}
+
+
+//////////////////////////////////  --stats  //////////////////////////////////
+
+// Adds an I/O call which started at t0 to hist and to the current range
+static void stats_op(job_stats_t *stats, lat_hist_t *hist, uint64_t t0)
+{
+    uint64_t ns = cc_now_ns() - t0;
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && (ns >> (b + 1)))
+        b++;
+
+    hist->count++;
+    hist->bucket[b]++;
+    if (ns > hist->max_ns)
+        hist->max_ns = ns;
+
+    if (stats->cur) {
+        if (hist == &stats->write)
+            stats->cur->writes++;
+        else
+            stats->cur->reads++;
+    }
+}
+
+// Returns the upper bound of the bucket which holds the permille'th latency.
+// Resolution is a factor of 2, which is enough to spot a slow device.
+static uint64_t hist_percentile(const lat_hist_t *hist, int permille)
+{
+    uint64_t need = (hist->count * permille + 999) / 1000;
+    uint64_t seen = 0;
+    int b;
+    for (b = 0; b < HIST_BUCKETS && need; b++) {
+        seen += hist->bucket[b];
+        if (seen >= need)
+            return cc_min(((uint64_t)2 << b) - 1, hist->max_ns);
+    }
+    return 0;
+}
+
+static void print_json_str(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; s && *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static void print_hist(FILE *f, const char *name, const lat_hist_t *hist)
+{
+    fprintf(f, "\"%s\":{\"count\":%llu,\"p50_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f}",
+            name, (unsigned long long)hist->count,
+            hist_percentile(hist, 500) / 1e3, hist_percentile(hist, 990) / 1e3, hist->max_ns / 1e3);
+}
+
+// Prints the stats of a job as one line of JSON to stderr
+void print_stats(const job_t *job, int ok)
+{
+    const job_stats_t *st = job->stats;
+    FILE *f = stderr;
+    int i;
+
+    cc_flockfile(f);
+    fprintf(f, "{\"in\":");
+    print_json_str(f, job->in_name);
+    fprintf(f, ",\"out\":");
+    print_json_str(f, job->out_name);
+    fprintf(f, ",\"ok\":%s", ok ? "true" : "false");
+    if (!ok) {
+        fprintf(f, ",\"error\":");
+        print_json_str(f, job->err);
+    }
+
+    fprintf(f, ",\"engine\":\"%s\",\"bufsize\":%llu,\"bytes\":%lld",
+            engines[job->engine].name, (unsigned long long)job->io_size, (long long)job->copied);
+    fprintf(f, ",\"bytes_per_sec\":%.0f",
+            st->copy_ns ? job->copied / (st->copy_ns / 1e9) : 0.0);
+    fprintf(f, ",\"phases_us\":{\"open\":%.3f,\"resolve\":%.3f,\"copy\":%.3f,\"close\":%.3f}",
+            st->open_ns / 1e3, st->resolve_ns / 1e3, st->copy_ns / 1e3, st->close_ns / 1e3);
+
+    fprintf(f, ",\"latency\":{");
+    print_hist(f, "read", &st->read);
+    fprintf(f, ",");
+    print_hist(f, "write", &st->write);
+    fprintf(f, ",");
+    print_hist(f, "copy", &st->copy);
+    fprintf(f, "}");
+
+    fprintf(f, ",\"ranges\":[");
+    for (i = 0; st->ranges && i < job->nranges; i++) {
+        const range_stats_t *r = &st->ranges[i];
+        fprintf(f, "%s{\"from\":%lld,\"to\":%lld,\"bytes\":%lld,\"reads\":%llu,\"writes\":%llu}",
+                i ? "," : "", (long long)r->from, (long long)r->to, (long long)r->bytes,
+                (unsigned long long)r->reads, (unsigned long long)r->writes);
+    }
+    fprintf(f, "]}\n");
+    cc_funlockfile(f);
+}
+
+
+///////////////////////  --batch: jobs from a manifest  ///////////////////////
+
+// --batch and --each make a list of jobs, and run_pool runs them.
+// Jobs are distributed to per-worker queues, grouped by input file so that
+// consecutive jobs on the same input reuse the worker's open input file.
+// A worker takes jobs from the head of its own queue, and when it's empty it
+// steals from the tail of other queues. Jobs take milliseconds or longer, so
+// one pool lock is enough. The lock also guards the per-device counters and
+// the report.
+
+typedef struct {
+    job_t **q;
+    int head, tail;  // owner takes from head, thieves from tail
+} batch_queue_t;
+
+typedef struct {
+    cc_mutex_t lock;
+    cc_cond_t cond;          // signaled when a job completes
+
+    batch_queue_t *queues;
+    int nworkers;
+    int pending;             // jobs which were not taken yet
+    int failed;
+
+    int per_device;          // 0: unlimited
+    int *dev_active;         // number of running jobs per input device
+    int report;              // 1: a report line per job to stdout, 0: errors to stderr
+} batch_pool_t;
+
+typedef struct {
+    batch_pool_t *pool;
+    int id;
+    char *buf;
+    size_t buf_size;
+
+    // the input file of the previous job, reused if the next job has the same
+    const char *in_name;
+    FILE *in_file;
+    cc_off_t in_size;
+} batch_worker_t;
+
+// Removes and returns the first job from the head (or tail) of dq, within
+// BATCH_SCAN entries, which doesn't exceed the per-device limit. Pool locked.
+static job_t *batch_take(batch_pool_t *pool, batch_queue_t *dq, int from_tail)
+{
+    int n = cc_min(dq->tail - dq->head, BATCH_SCAN);
+    int k;
+    for (k = 0; k < n; k++) {
+        int at = from_tail ? dq->tail - 1 - k : dq->head + k;
+        job_t *job = dq->q[at];
+        if (pool->per_device && pool->dev_active[job->dev] >= pool->per_device)
+            continue;
+
+        if (from_tail) {
+            memmove(&dq->q[at], &dq->q[at + 1], k * sizeof(job_t *));
+            dq->tail--;
+        } else {
+            memmove(&dq->q[dq->head + 1], &dq->q[dq->head], k * sizeof(job_t *));
+            dq->head++;
+        }
+        pool->dev_active[job->dev]++;
+        pool->pending--;
+        return job;
+    }
+
+    return NULL;
+}
+
+static void *batch_worker(void *arg)
+{
+    batch_worker_t *w = arg;
+    batch_pool_t *pool = w->pool;
+    int i;
+
+    cc_mutex_lock(&pool->lock);
+    while (pool->pending) {
+        job_t *job = batch_take(pool, &pool->queues[w->id], 0);
+        for (i = 1; !job && i < pool->nworkers; i++)
+            job = batch_take(pool, &pool->queues[(w->id + i) % pool->nworkers], 1);
+
+        if (!job) {
+            // everything left is for busy devices, wait for some job to end
+            cc_cond_wait(&pool->cond, &pool->lock);
+            continue;
+        }
+        cc_mutex_unlock(&pool->lock);
+
+        if (job->in_name && (!w->in_file || strcmp(w->in_name, job->in_name))) {
+            if (w->in_file)
+                fclose(w->in_file);
+            w->in_name = job->in_name;
+            w->in_file = open_input(job->in_name, &w->in_size);
+        }
+        if (w->in_file)
+            clearerr(w->in_file);
+
+        job->in_file = w->in_file;
+        job->in_size = w->in_size;
+        job->buf = w->buf;
+        job->buf_size = w->buf_size;
+        job->keep_buf = 1;
+
+        int ok = 0;
+        if (!job->in_name)
+            ; // invalid manifest line, err is already set
+        else if (pool->report && !strcmp(job->out_name, "-"))  // the report goes to stdout
+            snprintf(job->err, sizeof(job->err), "output to stdout is not supported with --batch");
+        else
+            ok = run_job(job);
+        w->buf = job->buf;  // as big as the biggest job needed
+        w->buf_size = job->buf_size;
+
+        cc_mutex_lock(&pool->lock);
+        pool->dev_active[job->dev]--;
+        if (!pool->report) {
+            if (!ok) {
+                pool->failed++;
+                cc_fprintf(stderr, "Error: %s: %s\n", job->in_name, job->err);
+            }
+        } else if (ok) {
+            fprintf(stdout, "OK\t%d\t%s\t%s\t%lld\n",
+                    job->line, job->in_name, job->out_name, (long long)job->copied);
+        } else {
+            pool->failed++;
+            fprintf(stdout, "FAIL\t%d\t%s\t%s\t%s\n", job->line,
+                    job->in_name ? job->in_name : "", job->out_name ? job->out_name : "",
+                    job->err);
+        }
+        if (pool->report)
+            fflush(stdout);
+        cc_cond_broadcast(&pool->cond);
+    }
+    cc_mutex_unlock(&pool->lock);
+
+    if (w->in_file)
+        fclose(w->in_file);
+    return NULL;
+}
+
+// Returns the whole content of fname ('-' for stdin) as a 0-terminated string,
+// or NULL on error. Caller should free it.
+static char *read_all(const char *fname)
+{
+    FILE *f = strcmp(fname, "-") ? cc_fopen(fname, "rb") : stdin;
+    char *data = NULL;
+    size_t len = 0, cap = 0;
+
+    while (f) {
+        if (cap - len < RW_BUFFSIZE + 1) {
+            char *tmp = realloc(data, cap = cap * 2 + RW_BUFFSIZE + 1);
+            if (!tmp)
+                break;
+            data = tmp;
+        }
+
+        len += fread(data + len, 1, RW_BUFFSIZE, f);
+        if (ferror(f))
+            break;
+
+        if (feof(f)) {
+            data[len] = 0;
+            if (f != stdin)
+                fclose(f);
+            return data;
+        }
+    }
+
+    if (f && f != stdin)
+        fclose(f);
+    free(data);
+    return NULL;
+}
+
+// Returns an index of the device which holds fname. devs holds the devices
+// seen so far, and is updated. On error or without stat, 0 is returned.
+static int device_index(const char *fname, unsigned long long *devs, int *ndevs)
+{
+#ifdef _WIN32
+    (void)fname; (void)devs; (void)ndevs;
+    return 0;
+#else
+    struct stat st;
+    int i;
+    if (stat(fname, &st))
+        return 0;
+    for (i = 0; i < *ndevs; i++) {
+        if (devs[i] == (unsigned long long)st.st_dev)
+            return i;
+    }
+    devs[*ndevs] = (unsigned long long)st.st_dev;
+    return (*ndevs)++;
+#endif
+}
+
+static int cmp_input_name(const job_t *ja, const job_t *jb)
+{
+    return strcmp(ja->in_name ? ja->in_name : "", jb->in_name ? jb->in_name : "");
+}
+
+// qsort: by input file name, and then by manifest order
+static int cmp_job_input(const void *a, const void *b)
+{
+    const job_t *ja = *(job_t * const *)a;
+    const job_t *jb = *(job_t * const *)b;
+    int c = cmp_input_name(ja, jb);
+    return c ? c : ja->line - jb->line;
+}
+
+int cc_ncpus(void)
+{
+#if defined(_SC_NPROCESSORS_ONLN) && !defined(CC_NO_THREADS)
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > BATCH_MAX_JOBS ? BATCH_MAX_JOBS : (int)n;
+#else
+    return 1;
+#endif
+}
+
+// Runs the njobsfound jobs on njobs threads (0: number of CPUs), and at most
+// per_device concurrent jobs on each input device (0: unlimited). With report,
+// prints one report line per job to stdout. Returns 0 if all succeeded.
+static int run_pool(const cc_opts_t *opts, job_t *jobs, int njobsfound, int njobs, int per_device,
+                    int report)
+{
+    int rv = 1;
+    int opt_verbose = opts->verbose;
+    job_t **order = NULL;
+    job_t **dealt = NULL;
+    int *counts = NULL;
+    unsigned long long *devs = NULL;
+    batch_pool_t pool = {0};
+    batch_worker_t *workers = NULL;
+    int ndevs = 0;
+    int i, w;
+
+    order = calloc(njobsfound, sizeof(job_t *));
+    devs = calloc(njobsfound, sizeof(unsigned long long));
+    if (!order || !devs) {
+        cc_fprintf(stderr, "Error: out of memory\n");
+        goto exit_L;
+    }
+    for (i = 0; i < njobsfound; i++)
+        order[i] = &jobs[i];
+
+    // group by input, and get the device of each input (a stat per input,
+    // so only if it's needed)
+    qsort(order, njobsfound, sizeof(job_t *), cmp_job_input);
+    for (i = 0; per_device && i < njobsfound; i++) {
+        if (i && order[i]->in_name && !cmp_input_name(order[i - 1], order[i]))
+            order[i]->dev = order[i - 1]->dev;
+        else if (order[i]->in_name)
+            order[i]->dev = device_index(order[i]->in_name, devs, &ndevs);
+    }
+
+    int nworkers = cc_min(njobs ? njobs : cc_ncpus(), njobsfound);
+#ifdef CC_NO_THREADS
+    nworkers = 1;
+#endif
+    pool.nworkers = nworkers;
+    pool.pending = njobsfound;
+    pool.per_device = per_device;
+    pool.report = report;
+    pool.dev_active = calloc(ndevs + 1, sizeof(int));
+    pool.queues = calloc(nworkers, sizeof(batch_queue_t));
+    workers = calloc(nworkers, sizeof(batch_worker_t));
+    counts = calloc(nworkers, sizeof(int));
+    dealt = calloc(njobsfound, sizeof(job_t *));
+    if (!pool.dev_active || !pool.queues || !workers || !counts || !dealt) {
+        cc_fprintf(stderr, "Error: out of memory\n");
+        goto exit_L;
+    }
+
+    // deal the input groups round robin. The queues are slices of dealt.
+    int group = -1;
+    for (i = 0; i < njobsfound; i++) {
+        if (!i || cmp_input_name(order[i - 1], order[i]))
+            group++;
+        counts[group % nworkers]++;
+    }
+    for (w = 0, i = 0; w < nworkers; i += counts[w++])
+        pool.queues[w].q = dealt + i;
+    for (group = -1, i = 0; i < njobsfound; i++) {
+        if (!i || cmp_input_name(order[i - 1], order[i]))
+            group++;
+        batch_queue_t *dq = &pool.queues[group % nworkers];
+        dq->q[dq->tail++] = order[i];
+    }
+
+    if (per_device) {
+        VERBOSE("- Jobs: %d, workers: %d, input devices: %d, per device limit: %d\n",
+                njobsfound, nworkers, ndevs, per_device);
+    } else {
+        VERBOSE("- Jobs: %d, workers: %d\n", njobsfound, nworkers);
+    }
+
+    cc_mutex_init(&pool.lock);
+    cc_cond_init(&pool.cond);
+
+    // the buffers are allocated by the jobs, as big as they need
+    for (w = 0; w < nworkers; w++) {
+        workers[w].pool = &pool;
+        workers[w].id = w;
+    }
+
+#ifndef CC_NO_THREADS
+    cc_thread_t *threads = calloc(nworkers, sizeof(cc_thread_t));
+    int started = 0;
+    if (threads) {
+        for (started = 1; started < nworkers; started++) {
+            if (cc_thread_create(&threads[started], batch_worker, &workers[started]))
+                break;
+        }
+    }
+    if (started < nworkers)
+        VERBOSE("- Only %d workers could be started\n", cc_max(started, 1));
+
+    batch_worker(&workers[0]);  // the main thread is worker 0
+
+    for (i = 1; i < started; i++)
+        cc_thread_join(threads[i]);
+    free(threads);
+#else
+    batch_worker(&workers[0]);
+#endif
+
+    VERBOSE("- Jobs done: %d, failed: %d.\n", njobsfound, pool.failed);
+    rv = pool.failed ? 1 : 0;
+
+    for (w = 0; w < nworkers; w++)
+        iobuf_free(workers[w].buf, workers[w].buf_size);
+    cc_cond_destroy(&pool.cond);
+    cc_mutex_destroy(&pool.lock);
+
+exit_L:
+    free(workers);
+    free(pool.queues);
+    free(pool.dev_active);
+    free(devs);
+    free(counts);
+    free(dealt);
+    free(order);
+    return rv;
+}
+
+// Each non-empty manifest line which doesn't start with '#' is a job:
+// IN_FILE<TAB>OUT_FILE<TAB>RANGE [RANGE_2 [...]]
+// Runs all the jobs with run_pool, and returns 0 if all succeeded.
+int run_batch(const cc_opts_t *opts, const char *manifest, int njobs, int per_device)
+{
+    int rv = 1;
+    int opt_verbose = opts->verbose;
+    char *data = NULL;
+    job_t *jobs = NULL;
+    char **tokens = NULL;
+    int njobsfound = 0, ntokens = 0;
+
+    if (!(data = read_all(manifest))) {
+        cc_fprintf(stderr, "Error: cannot read manifest '%s'\n", manifest);
+        goto exit_L;
+    }
+
+    // count upper limits of jobs and tokens, so we don't need to realloc
+    int maxjobs = 1, maxtokens = 1;
+    char *s;
+    for (s = data; *s; s++) {
+        maxjobs += *s == '\n';
+        maxtokens += *s == ' ' || *s == '\t';
+    }
+    maxtokens += maxjobs;
+
+    jobs = calloc(maxjobs, sizeof(job_t));
+    tokens = calloc(maxtokens, sizeof(char *));
+    if (!jobs || !tokens) {
+        cc_fprintf(stderr, "Error: out of memory\n");
+        goto exit_L;
+    }
+
+    int line = 0;
+    char *next = data;
+    while (next) {
+        char *l = next;
+        line++;
+        if ((next = strchr(l, '\n')))
+            *next++ = 0;
+        size_t len = strlen(l);
+        if (len && l[len - 1] == '\r')
+            l[--len] = 0;
+        if (!len || *l == '#')
+            continue;
+
+        job_t *job = &jobs[njobsfound++];
+        job->opts = opts;
+        job->line = line;
+
+        char *out = strchr(l, '\t');
+        char *rng = out ? strchr(out + 1, '\t') : NULL;
+        if (!rng) {
+            snprintf(job->err, sizeof(job->err), "invalid manifest line, expecting IN_FILE<TAB>OUT_FILE<TAB>RANGES");
+            continue;
+        }
+        *out++ = 0;
+        *rng++ = 0;
+
+        job->ranges = tokens + ntokens;
+        for (s = strtok(rng, " \t"); s; s = strtok(NULL, " \t"))
+            tokens[ntokens + job->nranges++] = s;
+        ntokens += job->nranges;
+
+        if (!job->nranges) {
+            snprintf(job->err, sizeof(job->err), "no ranges defined, must have at least one range");
+            continue;
+        }
+
+        job->in_name = l;
+        job->out_name = out;
+    }
+
+    if (!njobsfound) {
+        cc_fprintf(stderr, "Error: no jobs at manifest '%s'\n", manifest);
+        goto exit_L;
+    }
+
+    VERBOSE("- Batch: %d jobs from '%s'\n", njobsfound, manifest);
+    rv = run_pool(opts, jobs, njobsfound, njobs, per_device, 1);
+
+exit_L:
+    free(tokens);
+    free(jobs);
+    free(data);
+    return rv;
+}
+
+
+//////////////////////  --each: the same ranges of many inputs  //////////////////////
+
+// Returns 1 if the --each output template has a per-input field.
+int each_per_input(const char *out_tmpl)
+{
+    return strstr(out_tmpl, "{}") || strstr(out_tmpl, "{n}");
+}
+
+// Returns a new string: out_tmpl with {} replaced by the file name of in_name
+// (without its directory), and {n} by n. NULL if out of memory.
+static char *each_out_name(const char *out_tmpl, const char *in_name, int n)
+{
+    const char *base = in_name, *s;
+    for (s = in_name; *s; s++) {
+#ifdef _WIN32
+        if (*s == '\\' || *s == ':')
+            base = s + 1;
+#endif
+        if (*s == '/')
+            base = s + 1;
+    }
+
+    char num[24];
+    size_t len = 1;
+    snprintf(num, sizeof(num), "%d", n);
+    for (s = out_tmpl; *s; s++)
+        len += !strncmp(s, "{}", 2) ? strlen(base) : !strncmp(s, "{n}", 3) ? strlen(num) : 1;
+
+    char *out = malloc(len), *o = out;
+    for (s = out_tmpl; out && *s; ) {
+        if (!strncmp(s, "{}", 2)) {
+            o += sprintf(o, "%s", base);
+            s += 2;
+        } else if (!strncmp(s, "{n}", 3)) {
+            o += sprintf(o, "%s", num);
+            s += 3;
+        } else {
+            *o++ = *s++;
+        }
+    }
+    if (out)
+        *o = 0;
+    return out;
+}
+
+// qsort: strings
+static int cmp_str(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// Returns an output name of two of the jobs (e.g. {} of a/log and b/log), or
+// NULL if they're all different. Sets *oom if out of memory.
+static const char *each_dup_output(const job_t *jobs, int n, int *oom)
+{
+    const char **names = malloc(n * sizeof(char *)), *dup = NULL;
+    int i;
+    if (!(*oom = !names)) {
+        for (i = 0; i < n; i++)
+            names[i] = jobs[i].out_name;
+        qsort(names, n, sizeof(char *), cmp_str);
+        for (i = 1; i < n && !dup; i++)
+            dup = strcmp(names[i - 1], names[i]) ? NULL : names[i];
+        free(names);
+    }
+    return dup;
+}
+
+// Copies ranges of each input file at list (one name per line, '-' for
+// stdin), or which match the glob pattern list if is_glob, with run_pool.
+// If out_tmpl has {} or {n}, each input has its own output file, else all
+// the inputs are framed into out_tmpl (see run_job). Returns 0 if all
+// succeeded.
+int run_each(const cc_opts_t *opts, const char *list, int is_glob, const char *out_tmpl,
+             char **ranges, int nranges, int njobs, int per_device)
+{
+    int rv = 1;
+    int opt_verbose = opts->verbose;
+    char *data = NULL;
+    char **names = NULL;
+    job_t *jobs = NULL;
+    FILE *out_file = NULL;
+    cc_mutex_t out_lock;
+    int per_input = each_per_input(out_tmpl);
+    int nnames = 0;
+    int i;
+#ifdef CC_HAVE_GLOB
+    glob_t g = {0};
+#endif
+
+    if (is_glob) {
+#ifdef CC_HAVE_GLOB
+        int err = glob(list, 0, NULL, &g);
+        if (err && err != GLOB_NOMATCH) {
+            cc_fprintf(stderr, "Error: cannot expand '%s'\n", list);
+            goto exit_L;
+        }
+        names = g.gl_pathv;
+        nnames = (int)g.gl_pathc;
+#else
+        cc_fprintf(stderr, "Error: --each-glob is not supported on this platform\n");
+        goto exit_L;
+#endif
+    } else {
+        if (!(data = read_all(list))) {
+            cc_fprintf(stderr, "Error: cannot read input list '%s'\n", list);
+            goto exit_L;
+        }
+
+        int maxnames = 1;
+        char *s, *next;
+        for (s = data; *s; s++)
+            maxnames += *s == '\n';
+        if (!(names = malloc(maxnames * sizeof(char *)))) {
+            cc_fprintf(stderr, "Error: out of memory\n");
+            goto exit_L;
+        }
+
+        for (s = data; s; s = next) {
+            if ((next = strchr(s, '\n')))
+                *next++ = 0;
+            size_t len = strlen(s);
+            if (len && s[len - 1] == '\r')
+                s[--len] = 0;
+            if (len)
+                names[nnames++] = s;
+        }
+    }
+
+    if (!nnames) {
+        cc_fprintf(stderr, "Error: no input files at '%s'\n", list);
+        goto exit_L;
+    }
+
+    if (!(jobs = calloc(nnames, sizeof(job_t)))) {
+        cc_fprintf(stderr, "Error: out of memory\n");
+        goto exit_L;
+    }
+    for (i = 0; i < nnames; i++) {
+        jobs[i].opts = opts;
+        jobs[i].line = i + 1;
+        jobs[i].in_name = names[i];
+        jobs[i].ranges = ranges;
+        jobs[i].nranges = nranges;
+        jobs[i].out_name = per_input ? each_out_name(out_tmpl, names[i], i + 1) : out_tmpl;
+        if (!jobs[i].out_name) {
+            cc_fprintf(stderr, "Error: out of memory\n");
+            goto exit_L;
+        }
+    }
+
+    if (per_input) {
+        int oom;
+        const char *dup = each_dup_output(jobs, nnames, &oom);
+        if (oom || dup) {
+            if (oom)
+                cc_fprintf(stderr, "Error: out of memory\n");
+            else
+                cc_fprintf(stderr, "Error: several inputs have the output '%s', use {n} at -o\n", dup);
+            goto exit_L;
+        }
+    }
+
+    if (!per_input && !opts->dummy) {
+        char err[200];
+        if (!(out_file = open_output(out_tmpl, opts->overwrite, err, sizeof(err)))) {
+            cc_fprintf(stderr, "Error: %s\n", err);
+            goto exit_L;
+        }
+
+        cc_mutex_init(&out_lock);
+        for (i = 0; i < nnames; i++) {
+            jobs[i].out_file = out_file;
+            jobs[i].out_lock = &out_lock;
+        }
+    }
+
+    VERBOSE("- Each: %d input files from '%s', output: %s '%s'\n", nnames, list,
+            per_input ? "one per input," : "framed into", out_tmpl);
+    rv = run_pool(opts, jobs, nnames, njobs, per_device, 0);
+
+    if (out_file) {
+        cc_mutex_destroy(&out_lock);
+        if (out_file == stdout ? fflush(out_file) : fclose(out_file)) {
+            cc_fprintf(stderr, "Error: cannot write to output file\n");
+            rv = 1;
+        }
+    }
+
+exit_L:
+    for (i = 0; jobs && per_input && i < nnames; i++)
+        free((char *)jobs[i].out_name);
+    free(jobs);
+#ifdef CC_HAVE_GLOB
+    if (is_glob)
+        globfree(&g);
+    else
+#endif
+        free(names);
+    free(data);
+    return rv;
+}
+
+
+////////////////////////  --record and --fields: de-interleave  ////////////////////////
+
+// The copied data is a sequence of records, and each field of a record goes to
+// its own output. Up to cap records at a time are split into a buffer per field,
+// one field after the other, and then the buffers are written. The common field
+// widths have loops of fixed size copies, which compilers turn into plain moves
+// (and vectorize where they can).
+
+typedef struct {
+    char *name;
+    FILE *file;
+    size_t off, len;    // in the record
+    char *buf;          // cap * len bytes
+    cc_off_t written;
+    nocache_t nc;
+} field_out_t;
+
+struct fields_s {
+    size_t size;        // of a record
+    field_out_t *outs;  // nfields, of which nouts are open
+    int nfields;
+    int nouts;
+    size_t cap;         // records per block
+    size_t nrec;        // records at the buffers
+    char *part;         // a record which didn't arrive whole yet
+    size_t part_len;
+    int nocache;
+    int failed;         // 1 + the index of the output which failed
+};
+
+// Splits n records at rec to the field buffers, n <= cap - nrec
+static void fields_split(fields_t *f, const char *rec, size_t n)
+{
+    size_t size = f->size, k;
+    int i;
+    for (i = 0; i < f->nouts; i++) {
+        field_out_t *o = &f->outs[i];
+        const char *src = rec + o->off;
+        char *dst = o->buf + f->nrec * o->len;
+        switch (o->len) {
+            case 1:  for (k = 0; k < n; k++) dst[k] = src[k * size];                  break;
+            case 2:  for (k = 0; k < n; k++) memcpy(dst + k * 2, src + k * size, 2);   break;
+            case 4:  for (k = 0; k < n; k++) memcpy(dst + k * 4, src + k * size, 4);   break;
+            case 8:  for (k = 0; k < n; k++) memcpy(dst + k * 8, src + k * size, 8);   break;
+            case 16: for (k = 0; k < n; k++) memcpy(dst + k * 16, src + k * size, 16); break;
+            default: for (k = 0; k < n; k++) memcpy(dst + k * o->len, src + k * size, o->len);
+        }
+    }
+    f->nrec += n;
+}
+
+// Writes the buffered records to the outputs. Returns 0 on error.
+static int fields_flush(fields_t *f)
+{
+    int i;
+    for (i = 0; i < f->nouts && !f->failed; i++) {
+        field_out_t *o = &f->outs[i];
+        size_t len = f->nrec * o->len;
+        if (fwrite(o->buf, 1, len, o->file) != len) {
+            f->failed = i + 1;
+            break;
+        }
+        o->written += len;
+        if (f->nocache)
+            nocache_update(&o->nc, o->file, 0, 0, o->written);
+    }
+    f->nrec = 0;
+    return !f->failed;
+}
+
+// Splits the next len bytes of the records to the outputs. Returns 0 on error.
+int fields_write(fields_t *f, const char *buf, size_t len)
+{
+    if (f->part_len) {
+        size_t n = cc_min(len, f->size - f->part_len);
+        memcpy(f->part + f->part_len, buf, n);
+        f->part_len += n;
+        buf += n;
+        len -= n;
+        if (f->part_len < f->size)
+            return 1;
+        f->part_len = 0;
+        fields_split(f, f->part, 1);
+        if (f->nrec == f->cap && !fields_flush(f))
+            return 0;
+    }
+
+    while (len >= f->size) {
+        size_t n = cc_min(len / f->size, f->cap - f->nrec);
+        fields_split(f, buf, n);
+        buf += n * f->size;
+        len -= n * f->size;
+        if (f->nrec == f->cap && !fields_flush(f))
+            return 0;
+    }
+
+    memcpy(f->part, buf, len);
+    f->part_len = len;
+    return 1;
+}
+
+const char *fields_failed(const fields_t *f)
+{
+    return f->failed ? f->outs[f->failed - 1].name : "";
+}
+
+// Creates the output of each field at opts, named by out_tmpl with {n} replaced
+// by the field number (and {} by the file name of in_name), and reserves nrec
+// records at each. Returns NULL with err set on error.
+fields_t *fields_open(const cc_opts_t *opts, const char *out_tmpl, const char *in_name,
+                      cc_off_t nrec, char *err, size_t errlen)
+{
+    int opt_verbose = opts->verbose;
+    fields_t *f = calloc(1, sizeof(*f));
+    size_t sum = 0;
+    int i;
+    if (!f || !(f->outs = calloc(opts->nfields, sizeof(field_out_t))) ||
+        !(f->part = malloc(opts->record_size)))
+    {
+        goto oom_L;
+    }
+    f->nfields = opts->nfields;
+    f->size = opts->record_size;
+    f->nocache = opts->nocache;
+    for (i = 0; i < opts->nfields; i++)
+        sum += (size_t)(opts->fields[i].to - opts->fields[i].from);
+    f->cap = cc_max(1, FIELDS_BUF / sum);
+
+    for (i = 0; i < opts->nfields; i++) {
+        field_out_t *o = &f->outs[i];
+        o->off = (size_t)opts->fields[i].from;
+        o->len = (size_t)(opts->fields[i].to - opts->fields[i].from);
+        if (!(o->buf = malloc(f->cap * o->len)) || !(o->name = each_out_name(out_tmpl, in_name, i + 1)))
+            goto oom_L;
+        if (!(o->file = open_output(o->name, opts->overwrite, err, errlen)))
+            goto fail_L;
+        f->nouts++;
+
+        if (!out_preallocate(o->file, nrec * (cc_off_t)o->len)) {
+            snprintf(err, errlen, "not enough space for the output '%s' (%lld bytes): %s",
+                     o->name, (long long)(nrec * (cc_off_t)o->len), strerror(errno));
+            goto fail_L;
+        }
+        if (f->nocache)
+            nocache_start(&o->nc, NULL, o->file);
+        VERBOSE("-   Field #%d: [%lld, %lld) of each record -> '%s'\n", i + 1,
+                (long long)o->off, (long long)(o->off + o->len), o->name);
+    }
+    return f;
+
+oom_L:
+    snprintf(err, errlen, "out of memory");
+fail_L:
+    if (f)
+        fields_close(f, 0, NULL);
+    return NULL;
+}
+
+// Writes the buffered records (unless !finish), and closes the outputs.
+// Returns 0 if an output failed, and sets *failed (if not NULL) to its name.
+int fields_close(fields_t *f, int finish, const char **failed)
+{
+    int i, ok = 1;
+    if (finish)
+        ok = fields_flush(f);
+
+    for (i = 0; i < f->nouts; i++) {
+        field_out_t *o = &f->outs[i];
+        if (finish && f->nocache && !f->failed)
+            nocache_finish(&o->nc, o->file, o->written);
+        if (fclose(o->file) && !f->failed) {
+            f->failed = i + 1;
+            ok = 0;
+        }
+    }
+    if (failed)
+        *failed = fields_failed(f);
+
+    for (i = 0; f->outs && i < f->nfields; i++) {
+        free(f->outs[i].name);
+        free(f->outs[i].buf);
+    }
+    free(f->outs);
+    free(f->part);
+    free(f);
+    return ok;
+}
+
+
+/////////////////////  --manifest: the plan instead of the data  /////////////////////
+
+// The output is a description of the data which would be copied, which
+// ccmanifest.h reads on demand from the inputs (see there for the format).
+// Ranges which continue each other at the input are one line, and generated
+// ranges are written as they are.
+
+// Writes the input line of fname, with its absolute name where possible.
+static int manifest_input(FILE *out_file, const char *fname, cc_off_t size)
+{
+    long long mtime = 0;
+    char *abs = NULL;
+#ifndef _WIN32
+    struct stat st;
+    if (!stat(fname, &st))
+        mtime = (long long)st.st_mtime;
+    abs = realpath(fname, NULL);
+#endif
+    int ok = cc_fprintf(out_file, "input\t%lld\t%lld\t%s\n", (long long)size, mtime, abs ? abs : fname) >= 0;
+    free(abs);
+    return ok;
+}
+
+// Writes the manifest of the job's ranges (out_size bytes overall) of its
+// input (in_size bytes) to out_file. Returns 1 on success, or 0 with job->err set.
+int manifest_write(job_t *job, FILE *out_file, cc_off_t in_size, cc_off_t out_size)
+{
+    int opt_verbose = job->opts->verbose;
+    range_iter_t it;
+    range_t range, cur = {0, 0};
+    cc_off_t out = 0;
+    long lines = 0;
+    int i, r;
+
+    if (cc_fprintf(out_file, "cchunks-manifest 2\nsize\t%lld\n", (long long)out_size) < 0)
+        JOB_ERR("cannot write to output file");
+    if (job->in_names) {
+        for (i = 0; i < job->nin_names; i++) {
+            if (!manifest_input(out_file, job->in_names[i], fsize(job->in_names[i])))
+                JOB_ERR("cannot write to output file");
+        }
+    } else if (!manifest_input(out_file, job->in_name, in_size)) {
+        JOB_ERR("cannot write to output file");
+    }
+
+    range_iter_init(&it, job->ranges, job->nranges, in_size);
+    do {
+        r = range_next(&it, &range);
+        if (r > 0 && !it.gen && range.from == cur.to) {
+            cur.to = range.to;  // also skips empty ranges
+            continue;
+        }
+        if (cur.to > cur.from) {
+            if (cc_fprintf(out_file, "range\t%lld\t%lld\t%lld\n",
+                           (long long)out, (long long)cur.from, (long long)(cur.to - cur.from)) < 0)
+            {
+                JOB_ERR("cannot write to output file");
+            }
+            out += cur.to - cur.from;
+            lines++;
+        }
+        cur.from = cur.to = -1;
+        if (r > 0 && !it.gen)
+            cur = range;
+
+        if (r > 0 && it.gen && range.to) {
+            int w = it.gen == GEN_HEX ? cc_fprintf(out_file, "hex\t%lld\t%.*s\n", (long long)out,
+                                                   (int)(range.to * 2), it.hex)
+                                      : cc_fprintf(out_file, "fill\t%lld\t%d\t%lld\n", (long long)out,
+                                                   it.gen == GEN_FILL ? it.fill : 0, (long long)range.to);
+            if (w < 0)
+                JOB_ERR("cannot write to output file");
+            out += range.to;
+            lines++;
+        }
+    } while (r > 0);
+    if (r < 0)
+        JOB_ERR("(Internal): range became invalid?! '%s'", job->ranges[it.i - 1]);
+
+    VERBOSE("-   Manifest: %ld ranges, %lld bytes\n", lines, (long long)out);
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+
+////////////////////  Generated ranges: zero:, fill: and hex:  ////////////////////
+
+// These ranges have no input. Zeros are skipped as a hole where the output is
+// a file of its own, and fills are set once per range in the job's buffer,
+// which is then written as many times as needed.
+
+// Returns the value of the hex digit c, or -1
+static int hex_val(char c)
+{
+    return c >= '0' && c <= '9' ? c - '0'
+         : c >= 'a' && c <= 'f' ? c - 'a' + 10
+         : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+}
+
+// Skips len zero bytes of out_file as a hole, where the engine writes. The
+// last byte is written, so the file size includes a hole at the end too.
+// Returns 1 on success, or 0 with job->err set.
+static int gen_hole(job_t *job, FILE *out_file, cc_off_t len)
+{
+    cc_off_t at = -1;
+    if (job->engine == ENGINE_STDIO) {
+        if (!fflush(out_file) && !cc_fseek(out_file, len - 1, SEEK_CUR))
+            at = cc_ftell(out_file);
+    } else {
+#ifdef CC_HAVE_PREAD
+        at = lseek(fileno(out_file), len - 1, SEEK_CUR);
+#endif
+    }
+    if (at < 0)
+        JOB_ERR("cannot seek output file");
+
+    if (!write_out(job, out_file, "", 1))
+        return 0;
+
+#if defined(CC_HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    // the output was preallocated, so the skipped blocks are still allocated.
+    // Holes are punched only up to the file size, which now includes them.
+    if (job->engine != ENGINE_STDIO || !fflush(out_file))
+        fallocate(fileno(out_file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at - (len - 1), len - 1);
+#endif
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+// Writes the range it->gen generated, len bytes, using buf (buf_size bytes).
+// If holes, big runs of zeros are skipped. Returns 1 on success, or 0 with
+// job->err set.
+int gen_write(job_t *job, FILE *out_file, char *buf, size_t buf_size, const range_iter_t *it,
+              cc_off_t len, int holes)
+{
+    const char *hex = it->hex;
+    size_t n;
+    if (it->gen == GEN_ZERO && holes && len >= GEN_HOLE_MIN)
+        return gen_hole(job, out_file, len);
+
+    if (it->gen != GEN_HEX)
+        memset(buf, it->gen == GEN_FILL ? it->fill : 0, (size_t)cc_min(len, (cc_off_t)buf_size));
+    for (; len; len -= n) {
+        n = (size_t)cc_min(len, (cc_off_t)buf_size);
+        if (it->gen == GEN_HEX) {
+            size_t i;
+            for (i = 0; i < n; i++, hex += 2)
+                buf[i] = (char)(hex_val(hex[0]) << 4 | hex_val(hex[1]));
+        }
+        if (!write_out(job, out_file, buf, n))
+            return 0;
+    }
+    return 1;
+}
+
+// Parses the generated range at str .. end (exclusive) for the range
+// iterator, with its length at out->to. Returns 1 if it is one, 0 if not, or
+// -1 if invalid.
+static int gen_parse(range_iter_t *it, const char *str, const char *end, range_t *out)
+{
+    const char *s;
+    cc_off_t val;
+    if (!strncmp(str, "zero:", 5)) {
+        it->gen = GEN_ZERO;
+        s = str + 5;
+
+    } else if (!strncmp(str, "fill:", 5)) {
+        // BYTE is 0xHH or decimal
+        const char *sep = memchr(str + 5, ':', end - str - 5);
+        it->gen = GEN_FILL;
+        if (!sep)
+            return -1;
+        if (!strncmp(str + 5, "0x", 2) || !strncmp(str + 5, "0X", 2)) {
+            if (sep - str != 9 || hex_val(str[7]) < 0 || hex_val(str[8]) < 0)
+                return -1;
+            it->fill = hex_val(str[7]) << 4 | hex_val(str[8]);
+        } else {
+            if (!atooff_fast(str + 5, (int)(sep - str - 5), 0, &val) || val > 255)
+                return -1;
+            it->fill = (int)val;
+        }
+        s = sep + 1;
+
+    } else if (!strncmp(str, "hex:", 4)) {
+        it->gen = GEN_HEX;
+        it->hex = str + 4 + (!strncmp(str + 4, "0x", 2) || !strncmp(str + 4, "0X", 2)) * 2;
+        for (s = it->hex; s < end && hex_val(*s) >= 0; s++)
+            ;
+        if (s != end || s == it->hex || (s - it->hex) % 2)
+            return -1;
+        out->from = 0;
+        out->to = (s - it->hex) / 2;
+        return 1;
+
+    } else {
+        it->gen = GEN_NONE;
+        return 0;
+    }
+
+    // [+]LENGTH
+    s += s < end && *s == '+';
+    if (!atooff_fast(s, (int)(end - s), 0, &val))
+        return -1;
+    out->from = 0;
+    out->to = val;
+    return 1;
+}
+
+
+////////////////////  Key ranges: binary search of sorted input  ////////////////////
+
+// 'key:[FROM_KEY]..[TO_KEY]' is of an input which is sorted by a key at the
+// start of each line (or at --key-at of it), or of each --record. It's from
+// the first line (record) whose key is FROM_KEY or after it, to the end of the
+// last one whose key, cut to the length of TO_KEY, is TO_KEY or before it. The
+// bounds are found by binary search over the input offsets, where each probe
+// reads forward to the next line start, and its key, so a range costs about
+// 2 * log2(IN_SIZE) small reads. Key ranges are resolved to FROM:TO before
+// the other ranges, which then see them as any other range.
+
+#define KEY_READ    4096  // bytes per read, while looking for a line end
+
+typedef struct {
+    job_t *job;
+    FILE *in_file;
+    cc_off_t size;
+    const char *key;    // and key_len bytes
+    size_t key_len;
+    int after;          // the bound is after the lines of key (TO_KEY)
+    long reads;
+    char buf[KEY_READ];
+} key_search_t;
+
+// Reads len bytes at offset at of the input, which may be concatenated or
+// decompressed. Returns 1 on success.
+static int key_read(key_search_t *k, char *buf, size_t len, cc_off_t at)
+{
+    job_t *job = k->job;
+    k->reads++;
+    if (job->zsrc)
+        return zsrc_read(job->zsrc, buf, len, at);
+    while (len) {
+        FILE *f = k->in_file;
+        cc_off_t off = at, n = (cc_off_t)len;
+        if (job->vcat) {
+            vseg_t *s = vcat_map(job->vcat, at, (cc_off_t)len, &off, &n);
+            if (!(f = s->file))
+                return 0;
+            job->vcat->pos_file = NULL;  // moved
+        }
+        if (cc_fseek(f, off, SEEK_SET) || fread(buf, 1, (size_t)n, f) != (size_t)n)
+            return 0;
+        buf += n;
+        at += n;
+        len -= (size_t)n;
+    }
+    return 1;
+}
+
+// The first line start at or after at (IN_SIZE if none), or -1 on error.
+static cc_off_t key_line_start(key_search_t *k, cc_off_t at)
+{
+    if (at == 0)
+        return 0;
+    for (at--; at < k->size;) {  // after a '\n' at at or later
+        size_t n = (size_t)cc_min(k->size - at, (cc_off_t)KEY_READ);
+        const char *nl;
+        if (!key_read(k, k->buf, n, at))
+            return -1;
+        if ((nl = memchr(k->buf, '\n', n)))
+            return at + (nl - k->buf) + 1;
+        at += n;
+    }
+    return k->size;
+}
+
+// Whether the bound is at or before the line (record) at offset at: 1 if it
+// is, 0 if not, or -1 on error.
+static int key_probe(key_search_t *k, cc_off_t at)
+{
+    cc_off_t key_at = k->job->opts->key_at;
+    size_t len = (size_t)cc_min((cc_off_t)(key_at + k->key_len), k->size - at);
+    const char *key = k->buf + key_at;
+    size_t n;
+    if (!key_read(k, k->buf, len, at))
+        return -1;
+
+    if (k->job->opts->record_size) {
+        n = k->key_len;
+    } else {
+        // up to the line end
+        const char *nl = memchr(k->buf, '\n', len);
+        len = nl ? (size_t)(nl - k->buf) : len;
+        n = len > (size_t)key_at ? cc_min(len - (size_t)key_at, k->key_len) : 0;
+    }
+
+    int c = memcmp(key, k->key, n);
+    if (!c && n < k->key_len)
+        c = -1;  // a prefix of it
+    return k->after ? c > 0 : c >= 0;
+}
+
+// Sets *out to the offset of the bound of k. Returns 1 on success, 0 on error.
+static int key_bound(key_search_t *k, cc_off_t *out)
+{
+    cc_off_t rec = k->job->opts->record_size;
+    cc_off_t lo = 0, hi, s;
+    int r;
+    if (!k->key_len) {  // from the start, or to the end
+        *out = k->after ? k->size : 0;
+        return 1;
+    }
+
+    if (rec) {
+        // the first record (index) of the bound, the tail of a partial one is after all
+        for (hi = k->size / rec; lo < hi;) {
+            cc_off_t mid = lo + (hi - lo) / 2;
+            if ((r = key_probe(k, mid * rec)) < 0)
+                return 0;
+            if (r)
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        *out = lo == k->size / rec ? k->size : lo * rec;
+        return 1;
+    }
+
+    // the first offset whose next line start is at or after the bound (IN_SIZE is)
+    for (hi = k->size; lo < hi;) {
+        cc_off_t mid = lo + (hi - lo) / 2;
+        if ((s = key_line_start(k, mid)) < 0)
+            return 0;
+        if (s == k->size) {
+            hi = mid;
+            continue;
+        }
+        if ((r = key_probe(k, s)) < 0)
+            return 0;
+        if (r)
+            hi = mid;
+        else
+            lo = s + 1;  // and the offsets up to s have this line next
+    }
+    return (*out = key_line_start(k, lo)) >= 0;
+}
+
+// Replaces the key: ranges of job->ranges with FROM:TO of the input (in_size
+// bytes), in a new array of them. Returns 1 on success, or 0 with job->err set.
+int keys_resolve(job_t *job, FILE *in_file, cc_off_t in_size)
+{
+    int opt_verbose = job->opts->verbose;
+    key_search_t *k = NULL;
+    char **ranges = NULL;
+    int i, nkeys = 0;
+    size_t strs = 0;
+    for (i = 0; i < job->nranges; i++) {
+        if (!strncmp(job->ranges[i], "key:", 4)) {
+            nkeys++;
+            strs += 48 + strlen(job->ranges[i]);  // FROM:TO and the suffix
+        }
+    }
+    if (!nkeys)
+        return 1;
+
+    // the pointers, and then the strings
+    char *str;
+    if (!(k = malloc(sizeof(*k))) ||
+        !(ranges = malloc(job->nranges * sizeof(char *) + strs)))
+    {
+        JOB_ERR("out of memory");
+    }
+    str = (char *)(ranges + job->nranges);
+    k->job = job;
+    k->in_file = in_file;
+    k->size = in_size;
+    if (job->opts->record_size && (cc_off_t)job->opts->key_at >= job->opts->record_size)
+        JOB_ERR("--key-at %lld is not within the records of %lld bytes",
+                (long long)job->opts->key_at, (long long)job->opts->record_size);
+
+    for (i = 0; i < job->nranges; i++) {
+        const char *key = job->ranges[i], *dots, *suffix;
+        cc_off_t from, to;
+        ranges[i] = job->ranges[i];
+        if (strncmp(key, "key:", 4))
+            continue;
+        // *STRIDE#COUNT or @OFFSET, as range_next finds them, are of FROM:TO
+        suffix = key + 4 + strcspn(key + 4, "*@");
+        if (!(dots = strstr(key + 4, "..")) || dots + 2 > suffix)
+            JOB_ERR("invalid range '%s' (expecting key:[FROM_KEY]..[TO_KEY])", key);
+        cc_off_t key_end = job->opts->key_at + cc_max(dots - key - 4, suffix - dots - 2);
+        if (job->opts->record_size && key_end > job->opts->record_size)
+            JOB_ERR("range '%s': the keys don't fit in the records of %lld bytes",
+                    key, (long long)job->opts->record_size);
+        if (key_end > KEY_READ)
+            JOB_ERR("range '%s': the keys (at --key-at) should be within %d bytes", key, KEY_READ);
+
+        k->reads = 0;
+        k->key = key + 4;
+        k->key_len = (size_t)(dots - key - 4);
+        k->after = 0;
+        if (!key_bound(k, &from))
+            JOB_ERR("cannot read from input file");
+        k->key = dots + 2;
+        k->key_len = (size_t)(suffix - dots - 2);
+        k->after = 1;
+        if (!key_bound(k, &to))
+            JOB_ERR("cannot read from input file");
+
+        ranges[i] = str;
+        str += sprintf(str, "%lld:%lld%s", (long long)from, (long long)cc_max(from, to), suffix) + 1;
+        VERBOSE("-   Range #%d: '%s' -> '%s' (%ld reads)\n", i + 1, key, ranges[i], k->reads);
+    }
+
+    job->ranges = ranges;
+    free(k);
+    return 1;
+
+exit_L:
+    free(ranges);
+    free(k);
+    return 0;
+}
+
+
+/////////////////////////  --in-place: cut and insert  /////////////////////////
+
+// The ranges are the new content of the file: its own data, ascending and not
+// overlapping, and generated ranges. Where the file system supports it (e.g.
+// ext4, xfs) and the cuts and inserts are whole blocks, they're done with
+// FALLOC_FL_COLLAPSE_RANGE and FALLOC_FL_INSERT_RANGE, which don't move the
+// data. Otherwise the data is shifted: pieces which move to a lower offset in
+// ascending order, and those which move higher in descending order (neither
+// can overwrite data which the other still needs).
+//
+// Either way, the edit is a sequence of steps. FILE.ccjournal has the step
+// which is in progress, synced before the step is done, and also the data of
+// a shift which overlaps itself, since it can't be done twice from the file.
+// An interrupted edit is finished by running the same command again.
+
+#ifdef CC_HAVE_PREAD
+#define IP_CHUNK    (8 * 1024 * 1024)  // bytes per shift step
+#define IP_SLOT     4096               // journal: header, then 2 slots of IP_SLOT + IP_CHUNK
+#define IP_MAGIC    0x314c4e524a4343LL // "CCJRNL1"
+
+enum {
+    IP_COLLAPSE,    // fallocate, by blocks
+    IP_SHIFT,       // pread/pwrite
+};
+
+// A piece of the new file, at offset out
+typedef struct {
+    cc_off_t out, from, len;  // from: of the file before the edit, -1 if generated
+    int gen, fill;
+    const char *hex;
+} ip_piece_t;
+
+// A cut or an insert at the file before the edit
+typedef struct {
+    cc_off_t at, len;
+    long piece;         // insert: the generated piece, else -1
+} ip_op_t;
+
+// The journal header, and the record of a step at a slot
+typedef struct {
+    int64_t magic, in_size, hash, mode;
+} ip_head_t;
+
+typedef struct {
+    int64_t k;          // the step
+    int64_t size;       // IP_COLLAPSE: the file size before it
+    int64_t dst, len;   // IP_SHIFT: the data which follows the record, if len
+    int64_t sum;        // of the record and the data
+} ip_rec_t;
+
+typedef struct {
+    job_t *job;
+    FILE *file;
+    int fd, jfd;
+    char *jname;        // FILE.ccjournal
+    ip_piece_t *pieces;
+    long npieces;
+    ip_op_t *ops;
+    long nops;
+    ip_head_t head;
+    int64_t k;          // the current step
+    ip_rec_t resume;    // resume.k: the first step which isn't done, with its data at buf
+    char *buf;          // IP_CHUNK
+} inplace_t;
+
+static uint64_t ip_fnv(uint64_t h, const void *p, size_t len)
+{
+    const unsigned char *c = p;
+    while (len--)
+        h = (h ^ *c++) * 0x100000001b3ULL;
+    return h;
+}
+
+static int64_t ip_rec_sum(const ip_rec_t *r, const char *data)
+{
+    uint64_t h = ip_fnv(0xcbf29ce484222325ULL, r, sizeof(*r) - sizeof(r->sum));  // sum is last
+    return (int64_t)ip_fnv(h, data, (size_t)r->len);
+}
+
+static int ip_pread(int fd, char *buf, size_t len, cc_off_t at)
+{
+    while (len) {
+        ssize_t n = pread(fd, buf, len, at);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 1;
+}
+
+static int ip_pwrite(int fd, const char *buf, size_t len, cc_off_t at)
+{
+    while (len) {
+        ssize_t n = pwrite(fd, buf, len, at);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 1;
+}
+
+// Syncs the directory of fname, so a file which was created there survives a crash
+static void ip_sync_dir(const char *fname)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(fname, '/');
+    if (!slash)
+        snprintf(dir, sizeof(dir), ".");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - fname + 1), fname);
+    int fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+// Starts step ip->k: unless it's done (resumed past it), records it at the
+// journal with len bytes of data at buf (to write at dst), and syncs it.
+// Returns 1 to do the step, 0 to skip it, or -1 with errno on error.
+static int ip_begin(inplace_t *ip, cc_off_t size, cc_off_t dst, const char *data, size_t len)
+{
+    ip_rec_t r = {ip->k, size, dst, (int64_t)len, 0};
+    if (ip->k++ < ip->resume.k)
+        return 0;
+    r.sum = ip_rec_sum(&r, data);
+    cc_off_t at = IP_SLOT + (r.k % 2) * (IP_SLOT + IP_CHUNK);
+    if (!ip_pwrite(ip->jfd, (const char *)&r, sizeof(r), at) ||
+        (len && !ip_pwrite(ip->jfd, data, len, at + IP_SLOT)) || fdatasync(ip->jfd))
+    {
+        return -1;
+    }
+    return 1;
+}
+
+// Reads the journal of an interrupted edit to ip->head and ip->resume (the
+// data to ip->buf). Returns 1 on success, 0 if it has no header (the edit
+// didn't start), or -1 on error.
+static int ip_journal_read(inplace_t *ip)
+{
+    int s;
+    if (!ip_pread(ip->jfd, (char *)&ip->head, sizeof(ip->head), 0) || ip->head.magic != IP_MAGIC)
+        return 0;  // the header is synced before the first step
+
+    // the valid slot of the later step. None: the first step didn't start
+    int best = -1;
+    for (s = 0; s < 2; s++) {
+        ip_rec_t r;
+        cc_off_t at = IP_SLOT + s * (IP_SLOT + IP_CHUNK);
+        if (!ip_pread(ip->jfd, (char *)&r, sizeof(r), at) || (best >= 0 && r.k < ip->resume.k) ||
+            r.len < 0 || r.len > IP_CHUNK || (r.len && !ip_pread(ip->jfd, ip->buf, (size_t)r.len, at + IP_SLOT)) ||
+            ip_rec_sum(&r, ip->buf) != r.sum)
+        {
+            continue;  // torn or older
+        }
+        ip->resume = r;
+        best = s;
+    }
+    if (best < 0)
+        memset(&ip->resume, 0, sizeof(ip->resume));
+    else if (best == 0 && ip->resume.len)  // buf has slot 1
+        return ip_pread(ip->jfd, ip->buf, (size_t)ip->resume.len, 2 * IP_SLOT) ? 1 : -1;
+    return 1;
+}
+
+// Tries a collapse and an insert of a block at the (empty) journal file
+static int ip_can_collapse(inplace_t *ip, cc_off_t blk)
+{
+#if defined(FALLOC_FL_COLLAPSE_RANGE) && defined(FALLOC_FL_INSERT_RANGE)
+    int ok = !ftruncate(ip->jfd, 2 * blk) &&
+             !fallocate(ip->jfd, FALLOC_FL_COLLAPSE_RANGE, 0, blk) &&
+             !fallocate(ip->jfd, FALLOC_FL_INSERT_RANGE, 0, blk);
+    return !ftruncate(ip->jfd, 0) && ok;
+#else
+    (void)ip;
+    (void)blk;
+    return 0;
+#endif
+}
+
+// Writes the generated piece p at offset at. Returns 1 on success, or 0 with job->err set.
+static int ip_gen(inplace_t *ip, const ip_piece_t *p, cc_off_t at)
+{
+    range_iter_t it;
+    it.gen = p->gen;
+    it.fill = p->fill;
+    it.hex = p->hex;
+    ip->job->out_at = at;
+#if defined(CC_HAVE_FALLOCATE) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (p->gen == GEN_ZERO && p->len >= GEN_HOLE_MIN &&
+        !fallocate(ip->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, p->len))
+    {
+        return 1;  // beyond the end it's a hole, or written later
+    }
+#endif
+    return gen_write(ip->job, ip->file, ip->buf, IP_CHUNK, &it, p->len, 0);
+}
+
+// Restarts the edit as IP_SHIFT, from its first step. The journal loses the
+// steps first, so if interrupted before the new header, the collapse resumes
+// from its first step (and gets here again). Returns 1 on success, or 0.
+static int ip_restart_shift(inplace_t *ip)
+{
+    ip->head.mode = IP_SHIFT;
+    ip->k = 0;
+    memset(&ip->resume, 0, sizeof(ip->resume));
+    return !ftruncate(ip->jfd, IP_SLOT) && !fsync(ip->jfd) &&
+           ip_pwrite(ip->jfd, (const char *)&ip->head, sizeof(ip->head), 0) && !fsync(ip->jfd);
+}
+
+// The edit with fallocate: the ops from the last, so the offsets of the
+// others don't change. The ops at the end are ftruncate, and keep the data
+// before them. If a cut or insert fails (FILE may not support them where the
+// journal does) before any succeeded, the data wasn't moved, and the edit
+// restarts as a shift. Returns 1 on success, -1 to shift instead, or 0 with
+// job->err set.
+static int ip_collapse(inplace_t *ip)
+{
+#if defined(FALLOC_FL_COLLAPSE_RANGE) && defined(FALLOC_FL_INSERT_RANGE)
+    job_t *job = ip->job;
+    cc_off_t size = ip->head.in_size;
+    long i;
+    int moved = 0;  // by a cut or insert, also of the run which was interrupted
+    for (i = ip->nops - 1; i >= 0; i--) {
+        const ip_op_t *op = &ip->ops[i];
+        cc_off_t after = op->piece < 0 ? size - op->len : size + op->len;
+        int at_end = op->at + (op->piece < 0 ? op->len : 0) >= size;
+        int r = ip_begin(ip, size, 0, NULL, 0);
+        if (r < 0)
+            JOB_ERR("cannot write the journal '%s': %s", ip->jname, strerror(errno));
+
+        struct stat st;
+        if (r && ip->k - 1 == ip->resume.k && !fstat(ip->fd, &st) && st.st_size == after)
+            r = 0;  // interrupted after the op, only the data is missing
+        if (r && (at_end ? ftruncate(ip->fd, after)
+                         : fallocate(ip->fd, op->piece < 0 ? FALLOC_FL_COLLAPSE_RANGE : FALLOC_FL_INSERT_RANGE,
+                                     op->at, op->len)))
+        {
+            if (!at_end && !moved) {
+                if (!ip_restart_shift(ip))
+                    JOB_ERR("cannot write the journal '%s': %s", ip->jname, strerror(errno));
+                return -1;
+            }
+            JOB_ERR("cannot %s %lld bytes at offset %lld: %s", op->piece < 0 ? "cut" : "insert",
+                    (long long)op->len, (long long)op->at, strerror(errno));
+        }
+        if (!at_end)
+            moved = 1;
+        if (ip->k - 1 >= ip->resume.k) {
+            const ip_piece_t *p = op->piece < 0 ? NULL : &ip->pieces[op->piece];
+            if ((p && p->gen != GEN_ZERO && !ip_gen(ip, p, op->at)) || fsync(ip->fd))
+                JOB_ERR("cannot write to '%s'", job->in_name);
+        }
+        size = after;
+    }
+    return 1;
+
+exit_L:
+#else
+    (void)ip;
+#endif
+    return 0;
+}
+
+// Shifts piece p by chunks, from its start if down, else from its end.
+// Returns 1 on success, or 0 with job->err set.
+static int ip_shift_piece(inplace_t *ip, const ip_piece_t *p)
+{
+    job_t *job = ip->job;
+    int down = p->out < p->from;
+    cc_off_t done;
+    for (done = 0; done < p->len; ) {
+        size_t n = (size_t)cc_min(p->len - done, (cc_off_t)IP_CHUNK);
+        cc_off_t off = down ? done : p->len - done - (cc_off_t)n;
+        cc_off_t dst = p->out + off;
+        int overlaps = (down ? p->from - p->out : p->out - p->from) < (cc_off_t)n;
+        int r;
+
+        // when resuming with the data at the journal, it's already at buf
+        if (ip->k >= ip->resume.k && !(ip->k == ip->resume.k && ip->resume.len) &&
+            !ip_pread(ip->fd, ip->buf, n, p->from + off))
+        {
+            JOB_ERR("cannot read from '%s'", job->in_name);
+        }
+        if ((r = ip_begin(ip, 0, dst, ip->buf, overlaps ? n : 0)) < 0)
+            JOB_ERR("cannot write the journal '%s': %s", ip->jname, strerror(errno));
+        if (r && (!ip_pwrite(ip->fd, ip->buf, n, dst) || fdatasync(ip->fd)))
+            JOB_ERR("cannot write to '%s'", job->in_name);
+        done += n;
+    }
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+// The edit by shifting the data. Returns 1 on success, or 0 with job->err set.
+static int ip_shift(inplace_t *ip, cc_off_t out_size)
+{
+    job_t *job = ip->job;
+    long i;
+    int r;
+    for (i = 0; i < ip->npieces; i++) {
+        if (ip->pieces[i].from >= 0 && ip->pieces[i].out < ip->pieces[i].from &&
+            !ip_shift_piece(ip, &ip->pieces[i]))
+        {
+            return 0;
+        }
+    }
+    for (i = ip->npieces - 1; i >= 0; i--) {
+        if (ip->pieces[i].from >= 0 && ip->pieces[i].out > ip->pieces[i].from &&
+            !ip_shift_piece(ip, &ip->pieces[i]))
+        {
+            return 0;
+        }
+    }
+
+    // the generated pieces may be where the data was
+    for (i = 0; i < ip->npieces; i++) {
+        const ip_piece_t *p = &ip->pieces[i];
+        if (p->from >= 0)
+            continue;
+        if ((r = ip_begin(ip, 0, 0, NULL, 0)) < 0)
+            JOB_ERR("cannot write the journal '%s': %s", ip->jname, strerror(errno));
+        if (r && (!ip_gen(ip, p, p->out) || fdatasync(ip->fd)))
+            JOB_ERR("cannot write to '%s'", job->in_name);
+    }
+
+    if ((r = ip_begin(ip, 0, 0, NULL, 0)) < 0)
+        JOB_ERR("cannot write the journal '%s': %s", ip->jname, strerror(errno));
+    if (r && (ftruncate(ip->fd, out_size) || fsync(ip->fd)))
+        JOB_ERR("cannot set the size of '%s': %s", job->in_name, strerror(errno));
+    return 1;
+
+exit_L:
+    return 0;
+}
+#endif // CC_HAVE_PREAD
+
+// Edits job->in_name in place to the content which its ranges describe.
+// Returns 1 on success, or 0 with job->err set.
+int run_in_place(job_t *job)
+{
+    int rv = 0;
+#ifdef CC_HAVE_PREAD
+    int opt_verbose = job->opts->verbose;
+    inplace_t ip;
+    memset(&ip, 0, sizeof(ip));
+    ip.job = job;
+    ip.fd = ip.jfd = -1;
+
+    range_iter_t it;
+    range_t range;
+    cc_off_t out_size = 0, prev_to = 0, blk = 0;
+    long i, cap = 64;
+    int r, resumed = 0;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    struct stat st;
+
+    if (!(ip.file = cc_fopen(job->in_name, "r+b")))
+        JOB_ERR("cannot open '%s' for writing", job->in_name);
+    ip.fd = fileno(ip.file);
+    if (fstat(ip.fd, &st) || !S_ISREG(st.st_mode))
+        JOB_ERR("'%s' is not a regular file", job->in_name);
+    if (flock(ip.fd, LOCK_EX | LOCK_NB))
+        JOB_ERR("'%s' is being edited by another cchunks", job->in_name);
+    blk = st.st_blksize > 0 ? st.st_blksize : 4096;
+    ip.pieces = malloc(cap * sizeof(*ip.pieces));
+    ip.ops = malloc((cap + 1) * sizeof(*ip.ops));  // + the cut at the end
+    if (!(ip.buf = iobuf_alloc(IP_CHUNK)) || !ip.pieces || !ip.ops)
+        JOB_ERR("out of memory");
+    job->engine = ENGINE_PREAD;  // gen_write at job->out_at
+    job->out_pos = 1;
+
+    for (i = 0; i < job->nranges; i++)
+        hash = ip_fnv(hash, job->ranges[i], strlen(job->ranges[i]) + 1);
+
+    // an interrupted edit is resumed, with the file size before it
+    if (!(ip.jname = malloc(strlen(job->in_name) + 11)))
+        JOB_ERR("out of memory");
+    sprintf(ip.jname, "%s.ccjournal", job->in_name);
+    if ((ip.jfd = open(ip.jname, O_RDWR)) >= 0 && (r = ip_journal_read(&ip))) {
+        if (r < 0)
+            JOB_ERR("cannot read the journal '%s'", ip.jname);
+        if (ip.head.hash != (int64_t)(hash ^ (uint64_t)ip.head.in_size))
+            JOB_ERR("'%s' is of an unfinished edit with other ranges, finish it first", ip.jname);
+        resumed = 1;
+        VERBOSE("- Resuming the edit of '%s' at step %lld (journal: '%s')\n",
+                job->in_name, (long long)ip.resume.k, ip.jname);
+    } else {
+        memset(&ip.head, 0, sizeof(ip.head));
+        ip.head.in_size = st.st_size;
+    }
+    VERBOSE("-   File: '%s', size: %lld\n", job->in_name, (long long)ip.head.in_size);
+
+    // the pieces, with the ops which turn the file into them
+    range_iter_init(&it, job->ranges, job->nranges, ip.head.in_size);
+    while ((r = range_next(&it, &range)) > 0) {
+        cc_off_t len = it.gen ? range.to : range.to - range.from;
+        if (it.at)
+            JOB_ERR("invalid range '%s' (@OFFSET is valid with --patch)", job->ranges[it.i - 1]);
+        if (!len)
+            continue;
+        if (!it.gen && range.from < prev_to)
+            JOB_ERR("range '%s' is before the end of the previous one, the ranges should be ascending",
+                    job->ranges[it.i - 1]);
+
+        ip_piece_t *last = ip.npieces ? &ip.pieces[ip.npieces - 1] : NULL;
+        if (!it.gen && last && last->from >= 0 && last->from + last->len == range.from) {
+            last->len += len;  // contiguous
+        } else {
+            if (ip.npieces == cap) {  // and the ops, one at most per piece
+                ip_piece_t *p = realloc(ip.pieces, cap * 2 * sizeof(*p));
+                ip_op_t *o = p ? realloc(ip.ops, (cap * 2 + 1) * sizeof(*o)) : NULL;
+                if (p)
+                    ip.pieces = p;
+                if (!o)
+                    JOB_ERR("out of memory");
+                ip.ops = o;
+                cap *= 2;
+            }
+            ip_piece_t *p = &ip.pieces[ip.npieces];
+            p->out = out_size;
+            p->from = it.gen ? -1 : range.from;
+            p->len = len;
+            p->gen = it.gen;
+            p->fill = it.fill;
+            p->hex = it.hex;
+            if (it.gen) {
+                ip.ops[ip.nops].at = prev_to;
+                ip.ops[ip.nops].len = len;
+                ip.ops[ip.nops++].piece = ip.npieces;
+            } else if (range.from > prev_to) {
+                ip.ops[ip.nops].at = prev_to;
+                ip.ops[ip.nops].len = range.from - prev_to;
+                ip.ops[ip.nops++].piece = -1;
+            }
+            ip.npieces++;
+        }
+        if (!it.gen)
+            prev_to = range.to;
+        out_size += len;
+    }
+    if (r < 0)
+        JOB_ERR("invalid range '%s'", job->ranges[it.i - 1]);
+    if (prev_to < ip.head.in_size) {
+        ip.ops[ip.nops].at = prev_to;
+        ip.ops[ip.nops].len = ip.head.in_size - prev_to;
+        ip.ops[ip.nops++].piece = -1;
+    }
+
+    // by blocks (or at the end) only
+    if (!resumed) {
+        cc_off_t size = ip.head.in_size;
+        ip.head.mode = IP_COLLAPSE;
+        for (i = ip.nops - 1; i >= 0 && ip.head.mode == IP_COLLAPSE; i--) {
+            const ip_op_t *op = &ip.ops[i];
+            if (op->at + (op->piece < 0 ? op->len : 0) < size && (op->at % blk || op->len % blk))
+                ip.head.mode = IP_SHIFT;
+            size += op->piece < 0 ? -op->len : op->len;
+        }
+    }
+    VERBOSE("- In place: %ld pieces, %ld cuts and inserts, new size: %lld\n",
+            ip.npieces, ip.nops, (long long)out_size);
+
+    if (job->opts->dummy) {
+        VERBOSE("- Done - dummy mode - skipped editing '%s'.\n", job->in_name);
+        rv = 1;
+        goto exit_L;
+    }
+    if (!ip.nops) {
+        rv = 1;  // unchanged
+        goto exit_L;
+    }
+
+    job->started = 1;
+    if (!resumed) {
+        ip.head.magic = IP_MAGIC;
+        ip.head.hash = (int64_t)(hash ^ (uint64_t)ip.head.in_size);
+        if ((ip.jfd < 0 && (ip.jfd = open(ip.jname, O_RDWR | O_CREAT, 0644)) < 0) || ftruncate(ip.jfd, 0))
+            JOB_ERR("cannot create the journal '%s'", ip.jname);
+        if (ip.head.mode == IP_COLLAPSE && !ip_can_collapse(&ip, blk))
+            ip.head.mode = IP_SHIFT;
+        if (!ip_pwrite(ip.jfd, (const char *)&ip.head, sizeof(ip.head), 0) || fsync(ip.jfd))
+            JOB_ERR("cannot write the journal '%s': %s", ip.jname, strerror(errno));
+        ip_sync_dir(ip.jname);
+    }
+    VERBOSE("-   %s\n", ip.head.mode == IP_COLLAPSE ? "Cutting and inserting whole blocks of the file system"
+                                                    : "Shifting the data");
+
+    r = ip.head.mode == IP_COLLAPSE ? ip_collapse(&ip) : 0;
+    if (r < 0)
+        VERBOSE("-   Cannot cut or insert blocks of '%s', shifting the data\n", job->in_name);
+    if (ip.head.mode == IP_SHIFT)
+        r = ip_shift(&ip, out_size);
+    if (!r)
+        goto exit_L;
+
+    // done, the journal is no longer needed
+    close(ip.jfd);
+    ip.jfd = -1;
+    if (unlink(ip.jname))
+        JOB_ERR("cannot remove the journal '%s'", ip.jname);
+    job->copied = out_size;
+    rv = 1;
+
+exit_L:
+    if (ip.jfd >= 0)
+        close(ip.jfd);
+    if (ip.file && fclose(ip.file) && rv) {
+        snprintf(job->err, sizeof(job->err), "cannot write to '%s'", job->in_name);
+        rv = 0;
+    }
+    if (ip.buf)
+        iobuf_free(ip.buf, IP_CHUNK);
+    free(ip.pieces);
+    free(ip.ops);
+    free(ip.jname);
+#else
+    snprintf(job->err, sizeof(job->err), "--in-place is not supported on this platform");
+#endif
+    return rv;
+}
+
+
+///////////////////////  --rescue: copy past read errors  ///////////////////////
+
+// A copy from failing media. A read which fails is written as zeros, and the
+// copy goes on. After the ranges, what failed is read again in halves, down
+// to RESCUE_SECTOR, so that only the sectors which fail are lost. The map
+// says which parts of the output were read (good) and which weren't (bad),
+// and is saved while copying and at the end, also of a failed copy. With an
+// existing map, the copy continues at the same output: what's good isn't
+// read again, and what's bad is tried again. The map is text:
+//
+//   cchunks-rescue 1
+//   size    OUT_SIZE
+//   +       OFFSET  LENGTH     (good)
+//   -       OFFSET  LENGTH     (bad)
+//
+// The offsets are of the output, ascending. What isn't listed wasn't read
+// yet, which includes generated ranges (they're written on every run).
+
+typedef struct {
+    cc_off_t from, to;
+    int state;
+} rescue_ext_t;
+
+typedef struct {
+    cc_off_t out, in, len;  // to read again: the input at in is the output at out
+} rescue_retry_t;
+
+struct rescue_s {
+    char *name;
+    cc_off_t size;
+    int resumed;            // the map existed
+    rescue_ext_t *ext;      // ascending, apart, and next to each other only of other states
+    long next, cap_ext;
+    rescue_retry_t *retry;
+    long nretry, cap_retry;
+    uint64_t saved_ns;
+};
+
+// The state at out, and where it ends (*end).
+static int rescue_state(const rescue_t *r, cc_off_t out, cc_off_t *end)
+{
+    long lo = 0, hi = r->next;
+    while (lo < hi) {  // the first extent which ends after out
+        long mid = (lo + hi) / 2;
+        if (r->ext[mid].to <= out)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < r->next && r->ext[lo].from <= out) {
+        *end = r->ext[lo].to;
+        return r->ext[lo].state;
+    }
+    *end = lo < r->next ? r->ext[lo].from : OFF_T_MAX;
+    return RESCUE_UNKNOWN;
+}
+
+// Sets [from, to) of the output to state. Returns 0 if out of memory.
+static int rescue_mark(rescue_t *r, cc_off_t from, cc_off_t to, int state)
+{
+    rescue_ext_t add[3];
+    long i, j, k, end, lo, hi, n = 0;
+    if (from >= to)
+        return 1;
+    for (lo = 0, hi = r->next; lo < hi;) {  // the first extent which ends after from
+        long mid = (lo + hi) / 2;
+        if (r->ext[mid].to <= from)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    i = lo;
+    for (hi = r->next; lo < hi;) {  // and the first one which starts at or after to
+        long mid = (lo + hi) / 2;
+        if (r->ext[mid].from < to)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    j = lo;
+
+    // [i, j) overlap, and are replaced with what's left of them and the new one
+    if (i < j && r->ext[i].from < from) {
+        add[n] = r->ext[i];
+        add[n++].to = from;
+    }
+    add[n].from = from;
+    add[n].to = to;
+    add[n++].state = state;
+    if (i < j && r->ext[j - 1].to > to) {
+        add[n] = r->ext[j - 1];
+        add[n++].from = to;
+    }
+    if (r->next + n - (j - i) > r->cap_ext) {
+        long cap = r->cap_ext * 2 + 64;
+        rescue_ext_t *e = realloc(r->ext, cap * sizeof(*e));
+        if (!e)
+            return 0;
+        r->ext = e;
+        r->cap_ext = cap;
+    }
+    memmove(&r->ext[i + n], &r->ext[j], (r->next - j) * sizeof(*r->ext));
+    memcpy(&r->ext[i], add, n * sizeof(*add));
+    r->next += n - (j - i);
+
+    // merge with the neighbours of the same state
+    for (k = cc_max(i - 1, 0), end = i + n; k < end && k + 1 < r->next;) {
+        if (r->ext[k].to == r->ext[k + 1].from && r->ext[k].state == r->ext[k + 1].state) {
+            r->ext[k].to = r->ext[k + 1].to;
+            memmove(&r->ext[k + 1], &r->ext[k + 2], (r->next - k - 2) * sizeof(*r->ext));
+            r->next--;
+            end--;
+        } else {
+            k++;
+        }
+    }
+    return 1;
+}
+
+// Queues [in, in + len) of the input, which is the output at out, to read
+// again. Returns 0 if out of memory.
+static int rescue_queue(rescue_t *r, cc_off_t out, cc_off_t in, cc_off_t len)
+{
+    rescue_retry_t *last = r->nretry ? &r->retry[r->nretry - 1] : NULL;
+    if (last && last->out + last->len == out && last->in + last->len == in) {
+        last->len += len;
+        return 1;
+    }
+    if (r->nretry == r->cap_retry) {
+        long cap = r->cap_retry * 2 + 64;
+        rescue_retry_t *q = realloc(r->retry, cap * sizeof(*q));
+        if (!q)
+            return 0;
+        r->retry = q;
+        r->cap_retry = cap;
+    }
+    r->retry[r->nretry].out = out;
+    r->retry[r->nretry].in = in;
+    r->retry[r->nretry++].len = len;
+    return 1;
+}
+
+// Writes the map to NAME.tmp and renames it to NAME, unless it was saved
+// less than RESCUE_SAVE_MS ago and !now. Returns 1 on success, 0 on error.
+static int rescue_save(rescue_t *r, int now)
+{
+    uint64_t t = cc_now_ns();
+    if (!now && t - r->saved_ns < (uint64_t)RESCUE_SAVE_MS * 1000000)
+        return 1;
+    r->saved_ns = t;
+
+    char *tmp = malloc(strlen(r->name) + 5);
+    FILE *f = NULL;
+    long i;
+    int ok = 0;
+    if (!tmp)
+        return 0;
+    sprintf(tmp, "%s.tmp", r->name);
+    if (!(f = cc_fopen(tmp, "wb")))
+        goto exit_L;
+    if (cc_fprintf(f, "cchunks-rescue 1\nsize\t%lld\n", (long long)r->size) < 0)
+        goto exit_L;
+    for (i = 0; i < r->next; i++) {
+        if (cc_fprintf(f, "%c\t%lld\t%lld\n", r->ext[i].state == RESCUE_GOOD ? '+' : '-',
+                       (long long)r->ext[i].from, (long long)(r->ext[i].to - r->ext[i].from)) < 0)
+        {
+            goto exit_L;
+        }
+    }
+    ok = out_sync(f, 0);  // the data, then the name
+    ok = !fclose(f) && ok;
+    f = NULL;
+#ifdef _WIN32
+    remove(r->name);  // rename doesn't replace
+#endif
+    ok = ok && !rename(tmp, r->name);
+
+exit_L:
+    if (f)
+        fclose(f);
+    free(tmp);
+    return ok;
+}
+
+// Returns the map at map_name of a copy of out_size bytes, read from the file
+// if it exists, else empty. Returns NULL with err set on error.
+rescue_t *rescue_open(const char *map_name, cc_off_t out_size, char *err, size_t errlen)
+{
+    rescue_t *r = calloc(1, sizeof(*r));
+    FILE *f = NULL;
+    char line[128];
+    long lineno = 0;
+    cc_off_t size = -1;
+    int ok = 0;
+
+    if (!r || !(r->name = malloc(strlen(map_name) + 1))) {
+        snprintf(err, errlen, "out of memory");
+        goto exit_L;
+    }
+    strcpy(r->name, map_name);
+    r->size = out_size;  // and saved_ns 0: it's saved with the first chunk
+    if (!(f = cc_fopen(map_name, "rb"))) {
+        ok = 1;  // a new copy
+        goto exit_L;
+    }
+
+    r->resumed = 1;
+    while (fgets(line, sizeof(line), f)) {
+        long long v[2];
+        char c, nl;
+        lineno++;
+        if (lineno == 1) {
+            if (strcmp(line, "cchunks-rescue 1\n"))
+                goto bad_L;
+        } else if (sscanf(line, "size\t%lld%c", v, &nl) == 2 && nl == '\n') {
+            size = v[0];
+        } else if (sscanf(line, "%c\t%lld\t%lld%c", &c, v, v + 1, &nl) == 4 && nl == '\n' &&
+                   (c == '+' || c == '-') && v[0] >= (r->next ? r->ext[r->next - 1].to : 0) &&
+                   v[1] > 0 && v[0] + v[1] <= size)
+        {
+            if (!rescue_mark(r, v[0], v[0] + v[1], c == '+' ? RESCUE_GOOD : RESCUE_BAD)) {
+                snprintf(err, errlen, "out of memory");
+                goto exit_L;
+            }
+        } else {
+            goto bad_L;
+        }
+    }
+    if (lineno == 0 || size < 0) {
+        snprintf(err, errlen, "the map '%s' is truncated", map_name);
+        goto exit_L;
+    }
+    if (size != out_size) {
+        snprintf(err, errlen, "the map '%s' is of a copy of %lld bytes, the ranges are %lld bytes",
+                 map_name, (long long)size, (long long)out_size);
+        goto exit_L;
+    }
+    ok = 1;
+    goto exit_L;
+
+bad_L:
+    snprintf(err, errlen, "'%s' is not a cchunks rescue map (line %ld)", map_name, lineno);
+exit_L:
+    if (f)
+        fclose(f);
+    if (!ok) {
+        rescue_close(r, 0);
+        return NULL;
+    }
+    return r;
+}
+
+int rescue_resumed(const rescue_t *r)
+{
+    return r->resumed;
+}
+
+// The bytes of the output which are of state.
+cc_off_t rescue_bytes(const rescue_t *r, int state)
+{
+    cc_off_t n = 0;
+    long i;
+    for (i = 0; i < r->next; i++) {
+        if (r->ext[i].state == state)
+            n += r->ext[i].to - r->ext[i].from;
+    }
+    return n;
+}
+
+// Reads up to len bytes at offset at to buf, and stops at the first error.
+// Returns the bytes which were read.
+static size_t rescue_read(job_t *job, FILE *in_file, char *buf, size_t len, cc_off_t at)
+{
+    size_t done = 0;
+#ifdef CC_HAVE_PREAD
+    while (done < len) {
+        STAT_T0();
+        ssize_t n = pread(fileno(in_file), buf + done, len - done, at + done);
+        STAT_OP(read);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+#else
+    (void)job, (void)in_file, (void)buf, (void)len, (void)at;
+#endif
+    return done;
+}
+
+// Copies len bytes of the input at offset at to the output at out: what the
+// map has as good is skipped, bad is queued to read again, and the rest is
+// read, with zeros (and queued) from where the read fails.
+// Returns 1 on success, or 0 with job->err set.
+int rescue_copy(job_t *job, FILE *in_file, FILE *out_file, char *buf, cc_off_t at, size_t len, cc_off_t out)
+{
+    int opt_verbose = job->opts->verbose;
+    rescue_t *r = job->rescue;
+    while (len) {
+        cc_off_t end;
+        int state = rescue_state(r, out, &end);
+        size_t n = (size_t)cc_min((cc_off_t)len, end - out);
+
+        if (state == RESCUE_BAD && !rescue_queue(r, out, at, n))
+            JOB_ERR("out of memory");
+        if (state == RESCUE_UNKNOWN) {
+            size_t got = rescue_read(job, in_file, buf, n, at);
+            if (got < n) {
+                VERBOSE("-   Cannot read input offset %lld, writing zeros and reading it again later\n",
+                        (long long)(at + got));
+                memset(buf + got, 0, n - got);
+            }
+            job->out_at = out;
+            if (!write_out(job, out_file, buf, n))
+                return 0;
+            if (!rescue_mark(r, out, out + got, RESCUE_GOOD) || !rescue_mark(r, out + got, out + n, RESCUE_BAD) ||
+                (got < n && !rescue_queue(r, out + got, at + got, n - got)))
+            {
+                JOB_ERR("out of memory");
+            }
+        }
+        at += n;
+        out += n;
+        len -= n;
+    }
+    job->out_at = out;
+    if (!rescue_save(r, 0))
+        JOB_ERR("cannot write the map '%s'", r->name);
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+// Reads [in, in + len) of the input again, to the output at out. Where a read
+// fails, its first half (at a RESCUE_SECTOR boundary) is read again on its
+// own, and then the rest, until a read of one sector fails and it's left bad.
+// Returns 1 on success, or 0 with job->err set.
+static int rescue_split(job_t *job, FILE *in_file, FILE *out_file, char *buf, size_t buf_size,
+                        cc_off_t out, cc_off_t in, cc_off_t len)
+{
+    rescue_t *r = job->rescue;
+    while (len) {
+        size_t n = (size_t)cc_min(len, (cc_off_t)buf_size);
+        size_t got = rescue_read(job, in_file, buf, n, in);
+        if (got) {
+            job->out_at = out;
+            if (!write_out(job, out_file, buf, got))
+                return 0;
+            if (!rescue_mark(r, out, out + got, RESCUE_GOOD))
+                JOB_ERR("out of memory");
+            out += got;
+            in += got;
+            len -= got;
+            n -= got;
+        }
+        if (!n)
+            continue;
+
+        cc_off_t sector_end = (in / RESCUE_SECTOR + 1) * RESCUE_SECTOR;
+        cc_off_t half = cc_max((in + (cc_off_t)n / 2) / RESCUE_SECTOR * RESCUE_SECTOR, sector_end) - in;
+        if (half >= (cc_off_t)n) {  // one sector, lost
+            half = cc_min(sector_end - in, len);
+        } else if (!rescue_split(job, in_file, out_file, buf, buf_size, out, in, half)) {
+            return 0;
+        }
+        out += half;
+        in += half;
+        len -= half;
+        if (!rescue_save(r, 0))
+            JOB_ERR("cannot write the map '%s'", r->name);
+    }
+    return 1;
+
+exit_L:
+    return 0;
+}
+
+// Reads again what failed, and what was bad at the map before.
+// Returns 1 on success, or 0 with job->err set.
+int rescue_retry(job_t *job, FILE *in_file, FILE *out_file, char *buf, size_t buf_size)
+{
+    int opt_verbose = job->opts->verbose;
+    rescue_t *r = job->rescue;
+    long i;
+    if (r->nretry)
+        VERBOSE("- Rescue: reading %ld areas again, in smaller reads\n", r->nretry);
+    for (i = 0; i < r->nretry; i++) {
+        const rescue_retry_t *q = &r->retry[i];
+        if (!rescue_split(job, in_file, out_file, buf, buf_size, q->out, q->in, q->len))
+            return 0;
+    }
+    r->nretry = 0;
+    VERBOSE("-   Rescue: %lld bytes are good, %lld bad\n",
+            (long long)rescue_bytes(r, RESCUE_GOOD), (long long)rescue_bytes(r, RESCUE_BAD));
+    return 1;
+}
+
+// Frees r, and saves the map first if save. Returns 0 if it couldn't be saved.
+int rescue_close(rescue_t *r, int save)
+{
+    int ok = !r || !save || rescue_save(r, 1);
+    if (r) {
+        free(r->name);
+        free(r->ext);
+        free(r->retry);
+        free(r);
+    }
+    return ok;
+}
+
+
+/////////////////////  --diff: where two files differ  /////////////////////
+
+// The output is the ranges of IN_FILE which differ from OTHER, a line each, as
+// FROM:+LENGTH, or FROM:+LENGTH@FROM with --patch (which writes them into a
+// copy of OTHER). The segments of the files are compared by threads: a chunk
+// with memcmp (which is vectorized), and then the bytes of a chunk which
+// differs. Where both files have a hole (SEEK_DATA), they're equal without
+// reading. A range is written once the segments before it are done.
+
+typedef struct {
+    range_t *ranges;    // the differences in the segment, merged by the gap
+    long n, cap;
+    cc_off_t bytes;     // which differ, without the equal ones in the gaps
+    int done;
+} diff_seg_t;
+
+typedef struct {
+    int in_fd, other_fd;
+    cc_off_t size;      // compared: the smaller of the sizes
+    cc_off_t gap;
+    diff_seg_t *segs;
+    long nsegs;
+    long next;          // the next segment to compare
+    int failed;         // errno of a read which failed
+    int stop;           // the output is done (or failed)
+    int holes;
+    cc_mutex_t lock;
+    cc_cond_t cond;     // a segment is done
+} diff_t;
+
+#ifdef CC_HAVE_PREAD
+// Adds the difference [from, to) to s, or to its last range if it's up to gap
+// before from. Returns 0 if out of memory.
+static int diff_add(diff_seg_t *s, cc_off_t from, cc_off_t to, cc_off_t gap)
+{
+    if (s->n && from - s->ranges[s->n - 1].to <= gap) {
+        s->ranges[s->n - 1].to = to;
+        return 1;
+    }
+    if (s->n == s->cap) {
+        long cap = s->cap * 2 + 64;
+        range_t *r = realloc(s->ranges, cap * sizeof(*r));
+        if (!r)
+            return 0;
+        s->ranges = r;
+        s->cap = cap;
+    }
+    s->ranges[s->n].from = from;
+    s->ranges[s->n++].to = to;
+    return 1;
+}
+
+// Where fd has data at or after at, up to end.
+static cc_off_t diff_data(int fd, cc_off_t at, cc_off_t end)
+{
+#ifdef SEEK_DATA
+    off_t d = lseek(fd, at, SEEK_DATA);
+    if (d < 0)
+        return errno == ENXIO ? end : at;  // a hole to EOF, or not supported
+    return cc_min((cc_off_t)d, end);
+#else
+    (void)fd, (void)end;
+    return at;
+#endif
+}
+
+static int diff_pread(int fd, char *buf, size_t len, cc_off_t at)
+{
+    while (len) {
+        ssize_t n = pread(fd, buf, len, at);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (!n)
+                errno = EIO;  // shorter than its size was
+            return 0;
+        }
+        buf += n;
+        len -= n;
+        at += n;
+    }
+    return 1;
+}
+
+// Compares segment k, with two buffers of DIFF_CHUNK. Returns 0 with errno set on error.
+static int diff_segment(diff_t *d, long k, char *a, char *b)
+{
+    diff_seg_t *s = &d->segs[k];
+    cc_off_t at = (cc_off_t)k * DIFF_SEG;
+    cc_off_t end = cc_min(at + DIFF_SEG, d->size);
+
+    while (at < end) {
+        if (d->holes) {
+            // zeros at both
+            cc_off_t data = cc_min(diff_data(d->in_fd, at, end), diff_data(d->other_fd, at, end));
+            if (data > at) {
+                at = data;
+                continue;
+            }
+        }
+
+        size_t n = (size_t)cc_min(end - at, (cc_off_t)DIFF_CHUNK);
+        if (!diff_pread(d->in_fd, a, n, at) || !diff_pread(d->other_fd, b, n, at))
+            return 0;
+
+        size_t i = 0, j;
+        if (!memcmp(a, b, n)) {
+            at += n;
+            continue;
+        }
+        for (;;) {
+            while (i + 64 <= n && !memcmp(a + i, b + i, 64))
+                i += 64;
+            while (i < n && a[i] == b[i])
+                i++;
+            if (i == n)
+                break;
+            for (j = i + 1; j < n && a[j] != b[j]; j++)
+                ;
+            if (!diff_add(s, at + i, at + j, d->gap)) {
+                errno = ENOMEM;
+                return 0;
+            }
+            s->bytes += j - i;
+            i = j;
+        }
+        at += n;
+    }
+    return 1;
+}
 
-        } else { // no more arguments to parse
-            break;
-        }
+static void *diff_thread(void *arg)
+{
+    diff_t *d = arg;
+    char *a = iobuf_alloc(DIFF_CHUNK), *b = iobuf_alloc(DIFF_CHUNK);
+    int err = a && b ? 0 : ENOMEM;
 
-        if (out_name)  // Once we got the output file, the rest should be ranges
+    for (;;) {
+        cc_mutex_lock(&d->lock);
+        if (err && !d->failed)
+            d->failed = err;
+        long k = d->next++;
+        if (k >= d->nsegs || d->failed || d->stop) {
+            cc_cond_broadcast(&d->cond);
+            cc_mutex_unlock(&d->lock);
             break;
-    }
-    // from here onwards, optind should point to the first range in argv
-
-    VERBOSE("- Verbose mode enabled.\n");
+        }
+        cc_mutex_unlock(&d->lock);
 
-    if (opt_overwrite)
-        VERBOSE("- Force overwrite output file if exists.\n");
+        if (!diff_segment(d, k, a, b))
+            err = errno ? errno : EIO;
 
-    if (opt_progress)
-        VERBOSE("- Progress display enabled.\n");
+        cc_mutex_lock(&d->lock);
+        if (err && !d->failed)
+            d->failed = err;
+        d->segs[k].done = 1;
+        cc_cond_broadcast(&d->cond);
+        cc_mutex_unlock(&d->lock);
+    }
 
-    if (opt_dummy)
-        VERBOSE("- Dummy mode enabled.\n");
+    if (a)
+        iobuf_free(a, DIFF_CHUNK);
+    if (b)
+        iobuf_free(b, DIFF_CHUNK);
+    return NULL;
+}
 
-    if (!in_name)
-        ERR_EXIT("missing input file name");
+// Writes r to out_file, or adds it to *last if it's up to gap after it.
+// Returns 0 on error.
+static int diff_write(const diff_t *d, FILE *out_file, int patch, range_t *last, const range_t *r, long *count)
+{
+    if (r && last->to > last->from && r->from - last->to <= d->gap) {
+        last->to = r->to;
+        return 1;
+    }
+    if (last->to > last->from) {
+        if (cc_fprintf(out_file, "%lld:+%lld", (long long)last->from, (long long)(last->to - last->from)) < 0 ||
+            (patch && cc_fprintf(out_file, "@%lld", (long long)last->from) < 0) ||
+            cc_fprintf(out_file, "\n") < 0)
+        {
+            return 0;
+        }
+        (*count)++;
+    }
+    if (r)
+        *last = *r;
+    return 1;
+}
+#endif // CC_HAVE_PREAD
 
-    if (!out_name)
-        ERR_EXIT("missing output file name");
+// Writes the ranges where job->in_name differs from opts->diff to
+// job->out_name, compared by up to nthreads threads.
+// Returns 1 on success, or 0 with job->err set.
+int run_diff(job_t *job, int nthreads)
+{
+    int rv = 0;
+#ifdef CC_HAVE_PREAD
+    int opt_verbose = job->opts->verbose;
+    const char *other_name = job->opts->diff;
+    FILE *in_file = NULL, *other_file = NULL, *out_file = NULL;
+    cc_off_t in_size, other_size, diff_bytes = 0;
+    range_t last = {0, 0};
+    long i, k, count = 0;
+    int started = 0, write_failed = 0;
 
-    if (optind == argc)
-        ERR_EXIT("no ranges defined, must have at least one range");
+    diff_t d;
+    memset(&d, 0, sizeof(d));
+    cc_mutex_init(&d.lock);
+    cc_cond_init(&d.cond);
 
-    // Input file - verify, open and read size
-    cc_off_t in_size = fsize(in_name);
-    in_file = cc_fopen(in_name, "rb");
-    if (in_size < 0 || !in_file)
-        ERR_EXIT("input file '%s' cannot be opened", in_name);
-    VERBOSE("-   Input file: '%s', size: %lld\n", in_name, (long long)in_size);
+    if (!(in_file = cc_fopen(job->in_name, "rb")) || (in_size = fsize(job->in_name)) < 0)
+        JOB_ERR("cannot open input file '%s'", job->in_name);
+    if (!(other_file = cc_fopen(other_name, "rb")) || (other_size = fsize(other_name)) < 0)
+        JOB_ERR("cannot open input file '%s'", other_name);
+    VERBOSE("- Diff: '%s' (%lld bytes) where it differs from '%s' (%lld bytes)\n",
+            job->in_name, (long long)in_size, other_name, (long long)other_size);
 
-    // verify ranges and calculate expected output size
-    cc_off_t expected_output_size = 0;
-    cc_off_t prev_to = 0;
-    for (i = optind; i < argc; i++) {
-        range_t range;
-        if (!get_range(in_size, prev_to, argv[i], &range))
-            ERR_EXIT("invalid range '%s'", argv[i]);
-        expected_output_size += range.to - range.from;
-        prev_to = range.to;
-        VERBOSE("-   Range #%d: '%s' -> [%lld, %lld) -> %lld bytes\n",
-                i - optind + 1,
-                argv[i],
-                (long long)range.from,
-                (long long)range.to,
-                (long long)(range.to - range.from)
-                );
-    }
+    d.in_fd = fileno(in_file);
+    d.other_fd = fileno(other_file);
+    d.size = cc_min(in_size, other_size);
+    d.gap = job->opts->diff_gap;
+    d.nsegs = (long)((d.size + DIFF_SEG - 1) / DIFF_SEG);
+    nthreads = (int)cc_max(cc_min((long)nthreads, d.nsegs), 1);
+#ifdef SEEK_DATA
+    struct stat st_in, st_other;
+    d.holes = !fstat(d.in_fd, &st_in) && S_ISREG(st_in.st_mode) &&
+              !fstat(d.other_fd, &st_other) && S_ISREG(st_other.st_mode);
+#endif
+    if (d.nsegs && !(d.segs = calloc(d.nsegs, sizeof(*d.segs))))
+        JOB_ERR("out of memory");
 
-    if (opt_dummy) {
-        VERBOSE("- Done - dummy mode - skipped copying %lld bytes to '%s'%s.\n",
-                (long long)expected_output_size, out_name,
-                strcmp(out_name, "-") ? "" : " (stdout)");
-        rv = 0;
+    if (job->opts->dummy) {
+        VERBOSE("- Done - dummy mode - skipped comparing %lld bytes.\n", (long long)d.size);
+        rv = 1;
         goto exit_L;
     }
+    if (!(out_file = open_output(job->out_name, job->opts->overwrite, job->err, sizeof(job->err))))
+        goto exit_L;
+    job->started = 1;
+    VERBOSE("-   Comparing %lld bytes, %ld segments, %d threads, gap: %lld\n",
+            (long long)d.size, d.nsegs, nthreads, (long long)d.gap);
 
-    // open/setup output
-    if (!strcmp(out_name, "-")) {
-        out_file = stdout;
-
-#ifdef _WIN32
-        // change stdout to binary mode, or else it messes with EOL chars
-        if (_setmode(_fileno(stdout), O_BINARY) == -1)
-            ERR_EXIT("cannot set stdout to binary mode");
+    // the segments are written in order, while the threads compare the next ones
+#ifndef CC_NO_THREADS
+    cc_thread_t *threads = calloc(nthreads, sizeof(cc_thread_t));
+    if (!threads)
+        JOB_ERR("out of memory");
+    for (i = 0; i < nthreads; i++) {
+        if (cc_thread_create(&threads[started], diff_thread, &d) == 0)
+            started++;
+    }
 #endif
+    if (!started)
+        diff_thread(&d);  // inline
 
-    } else {
-        FILE *tmp = cc_fopen(out_name, "r");
-        if (tmp) {
-            fclose(tmp);
-            if (!opt_overwrite)
-                ERR_EXIT("output file '%s' exists, use -f to force overwrite", out_name);
-        }
+    for (k = 0; k < d.nsegs && !write_failed; k++) {
+        cc_mutex_lock(&d.lock);
+        while (!d.segs[k].done && !d.failed)
+            cc_cond_wait(&d.cond, &d.lock);
+        int failed = d.failed;
+        cc_mutex_unlock(&d.lock);
+        if (failed)
+            break;
 
-        out_file = cc_fopen(out_name, "wb");
-        if (!out_file)
-            ERR_EXIT("output file '%s' cannot be created", out_name);
+        for (i = 0; i < d.segs[k].n && !write_failed; i++)
+            write_failed = !diff_write(&d, out_file, job->opts->patch, &last, &d.segs[k].ranges[i], &count);
+        diff_bytes += d.segs[k].bytes;
+        free(d.segs[k].ranges);
+        d.segs[k].ranges = NULL;
     }
 
+    cc_mutex_lock(&d.lock);
+    d.stop = 1;  // if it stopped early
+    cc_mutex_unlock(&d.lock);
+#ifndef CC_NO_THREADS
+    for (i = 0; i < started; i++)
+        cc_thread_join(threads[i]);
+    free(threads);
+#endif
+    if (write_failed)
+        JOB_ERR("cannot write to output file");
+    if (d.failed)
+        JOB_ERR("cannot compare '%s' and '%s': %s", job->in_name, other_name, strerror(d.failed));
 
-    // args are valid, input file is valid, output file created. Start copy
-    needs_usage_on_err = 0;
-    VERBOSE("- About to copy overall %lld bytes to '%s'%s ...\n",
-            (long long)expected_output_size, out_name,
-            strcmp(out_name, "-") ? "" : " (stdout)");
+    // the rest of a longer input differs
+    if (in_size > other_size) {
+        range_t tail = {other_size, in_size};
+        if (!diff_write(&d, out_file, job->opts->patch, &last, &tail, &count))
+            JOB_ERR("cannot write to output file");
+        diff_bytes += in_size - other_size;
+    }
+    if (!diff_write(&d, out_file, job->opts->patch, &last, NULL, &count))
+        JOB_ERR("cannot write to output file");
+    if (in_size < other_size)
+        VERBOSE("-   '%s' is shorter, the rest of '%s' isn't a range\n", job->in_name, other_name);
+    VERBOSE("-   %lld bytes differ, %ld ranges\n", (long long)diff_bytes, count);
+    rv = 1;
 
-    char buf[RW_BUFFSIZE];
-    cc_off_t total_processed = 0;
-    prev_to = 0;
+exit_L:
+    if (d.segs) {
+        for (k = 0; k < d.nsegs; k++)
+            free(d.segs[k].ranges);
+        free(d.segs);
+    }
+    cc_cond_destroy(&d.cond);
+    cc_mutex_destroy(&d.lock);
+    if (in_file)
+        fclose(in_file);
+    if (other_file)
+        fclose(other_file);
+    if (out_file && out_file != stdout && fclose(out_file) && rv) {
+        snprintf(job->err, sizeof(job->err), "cannot write to output file");
+        rv = 0;
+    }
+    if (out_file == stdout && fflush(stdout) && rv) {
+        snprintf(job->err, sizeof(job->err), "cannot write to stdout");
+        rv = 0;
+    }
+#else
+    snprintf(job->err, sizeof(job->err), "--diff is not supported on this platform");
+#endif
+    return rv;
+}
 
-    for (i = optind; (i < argc) && expected_output_size; i++) {
-        range_t range;
-        if (!get_range(in_size, prev_to, argv[i], &range))
-            ERR_EXIT("(Internal): range became invalid?! '%s'", argv[i]);
-        prev_to = range.to;
 
-        if (cc_fseek(in_file, range.from, SEEK_SET))
-            ERR_EXIT("cannot seek input file to offset %lld", (long long)range.from);
+////////////////////////  --follow: what's appended  ////////////////////////
 
-        cc_off_t toread = range.to - range.from;
-        while (toread) {
-            size_t single_read = (size_t)(cc_min(toread, (cc_off_t)RW_BUFFSIZE));
-            size_t got = fread(buf, 1, single_read, in_file);
-            if (ferror(in_file) || got != single_read)
-                ERR_EXIT("cannot read from input file");
+// After the ranges, what's appended to the input (after its size when the
+// ranges were resolved) is copied as it arrives, like tail -f: only the new
+// bytes each time. inotify wakes it on writes, and it also looks every
+// FOLLOW_POLL_MS (without inotify, only so). If the input gets shorter, it
+// was truncated, and is copied again from its start. If IN_FILE is then
+// another file (rotated), the rest of the old one is copied first, and then
+// the new one from its start. It stops only on errors, e.g. a closed output.
 
-            if (got != fwrite(buf, 1, got, out_file))
-                ERR_EXIT("cannot write to output file");
+#ifdef CC_HAVE_PREAD
+#define FOLLOW_EVENTS  (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
 
-            toread -= got;
-            total_processed += got;
+// Copies len bytes of the input at offset at, and flushes the output.
+// Returns 1 on success, or 0 with job->err set.
+static int follow_copy(job_t *job, FILE *in_file, FILE *out_file, char *buf, size_t chunk,
+                       cc_off_t at, cc_off_t len)
+{
+    while (len) {
+        size_t n = (size_t)cc_min(len, (cc_off_t)chunk);
+        if (!copy_chunk(job, in_file, out_file, buf, at, n))
+            return 0;
+        at += n;
+        len -= n;
+        job->copied += n;
+    }
+    if (fflush(out_file))
+        JOB_ERR("cannot write to output file");
+    return 1;
 
-            if (opt_progress) {
-                int percent = (int)((double)total_processed / expected_output_size * 100);
-                int prev_percent = (int)((double)(total_processed - got) / expected_output_size * 100);
+exit_L:
+    return 0;
+}
 
-                if (percent / PROGRESS_PER != prev_percent / PROGRESS_PER)
-                    cc_fprintf(stderr, " %d%% ", percent);
-                else if (percent / PROGRESS_DOT != prev_percent / PROGRESS_DOT)
-                    cc_fprintf(stderr, ".");
-            }
+// Waits until the input may have changed. ifd is of inotify, or -1.
+static void follow_wait(int ifd)
+{
+#ifdef CC_HAVE_INOTIFY
+    if (ifd >= 0) {
+        struct pollfd p = {ifd, POLLIN, 0};
+        char events[4096];
+        if (poll(&p, 1, FOLLOW_POLL_MS) > 0) {
+            while (read(ifd, events, sizeof(events)) > 0)
+                ;  // which doesn't matter
         }
+        return;
     }
+#endif
+    (void)ifd;
+    cc_sleep_ns((uint64_t)FOLLOW_POLL_MS * 1000000);
+}
+#endif // CC_HAVE_PREAD
 
-    if (opt_progress) {
-        if (!expected_output_size)
-            cc_fprintf(stderr, " %d%% ", 100);
-        cc_fprintf(stderr, "\n");
-    }
+// Copies what's appended to the input after offset at, until an error (which
+// could replace *in_file). Returns 0 with job->err set.
+int follow_input(job_t *job, FILE **in_file, FILE *out_file, char *buf, size_t buf_size, cc_off_t at)
+{
+#ifdef CC_HAVE_PREAD
+    int opt_verbose = job->opts->verbose;
+    size_t chunk = cc_min(buf_size, job->io_size);
+    int ifd = -1, wd = -1;
+    struct stat st, cur;
 
-    // success
-    VERBOSE("- Done.\n");
-    rv = 0;
+#ifdef CC_HAVE_INOTIFY
+    if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0 &&
+        (wd = inotify_add_watch(ifd, job->in_name, FOLLOW_EVENTS)) < 0)
+    {
+        close(ifd);
+        ifd = -1;
+    }
+#endif
+    // stdio could read a truncated input from its stale buffer
+    if (job->engine == ENGINE_STDIO)
+        job->engine = ENGINE_PREAD;
+    VERBOSE("- Following '%s' from offset %lld%s ...\n",
+            job->in_name, (long long)at, ifd >= 0 ? " (inotify)" : "");
+    if (fflush(out_file))
+        JOB_ERR("cannot write to output file");
 
-exit_L:
-    if (in_file)
-        fclose(in_file);
-    if (out_file && out_file != stdout)
-        fclose(out_file);
+    for (;;) {
+        if (fstat(fileno(*in_file), &st))
+            JOB_ERR("cannot get the size of input file '%s'", job->in_name);
+        if (st.st_size < at) {
+            cc_fprintf(stderr, "- Follow: '%s' was truncated, copying it from its start\n", job->in_name);
+            at = 0;
+        }
+        if (st.st_size > at) {
+            if (!follow_copy(job, *in_file, out_file, buf, chunk, at, st.st_size - at))
+                goto exit_L;
+            at = st.st_size;
+            continue;
+        }
 
-    if (rv && needs_usage_on_err) {
-        cc_fprintf(stderr, "\n");
-        usage();
+        // all of it was copied: if IN_FILE is another file now, it's next
+        if (!stat(job->in_name, &cur) && (cur.st_ino != st.st_ino || cur.st_dev != st.st_dev)) {
+            cc_off_t size;
+            FILE *f = open_input(job->in_name, &size);
+            if (f) {
+                cc_fprintf(stderr, "- Follow: '%s' is another file, copying it from its start\n", job->in_name);
+                if (*in_file != job->in_file)
+                    fclose(*in_file);
+                *in_file = f;
+                at = 0;
+#ifdef CC_HAVE_INOTIFY
+                if (ifd >= 0) {
+                    inotify_rm_watch(ifd, wd);
+                    wd = inotify_add_watch(ifd, job->in_name, FOLLOW_EVENTS);
+                }
+#endif
+                continue;
+            }
+        }
+        follow_wait(ifd);
     }
 
-#ifdef CC_HAVE_WIN_UTF8
-    if (g_win_utf8_enabled)
-        free_argvutf8(argc, argv);
+exit_L:
+    if (ifd >= 0)
+        close(ifd);
+    (void)wd;
+#else
+    (void)in_file, (void)out_file, (void)buf, (void)buf_size, (void)at;
+    snprintf(job->err, sizeof(job->err), "--follow is not supported on this platform");
 #endif
-
-    return rv;
+    return 0;
 }
 
 
@@ -443,21 +6998,72 @@ int atooff(const char *str, int length, int allow_neg, cc_off_t *outval)
     return 1;
 }
 
-// interpret and reads a range string into out->from and out->to by the syntax:
-// [START|+SKIP]:[END|+LENGTH] - START/END/SKIP may be negative, LENGTH may not.
-// See help() for behaviour definition.
-// Returns 1 on success or 0 on error (at which case out is undefined).
-// in_size is the input file size (for cropping or negative START/END)
-// prev_to is the previous TO value (for SKIP)
-int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
+// Same as atooff, but faster for values of up to 18 digits, which cannot
+// overflow a 64 bit cc_off_t: digits are converted 8 at a time (SWAR), and
+// only the unit multiplication is checked for overflow. Longer values, and
+// 32 bit cc_off_t, fall back to atooff.
+int atooff_fast(const char *str, int length, int allow_neg, cc_off_t *outval)
 {
-    if (!out || !str)
-        return 0;
+    static const union { uint32_t i; char c[4]; } endian = { 1 };
 
-    char *sep = strstr(str, ":");
-    if (!sep)
+    if (sizeof(cc_off_t) < 8 || !str || length <= 0 || length > 20)
+        return atooff(str, length, allow_neg, outval);
+
+    const char *s = str;
+    int n = length;
+    int is_neg = 0;
+    if (*s == '-') {
+        if (!allow_neg)
+            return 0;
+        is_neg = 1;
+        s++;
+        n--;
+    }
+
+    char suffix = 0;
+    if (n > 0 && (s[n - 1] < '0' || s[n - 1] > '9'))
+        suffix = s[--n];
+
+    if (n <= 0)
         return 0;
+    if (n > 18)
+        return atooff(str, length, allow_neg, outval);
+
+    uint64_t v = 0;
+    if (endian.c[0]) {
+        // little endian: s[0] is the low byte
+        for (; n >= 8; n -= 8, s += 8) {
+            uint64_t c;
+            memcpy(&c, s, 8);
+            if ((c & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL ||
+                ((c + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) != 0x3030303030303030ULL)
+            {
+                return 0;
+            }
+
+            c -= 0x3030303030303030ULL;
+            c = (c * 10) + (c >> 8);
+            c = (((c & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+                 (((c >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+            v = v * 100000000 + c;
+        }
+    }
 
+    for (; n; n--, s++) {
+        unsigned digit = (unsigned char)*s - '0';
+        if (digit > 9)
+            return 0;
+        v = v * 10 + digit;
+    }
+
+    *outval = is_neg ? -(cc_off_t)v : (cc_off_t)v;
+    return !suffix || apply_suffix(*outval, suffix, outval);
+}
+
+// get_range of the string str .. end (exclusive), where sep is its ':'
+static int parse_range(cc_off_t in_size, cc_off_t prev_to, const char *str, const char *sep,
+                       const char *end, range_t *out)
+{
     out->from = 0;
     if (sep != str) {
         // FROM exists
@@ -471,7 +7077,7 @@ int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
         }
 
         cc_off_t val = 0;
-        if (!atooff(str, sep - str, isfromskip || isfromback, &val))
+        if (!atooff_fast(str, sep - str, isfromskip || isfromback, &val))
             return 0;
 
         if (isfromback) {
@@ -491,7 +7097,7 @@ int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
 
     sep++; // point to TO
     out->to = in_size;
-    if (strlen(sep)) {
+    if (sep != end) {
         // TO exists
         int istoback = 0;
         int istolen = 0;
@@ -503,7 +7109,7 @@ int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
         }
 
         cc_off_t val = 0;
-        if (!atooff(sep, strlen(sep), istoback, &val))
+        if (!atooff_fast(sep, end - sep, istoback, &val))
             return 0;
 
         if (istoback) {
@@ -524,6 +7130,257 @@ int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
     return 1;
 }
 
+// interpret and reads a range string into out->from and out->to by the syntax:
+// [START|+SKIP]:[END|+LENGTH] - START/END/SKIP may be negative, LENGTH may not.
+// See help() for behaviour definition.
+// Returns 1 on success or 0 on error (at which case out is undefined).
+// in_size is the input file size (for cropping or negative START/END)
+// prev_to is the previous TO value (for SKIP)
+int get_range(cc_off_t in_size, cc_off_t prev_to, const char *str, range_t *out)
+{
+    if (!out || !str)
+        return 0;
+
+    // single pass for the separator and the end
+    const char *sep = NULL;
+    const char *end = str;
+    for (; *end; end++) {
+        if (*end == ':' && !sep)
+            sep = end;
+    }
+    if (!sep)
+        return 0;
+
+    return parse_range(in_size, prev_to, str, sep, end, out);
+}
+
+// --patch: the output offset of the range which range_next just returned, by
+// its @OFFSET: OFFSET, -OFFSET from out_size or +OFFSET (may be negative)
+// from prev_end, which is also the offset without @. Returns 0 if invalid or
+// negative.
+int range_out_at(const range_iter_t *it, cc_off_t out_size, cc_off_t prev_end, cc_off_t *out)
+{
+    const char *s = it->at;
+    if (!s) {
+        *out = prev_end;
+        return 1;
+    }
+
+    cc_off_t base = 0, val;
+    int neg = *s == '-';
+    if (neg) {
+        base = out_size;
+    } else if (*s == '+') {
+        base = prev_end;
+        neg = 1;  // +-OFFSET
+        s++;
+    }
+    if (!atooff_fast(s, (int)strlen(s), neg, &val) || !add_safe(base, val, out))
+        return 0;
+    return *out >= 0;
+}
+
+void range_iter_init(range_iter_t *it, char **ranges, int nranges, cc_off_t in_size)
+{
+    it->ranges = ranges;
+    it->nranges = nranges;
+    it->i = 0;
+    it->in_size = in_size;
+    it->prev_to = 0;
+    it->reps = 0;
+    it->nrep = 0;
+    it->gen = GEN_NONE;
+    it->at = NULL;
+}
+
+// Returns 1 with the next range at out, 0 at the end, or -1 if the range
+// it->ranges[it->i - 1] is invalid.
+// RANGE*STRIDE#COUNT is RANGE, and then COUNT - 1 repetitions of it, each
+// STRIDE bytes after the previous one (without #COUNT: up to IN_SIZE). They
+// are cropped to IN_SIZE, and stop once they start at IN_SIZE. SKIP after them
+// is relative to the TO of the last one. Generated ranges set it->gen.
+int range_next(range_iter_t *it, range_t *out)
+{
+    if (it->reps) {
+        if (it->reps > 0)
+            it->reps--;
+        it->gen = GEN_NONE;
+        it->at = NULL;
+        if (add_safe(it->rep.from, it->stride, &it->rep.from) && it->rep.from < it->in_size) {
+            if (!add_safe(it->rep.from, it->rep_len, &it->rep.to) || it->rep.to > it->in_size)
+                it->rep.to = it->in_size;
+            it->nrep++;
+            *out = it->rep;
+            it->prev_to = out->to;
+            return 1;
+        }
+        it->reps = 0;  // prev_to stays the TO of the last one
+    }
+
+    if (it->i >= it->nranges)
+        return 0;
+
+    // single pass for the separator, the repetition and the end (or @OFFSET)
+    const char *str = it->ranges[it->i++];
+    const char *sep = NULL, *star = NULL, *hash = NULL, *end;
+    it->at = NULL;
+    for (end = str; *end; end++) {
+        if (*end == ':' && !sep) {
+            sep = end;
+        } else if (*end == '*' && !star) {
+            star = end;
+        } else if (*end == '#' && star && !hash) {
+            hash = end;
+        } else if (*end == '@') {
+            it->at = end + 1;
+            break;
+        }
+    }
+
+    int gen = gen_parse(it, str, end, out);
+    it->nrep = 0;
+    if (gen)
+        return gen;
+
+    if (!sep || (star && star < sep) ||
+        !parse_range(it->in_size, it->prev_to, str, sep, star ? star : end, out))
+    {
+        return -1;
+    }
+    it->prev_to = out->to;
+    it->nrep = 0;
+
+    if (star) {
+        cc_off_t count = -1;
+        if (!atooff_fast(star + 1, (int)((hash ? hash : end) - star - 1), 0, &it->stride) ||
+            it->stride < 1 ||
+            (hash && (!atooff_fast(hash + 1, (int)(end - hash - 1), 0, &count) || count < 1)))
+        {
+            return -1;
+        }
+        it->rep = *out;
+        it->rep_len = out->to - out->from;
+        it->reps = out->from < it->in_size ? (count < 0 ? -1 : count - 1) : 0;
+    }
+    return 1;
+}
+
+#ifdef POSIX_FADV_WILLNEED
+// Advises the input at *span, if any, and empties it.
+static void prefetch_span(prefetch_t *pf, FILE *in_file, range_t *span)
+{
+    if (span->to == span->from)
+        return;
+    if (pf->vcat)
+        vcat_advise(pf->vcat, span->from, span->to - span->from, POSIX_FADV_WILLNEED);
+    else
+        posix_fadvise(fileno(in_file), span->from, span->to - span->from, POSIX_FADV_WILLNEED);
+    span->from = span->to;
+}
+#endif
+
+// If less than half of pf->depth is advised ahead of done (output bytes),
+// advises the input of the next ranges up to depth bytes ahead. Ranges which
+// are close to each other are advised together.
+void prefetch_advance(prefetch_t *pf, FILE *in_file, cc_off_t done)
+{
+#ifdef POSIX_FADV_WILLNEED
+    range_t span = {0, 0};
+    if (pf->ahead - done > pf->depth / 2)
+        return;
+
+    while (pf->ahead - done < pf->depth) {
+        if (pf->cur.from == pf->cur.to) {
+            if (range_next(&pf->it, &pf->cur) <= 0) {
+                pf->depth = 0;  // no more ranges
+                break;
+            }
+            if (pf->it.gen) {  // no input
+                pf->ahead += pf->cur.to - pf->cur.from;
+                pf->cur.from = pf->cur.to;
+            }
+            continue;
+        }
+
+        cc_off_t len = cc_min(pf->cur.to - pf->cur.from, pf->depth - (pf->ahead - done));
+        if (pf->cur.from < span.from || pf->cur.from - span.to > PREFETCH_MERGE_GAP)
+            prefetch_span(pf, in_file, &span);
+        if (span.to == span.from)
+            span.from = span.to = pf->cur.from;
+        span.to = cc_max(span.to, pf->cur.from + len);
+        pf->cur.from += len;
+        pf->ahead += len;
+    }
+    prefetch_span(pf, in_file, &span);
+#else
+    (void)in_file;
+    (void)done;
+    pf->depth = 0;
+#endif
+}
+
+// If argv[optind] is a --long option: consumes it (and its value if needed),
+// sets optarg and returns its id. Returns LOPT_NONE if it's not a long option,
+// or LOPT_UNKNOWN/LOPT_MISSING_ARG on error (optind is left at the option).
+int get_long_opt(int argc, char **argv)
+{
+    if (optind >= argc || strncmp(argv[optind], "--", 2) || !argv[optind][2])
+        return LOPT_NONE;
+
+    char *name = argv[optind] + 2;
+    char *eq = strchr(name, '=');
+    size_t len = eq ? (size_t)(eq - name) : strlen(name);
+    int i;
+
+    for (i = 0; long_opts[i].name; i++) {
+        if (strlen(long_opts[i].name) != len || strncmp(long_opts[i].name, name, len))
+            continue;
+
+        if (!long_opts[i].has_arg) {
+            if (eq)
+                return LOPT_UNKNOWN;
+            optarg = NULL;
+
+        } else if (eq) {
+            optarg = eq + 1;
+
+        } else {
+            if (optind + 1 >= argc)
+                return LOPT_MISSING_ARG;
+            optarg = argv[++optind];
+        }
+
+        optind++;
+        return long_opts[i].id;
+    }
+
+    return LOPT_UNKNOWN;
+}
+
+// Monotonic time in nanoseconds, for durations
+uint64_t cc_now_ns(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    return (uint64_t)((double)clock() * (1e9 / CLOCKS_PER_SEC));
+}
+
+void cc_sleep_ns(uint64_t ns)
+{
+#ifdef _WIN32
+    Sleep((DWORD)(ns / 1000000));
+#else
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000;
+    ts.tv_nsec = ns % 1000000000;
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+        ;
+#endif
+}
+
 // returns file size or -1 on any error
 cc_off_t fsize(const char* fname)
 {
@@ -546,10 +7403,84 @@ exit_L:
     return rv;
 }
 
+// Opens fname for reading and sets *out_size to its size. Returns NULL on error.
+// One open, and the size of regular files from one fstat, since --each and
+// --batch may open many small files.
+FILE *open_input(const char *fname, cc_off_t *out_size)
+{
+    FILE *f = cc_fopen(fname, "rb");
+    if (!f)
+        return NULL;
+
+#ifndef _WIN32
+    struct stat st;
+    if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode)) {
+        *out_size = st.st_size;
+        return f;
+    }
+#endif
+
+    // devices and others: seek to the end
+    cc_off_t size = -1;
+    if (!cc_fseek(f, 0, SEEK_END))
+        size = cc_ftell(f);
+    if (size < 0 || cc_fseek(f, 0, SEEK_SET)) {
+        fclose(f);
+        return NULL;
+    }
+    *out_size = size;
+    return f;
+}
+
+// Creates fname for writing, or returns stdout if it's '-'. Unless overwrite,
+// fails if fname exists. Returns NULL with err set on error.
+FILE *open_output(const char *fname, int overwrite, char *err, size_t errlen)
+{
+    if (!strcmp(fname, "-")) {
+#ifdef _WIN32
+        // change stdout to binary mode, or else it messes with EOL chars
+        if (_setmode(_fileno(stdout), O_BINARY) == -1) {
+            snprintf(err, errlen, "cannot set stdout to binary mode");
+            return NULL;
+        }
+#endif
+        return stdout;
+    }
+
+    FILE *f = cc_fopen(fname, "r");
+    if (f) {
+        fclose(f);
+        if (!overwrite) {
+            snprintf(err, errlen, "output file '%s' exists, use -f to force overwrite", fname);
+            return NULL;
+        }
+    }
+
+    if (!(f = cc_fopen(fname, "wb")))
+        snprintf(err, errlen, "output file '%s' cannot be created", fname);
+    return f;
+}
+
+// --patch: opens fname for writing without truncating it, or creates it.
+// Returns NULL with err set on error.
+FILE *open_patch_output(const char *fname, char *err, size_t errlen)
+{
+    FILE *f = cc_fopen(fname, "r+b");
+    if (!f && errno == ENOENT)
+        f = cc_fopen(fname, "wb");
+    if (!f)
+        snprintf(err, errlen, "output file '%s' cannot be opened for writing", fname);
+    return f;
+}
+
 void usage()
 {
     cc_fprintf(stderr, "\
-Usage:   cchunks [-hfvpd] IN_FILE -o OUT_FILE RANGE [RANGE_2 [...]]\n\
+Usage:   cchunks [-hfvpd] IN_FILE [IN_FILE_2 [...]] -o OUT_FILE RANGE [RANGE_2 [...]]\n\
+         cchunks [-fvd] [--jobs N] [--per-device N] --batch MANIFEST\n\
+         cchunks [-fvd] [--jobs N] --each LIST -o OUT_TEMPLATE RANGE [RANGE_2 [...]]\n\
+         cchunks [-vd] --in-place FILE RANGE [RANGE_2 [...]]\n\
+         cchunks [-fvd] [--jobs N] --diff OTHER IN_FILE -o OUT_FILE\n\
 Example: Copy 2KiB from offset 5KiB: cchunks infile -o outfile 5K:+2K (or 5K:7K)\n\
 Help:    cchunks -h\n\
 ");
@@ -557,8 +7488,13 @@ Help:    cchunks -h\n\
 
 void help()
 {
+    // in parts, each shorter than the 4095 bytes which C99 compilers should support
     cc_fprintf(stdout, "\
-Usage: cchunks [-hfvpd] IN_FILE -o OUT_FILE RANGE [RANGE_2 [...]]\n\
+Usage: cchunks [-hfvpd] IN_FILE [IN_FILE_2 [...]] -o OUT_FILE RANGE [RANGE_2 [...]]\n\
+       cchunks [-fvd] [--jobs N] [--per-device N] --batch MANIFEST\n\
+       cchunks [-fvd] [--jobs N] --each LIST -o OUT_TEMPLATE RANGE [RANGE_2 [...]]\n\
+       cchunks [-vd] --in-place FILE RANGE [RANGE_2 [...]]\n\
+       cchunks [-fvd] [--jobs N] --diff OTHER IN_FILE -o OUT_FILE\n\
 Copy chunks from an input file, with flexible ranges description.\n\
 Version %s\n\
 Values supported: %d bit (%lld - %lld).\n\
@@ -566,13 +7502,143 @@ Values supported: %d bit (%lld - %lld).\n\
 Example: Copy 2KiB from offset 5KiB: cchunks infile -o outfile 5K:+2K (or 5K:7K)\n\
 \n\
 If OUT_FILE is '-' (without quotes), the output will go to stdout.\n\
+Several IN_FILEs are one input: their concatenation, and IN_SIZE is the sum.\n\
+With -o OUT_FILE more than once, the same data is written to all of them.\n\
 Options:\n\
   -h   Display this help and exit.\n\
   -f   Force overwrite OUT_FILE if exists.\n\
   -v   Be verbose (to stderr).\n\
-  -p   Print progress (to stderr).\n\
+  -p   Print progress, rate and ETA (to stderr).\n\
   -d   Dummy mode: validate and resolve inputs, then exit.\n\
+  --engine NAME   How chunks are copied: stdio (default), pread, sendfile,\n\
+                  copy_file_range. The last ones are linux-only and fall back\n\
+                  to pread with files which don't support them.\n\
+  --bufsize SIZE  Copy in chunks of SIZE bytes. The default, auto, starts\n\
+                  from the block and optimal I/O sizes of the files, and for\n\
+                  big copies measures the speed of bigger/smaller sizes.\n\
+  --prefetch SIZE Ask the OS to read ahead the next ranges while copying, up\n\
+                  to SIZE bytes ahead (default: 16M, 0 disables).\n\
+  --nocache       Keep the page cache footprint flat: write back the output\n\
+                  as it's copied, and drop it and the copied input from the\n\
+                  cache (linux, or posix_fadvise and fdatasync elsewhere).\n\
+  --sync WHEN     Flush the output to the disk: none (default), end (once,\n\
+                  before the exit), or range (also after each range, so a\n\
+                  range is on the disk before the next one is written).\n\
+  --compress FMT[:LEVEL]  Compress the output as gzip (level 1-9, default 6)\n\
+                  or zstd (1-22, default 3), in blocks of 1M on all CPUs.\n\
+                  The output is multi-member gzip, or multi-frame zstd with\n\
+                  a seek table.\n\
+  --decompress    The input is gzip or zstd, and the ranges are of its\n\
+                  uncompressed data. Ranges are reached via the zstd seek\n\
+                  table or frames, or via a gzip index which is built on\n\
+                  first use and saved as IN_FILE.ccidx.\n\
+  --manifest      Write the plan of the copy to OUT_FILE instead of the data:\n\
+                  the inputs (name, size, mtime) and the ranges with their\n\
+                  output offsets, as text. ccmanifest.h reads the output\n\
+                  from the inputs on demand. See there for the format.\n\
+  --tee-lag SIZE  With several -o, how far behind the others an output may\n\
+                  fall before the copy waits for it (default: 64M).\n\
+  --max-rate SIZE Copy at most SIZE bytes per second (e.g. 20M), smoothly.\n\
+  --max-iops N    Issue at most N I/O calls per second.\n\
+                  With --batch, the limits are for all the jobs together.\n\
+  --progress-fd N Also report progress as JSON lines to file descriptor N:\n\
+                  bytes, total, percent, bytes_per_sec, avg_bytes_per_sec,\n\
+                  elapsed_sec, eta_sec (-1: unknown), state (running/done/failed).\n\
+  --stats json    Print run statistics as one JSON line per job to stderr:\n\
+                  time per phase, bytes and I/O calls per range, throughput,\n\
+                  and read/write latency p50/p99/max (p50/p99 within 2x).\n\
+\n\
+", CCVERSION, (int)sizeof(cc_off_t) * 8, (long long)OFF_T_MIN, (long long)OFF_T_MAX);
+    fputs("\
+Batch:\n\
+  --batch MANIFEST  Run the jobs at MANIFEST ('-' for stdin) in one process.\n\
+                    Each line is IN_FILE<TAB>OUT_FILE<TAB>RANGE [RANGE_2 [...]].\n\
+                    Empty lines and lines which start with '#' are ignored.\n\
+  --jobs N          Run up to N jobs concurrently (default: number of CPUs).\n\
+  --per-device N    Run up to N concurrent jobs per input device (default: no limit).\n\
+  A failed job doesn't stop the others. A report line per job is printed to\n\
+  stdout, as OK|FAIL<TAB>LINE<TAB>IN_FILE<TAB>OUT_FILE<TAB>BYTES|ERROR.\n\
+  The exit code is 0 only if all the jobs succeeded.\n\
 \n\
+Many inputs:\n\
+  --each LIST       Copy the same ranges of each file at LIST (a name per line,\n\
+                    '-' for stdin), as concurrent jobs like --batch (--jobs and\n\
+                    --per-device apply). Errors are printed to stderr.\n\
+  --each-glob PATTERN  Like --each, with the files which match PATTERN.\n\
+  If OUT_TEMPLATE has {} or {n}, each input has its own output, where {} is\n\
+  the input file name (without its directory) and {n} its number at LIST.\n\
+  Otherwise, the outputs are framed into one OUT_TEMPLATE (or stdout if '-'),\n\
+  in no particular order, each as LENGTH<TAB>IN_FILE<LF> and LENGTH bytes.\n\
+  If an input fails mid-copy, the rest of its frame is zeros.\n\
+\n\
+", stdout);
+    fputs("\
+Records:\n\
+  --record SIZE     With --fields: the copied data is records of SIZE bytes,\n\
+                    and each field of them is written to its own output.\n\
+                    With key: ranges: the input is records of SIZE bytes.\n\
+  --fields LIST     Comma separated fields of a record, each a RANGE within it,\n\
+                    e.g. '0:+8,+0:+4,16:' (SKIP is from the previous field).\n\
+                    OUT_FILE should have {n}, which is the field number (from\n\
+                    1), and the ranges should add up to whole records. All\n\
+                    the fields are split in one pass.\n\
+  --key-at OFFSET   The key of key: ranges is at OFFSET of each line or\n\
+                    record (default: 0).\n\
+\n\
+Patch:\n\
+  --patch           Write into the existing OUT_FILE (created if missing)\n\
+                    without truncating it, like dd conv=notrunc. A range may\n\
+                    be RANGE@OFFSET, which writes it at OFFSET of OUT_FILE,\n\
+                    -OFFSET from its size before the copy (@-0 appends), or\n\
+                    +OFFSET (may be negative) after the previous range. A\n\
+                    range without @ follows the previous one, from 0.\n\
+\n\
+", stdout);
+    fputs("\
+Rescue:\n\
+  --rescue MAP      Copy from failing media: what cannot be read is written\n\
+                    as zeros, and the copy goes on. What failed is then read\n\
+                    again in smaller reads, down to 4K, so only what fails is\n\
+                    lost. MAP has the good (+) and bad (-) OFFSET LENGTH of\n\
+                    OUT_FILE, and is saved while copying. With an existing\n\
+                    MAP, the copy continues: only what isn't good is read,\n\
+                    into the same OUT_FILE. Run it again to retry the bad.\n\
+\n\
+Diff:\n\
+  --diff OTHER      Write the ranges where IN_FILE differs from OTHER to\n\
+                    OUT_FILE, as FROM:+LENGTH, a line each (the rest of a\n\
+                    longer IN_FILE is a range). With --patch, they're\n\
+                    FROM:+LENGTH@FROM, so 'xargs cchunks --patch IN_FILE\n\
+                    -o OTHER < OUT_FILE' makes OTHER a copy of IN_FILE (if\n\
+                    it's not longer), in several runs if the ranges are too\n\
+                    many for one command line. The files are compared by\n\
+                    --jobs threads, and holes of both are skipped.\n\
+  --diff-gap SIZE   Differences up to SIZE bytes apart are one range\n\
+                    (default: 64).\n\
+\n\
+", stdout);
+    fputs("\
+Follow:\n\
+  --follow          After the ranges, copy what's appended to IN_FILE as it\n\
+                    arrives, like 'tail -f', until interrupted. If IN_FILE\n\
+                    gets shorter (truncated), it's copied again from its\n\
+                    start. If it's renamed and a new IN_FILE is created\n\
+                    (rotated), the rest of the old one is copied, and then\n\
+                    the new one. E.g. 'cchunks --follow log -o - -1M:'.\n\
+\n\
+In place:\n\
+  --in-place FILE   Edit FILE to be the ranges of itself, e.g. cut 100M..200M\n\
+                    with ':100M 200M:', or insert 1M of zeros at 100M with\n\
+                    ':100M zero:+1M 100M:'. The ranges of FILE should be\n\
+                    ascending and not overlap, and generated ranges are\n\
+                    inserts. Cuts and inserts of whole blocks (e.g. 4K) are\n\
+                    done without moving the data where the file system\n\
+                    supports it (linux: ext4, xfs), else the data is shifted.\n\
+                    FILE.ccjournal exists while editing: if it's still there\n\
+                    after a crash, run the same command again to finish.\n\
+\n\
+", stdout);
+    fputs("\
 Ranges:\n\
   Ranges may overlap, but will NOT be combined. Ranges are independently copied.\n\
   The output will include the ranges in the order they appear.\n\
@@ -587,7 +7653,23 @@ Ranges:\n\
   Once resolved, FROM and TO are cropped to [0 .. IN_SIZE] on each RANGE.\n\
   If FROM is omitted, 0 is used. If TO is omitted, IN_SIZE is used.\n\
   If (FROM >= TO), the range is ignored (will not reverse data).\n\
+  RANGE*STRIDE#COUNT is RANGE and then COUNT - 1 repetitions of it, each STRIDE\n\
+  bytes after the previous one, cropped to IN_SIZE. Without #COUNT, it repeats\n\
+  up to IN_SIZE. A SKIP after it is relative to the TO of its last repetition.\n\
+  Generated ranges have no input, and don't move it (SKIP is from the range\n\
+  before them): 'zero:[+]LENGTH', 'fill:BYTE:[+]LENGTH' (BYTE is 0xHH or\n\
+  0-255) and 'hex:HEX' (its bytes, e.g. hex:CAFEBABE). At an output file,\n\
+  zeros of 64K or more are a hole.\n\
+  Key ranges 'key:[FROM_KEY]..[TO_KEY]' are of an input which is sorted by a\n\
+  key at the start of each line (or --record): from the first line whose key\n\
+  is FROM_KEY or after it, to the end of the last line whose key is TO_KEY or\n\
+  before it, where a longer key which starts with TO_KEY is TO_KEY. They're\n\
+  found by binary search, with a few small reads also of a huge input. A\n\
+  *STRIDE#COUNT or @OFFSET after TO_KEY is of the range which was found, so\n\
+  the keys can't have * or @.\n\
 \n\
+", stdout);
+    fputs("\
 Sample ranges:\n\
   (up to) 200 bytes from offset 50: '50:250' or '50:+200'\n\
   The first 50 bytes of the file: '0:50' or ':50'\n\
@@ -597,5 +7679,9 @@ Sample ranges:\n\
   Take first 100 bytes, skip 2, and take another 100: '0:100 +2:+100'\n\
   The whole file: ':' or '0:-0' or '0:200 +0:' and many others.\n\
   Move the first 100 bytes to the end: '100: :100'\n\
-", CCVERSION, (int)sizeof(cc_off_t) * 8, (long long)OFF_T_MIN, (long long)OFF_T_MAX);
+  16 bytes header of each of 1000 records of 4KiB: '0:+16*4K#1000'\n\
+  Magic, the first 1M, and zeros up to 2M: 'hex:CAFEBABE :1M zero:+1048572'\n\
+  With --patch, a new header over the old one and a trailer: ':512@0 -4K:@-0'\n\
+  Lines of a log sorted by time, from 10:00 to 11:59: 'key:2024-05-01T10..2024-05-01T11'\n\
+", stdout);
 }
@@ -0,0 +1,349 @@
+/*******************************************************************************
+*  cchunks - Copy chunks from an input file, with flexible ranges description
+*  Copyright (C) 2015 Avi Halachmi
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program; if not, write to the Free Software
+*  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*******************************************************************************/
+
+// Reads the output which `cchunks --manifest` describes, from the inputs, on
+// demand. Header only: include it in one or more C files.
+//
+//   ccm_t *m = ccm_open("out.ccm", err, sizeof(err));
+//   long long n = ccm_read(m, buf, len, offset);  // like pread of the output
+//   ccm_close(m);
+//
+// The manifest is text, one record per line, with TAB separated fields:
+//
+//   cchunks-manifest 2
+//   size    OUT_SIZE
+//   input   SIZE  MTIME  NAME         (once per input file, in order)
+//   range   OUT_OFFSET  IN_OFFSET  LENGTH
+//   fill    OUT_OFFSET  BYTE  LENGTH      (LENGTH times BYTE, 0-255)
+//   hex     OUT_OFFSET  HEX               (the bytes which HEX describes)
+//
+// The inputs are one concatenated input (usually there's one), and IN_OFFSET
+// is of it. The range, fill and hex lines are in output order, back to back
+// from offset 0, and cover OUT_SIZE. MTIME is seconds since the epoch, 0 if
+// unknown. ccm_open fails if an input's size or (known) MTIME changed. Lines
+// with other keywords are ignored, for later additions which readers may skip.
+// Records which change the data raise the version: 1 had no fill and hex
+// lines, and ccm_open reads versions up to CCM_VERSION.
+//
+// A ccm_t is not thread safe. Input files are opened on first read.
+
+#ifndef CCMANIFEST_H
+#define CCMANIFEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#define CCM_VERSION 2
+
+#ifdef _WIN32
+    #define ccm_fseek _fseeki64
+#else
+    #define ccm_fseek fseeko
+#endif
+
+typedef struct {
+    char *name;
+    long long size, mtime;
+    long long start;            // at the concatenated input
+    FILE *file;                 // NULL until read
+} ccm_input_t;
+
+typedef struct {
+    long long out, in, len;
+    int fill;                   // -1: from the input at in, else the byte
+    unsigned char *data;        // hex: len bytes
+} ccm_range_t;
+
+typedef struct {
+    long long size;
+    ccm_input_t *inputs;
+    int ninputs;
+    ccm_range_t *ranges;
+    long nranges;
+} ccm_t;
+
+static inline void ccm_close(ccm_t *m)
+{
+    long i;
+    if (!m)
+        return;
+    for (i = 0; i < m->ninputs; i++) {
+        if (m->inputs[i].file)
+            fclose(m->inputs[i].file);
+        free(m->inputs[i].name);
+    }
+    free(m->inputs);
+    for (i = 0; i < m->nranges; i++)
+        free(m->ranges[i].data);
+    free(m->ranges);
+    free(m);
+}
+
+// Parses the TAB separated numbers at *s into out, and moves *s after them.
+static inline int ccm_nums(char **s, long long *out, int n)
+{
+    while (n--) {
+        char *end;
+        if (**s != '\t')
+            return 0;
+        *out++ = strtoll(*s + 1, &end, 10);
+        if (end == *s + 1)
+            return 0;
+        *s = end;
+    }
+    return 1;
+}
+
+// Returns the manifest at fname, or NULL with err set.
+static inline ccm_t *ccm_open(const char *fname, char *err, size_t errlen)
+{
+    FILE *f = fopen(fname, "rb");
+    ccm_t *m = calloc(1, sizeof(*m));
+    char *line = NULL;
+    size_t cap = 0;
+    long lineno = 0, rcap = 0;
+    int icap = 0, ok = 0;
+    long long out = 0, in_size = 0;
+
+    if (!f || !m) {
+        snprintf(err, errlen, f ? "out of memory" : "cannot open '%s'", fname);
+        goto exit_L;
+    }
+
+    for (;;) {
+        // a line of any length
+        size_t len = 0;
+        int c;
+        while ((c = getc(f)) != EOF && c != '\n') {
+            if (len + 2 > cap) {
+                char *l = realloc(line, cap = cap * 2 + 256);
+                if (!l) {
+                    snprintf(err, errlen, "out of memory");
+                    goto exit_L;
+                }
+                line = l;
+            }
+            line[len++] = (char)c;
+        }
+        if (c == EOF && !len)
+            break;
+        if (!line && !(line = malloc(cap = 256))) {
+            snprintf(err, errlen, "out of memory");
+            goto exit_L;
+        }
+        line[len] = 0;
+        lineno++;
+
+        char *s = strchr(line, '\t');
+        if (lineno == 1) {
+            char *end = line;
+            long version = 0;
+            if (!strncmp(line, "cchunks-manifest ", 17))
+                version = strtol(line + 17, &end, 10);
+            if (version < 1 || version > CCM_VERSION || *end) {
+                snprintf(err, errlen, "'%s' is not a cchunks manifest (version 1 to %d)", fname, CCM_VERSION);
+                goto exit_L;
+            }
+
+        } else if (!strncmp(line, "size\t", 5)) {
+            if (!ccm_nums(&s, &m->size, 1) || *s)
+                goto bad_L;
+
+        } else if (!strncmp(line, "input\t", 6)) {
+            long long v[2];
+            if (!ccm_nums(&s, v, 2) || *s != '\t')
+                goto bad_L;
+            if (m->ninputs == icap) {
+                ccm_input_t *in = realloc(m->inputs, (icap = icap * 2 + 4) * sizeof(*in));
+                if (!in) {
+                    snprintf(err, errlen, "out of memory");
+                    goto exit_L;
+                }
+                m->inputs = in;
+            }
+            ccm_input_t *in = &m->inputs[m->ninputs];
+            memset(in, 0, sizeof(*in));
+            in->size = v[0];
+            in->mtime = v[1];
+            in->start = m->ninputs ? in[-1].start + in[-1].size : 0;
+            if (!(in->name = malloc(strlen(s)))) {
+                snprintf(err, errlen, "out of memory");
+                goto exit_L;
+            }
+            strcpy(in->name, s + 1);
+            m->ninputs++;
+            in_size += in->size;
+
+            struct stat st;
+            if (stat(in->name, &st) || (long long)st.st_size != in->size ||
+                (in->mtime && (long long)st.st_mtime != in->mtime))
+            {
+                snprintf(err, errlen, "input '%s' is missing or was modified", in->name);
+                goto exit_L;
+            }
+
+        } else if (!strncmp(line, "range\t", 6) || !strncmp(line, "fill\t", 5) ||
+                   !strncmp(line, "hex\t", 4))
+        {
+            ccm_range_t r = {0, -1, 0, -1, NULL};
+            if (*line == 'r') {
+                if (!ccm_nums(&s, &r.out, 3) || *s || r.in < 0 || r.len <= 0 ||
+                    r.in + r.len > in_size)  // the inputs are listed first
+                {
+                    goto bad_L;
+                }
+            } else if (*line == 'f') {
+                long long v[3];
+                if (!ccm_nums(&s, v, 3) || *s || v[1] < 0 || v[1] > 255 || v[2] <= 0)
+                    goto bad_L;
+                r.out = v[0];
+                r.fill = (int)v[1];
+                r.len = v[2];
+            } else {
+                size_t i, n;
+                if (!ccm_nums(&s, &r.out, 1) || *s++ != '\t' || !(n = strlen(s)) || n % 2 ||
+                    strspn(s, "0123456789abcdefABCDEF") != n)
+                {
+                    goto bad_L;
+                }
+                if (!(r.data = malloc(n / 2))) {
+                    snprintf(err, errlen, "out of memory");
+                    goto exit_L;
+                }
+                for (i = 0; i < n / 2; i++) {
+                    unsigned v;
+                    sscanf(s + i * 2, "%2x", &v);
+                    r.data[i] = (unsigned char)v;
+                }
+                r.len = (long long)(n / 2);
+            }
+            if (r.out != out) {
+                free(r.data);
+                goto bad_L;
+            }
+            if (m->nranges == rcap) {
+                ccm_range_t *rs = realloc(m->ranges, (rcap = rcap * 2 + 64) * sizeof(*rs));
+                if (!rs) {
+                    free(r.data);
+                    snprintf(err, errlen, "out of memory");
+                    goto exit_L;
+                }
+                m->ranges = rs;
+            }
+            m->ranges[m->nranges++] = r;
+            out += r.len;
+        }
+    }
+
+    if (lineno == 0 || out != m->size) {
+        snprintf(err, errlen, "'%s' is truncated", fname);
+        goto exit_L;
+    }
+    ok = 1;
+    goto exit_L;
+
+bad_L:
+    snprintf(err, errlen, "'%s': invalid line %ld", fname, lineno);
+exit_L:
+    free(line);
+    if (f)
+        fclose(f);
+    if (!ok) {
+        ccm_close(m);
+        return NULL;
+    }
+    return m;
+}
+
+static inline long long ccm_size(const ccm_t *m)
+{
+    return m->size;
+}
+
+// Reads len bytes of the concatenated input at offset in to buf. Returns 0 on error.
+static inline int ccm_read_input(ccm_t *m, char *buf, long long len, long long in)
+{
+    int lo = 0, hi = m->ninputs - 1;
+    while (lo < hi) {  // the last input which starts at or before in
+        int mid = (lo + hi + 1) / 2;
+        if (m->inputs[mid].start <= in)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    for (; len; lo++) {
+        if (lo >= m->ninputs)
+            return 0;
+        ccm_input_t *f = &m->inputs[lo];
+        long long n = f->start + f->size - in;
+        if (n <= 0)
+            continue;
+        if (n > len)
+            n = len;
+        if (!f->file && !(f->file = fopen(f->name, "rb")))
+            return 0;
+        if (ccm_fseek(f->file, in - f->start, SEEK_SET) || fread(buf, 1, (size_t)n, f->file) != (size_t)n)
+            return 0;
+        buf += n;
+        in += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Reads up to len bytes of the output at offset to buf. Returns the bytes
+// which were read (less than len only at the end of the output), or -1 on error.
+static inline long long ccm_read(ccm_t *m, void *buf, size_t len, long long offset)
+{
+    long lo = 0, hi = m->nranges - 1;
+    long long done = 0;
+    if (offset < 0)
+        return -1;
+    while (lo < hi) {  // the range which has offset
+        long mid = (lo + hi + 1) / 2;
+        if (m->ranges[mid].out <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    for (; lo < m->nranges && done < (long long)len; lo++) {
+        const ccm_range_t *r = &m->ranges[lo];
+        long long skip = offset + done - r->out;
+        long long n = r->len - skip;
+        if (n <= 0)
+            continue;  // offset is at or after the end
+        if (n > (long long)len - done)
+            n = (long long)len - done;
+        if (r->data)
+            memcpy((char *)buf + done, r->data + skip, (size_t)n);
+        else if (r->fill >= 0)
+            memset((char *)buf + done, r->fill, (size_t)n);
+        else if (!ccm_read_input(m, (char *)buf + done, n, r->in + skip))
+            return -1;
+        done += n;
+    }
+    return done;
+}
+
+#endif // CCMANIFEST_H
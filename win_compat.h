@@ -34,6 +34,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <windows.h>  // Sleep
 
 // Some windows compilers (mingw) can support off_t, ftello, etc, but they
 // still have to map those to the actual windows API, so use this API
@@ -44,6 +47,8 @@
 #define cc_fseek     _fseeki64
 // _ftelli64 is hard to link. _telli64 + _fileno is the same, easier to link
 #define cc_ftell(fd) _telli64(_fileno(fd))
+#include <process.h>
+#define cc_getpid    _getpid
 
 #ifndef OFF_T_MIN
     #define OFF_T_MIN _I64_MIN
@@ -52,6 +57,12 @@
     #define OFF_T_MAX _I64_MAX
 #endif
 
+// No pthreads by default, so --batch jobs run one after the other.
+// mingw with winpthreads can use them: -DCC_WIN_PTHREADS
+#if !defined(CC_WIN_PTHREADS) && !defined(CC_NO_THREADS)
+    #define CC_NO_THREADS
+#endif
+
 // On non-gcc compilers (tcc, msvc), by default, embed a local getopt copy
 #if !defined(CC_GETOPT_LOCAL) && !defined(CC_GETOPT_GLOBAL) && !defined(__GNUC__)
     // if HAVE_STRING_H then it includes string.h, otherwise strings.h which is bad